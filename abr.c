@@ -0,0 +1,110 @@
+/*
+File: abr.c
+Description: adaptive bitrate selection among the variants of an HLS master playlist
+
+The throughput is estimated from the segment downloads with two
+exponentially weighted moving averages, a fast one which reacts to a drop
+and a slow one which ignores a short burst; the lower of the two is used.
+The choice of variant also looks at how much audio is buffered:
+- when the buffer runs low the lowest variant is taken at once
+- a lower variant is taken as soon as the estimate cannot sustain the current one
+- a higher variant is only taken with a healthy buffer, and not right after a switch
+*/
+
+#include <math.h>
+#include <string.h>
+
+#include "pi_radio.h"
+
+// half-lives of the averages, in seconds of downloaded media
+#define ABR_FAST_HALF_LIFE 3.0
+#define ABR_SLOW_HALF_LIFE 9.0
+// share of the estimated throughput a variant may use
+#define ABR_SAFETY_FACTOR 0.8
+// samples needed before the first decision
+#define ABR_MIN_SAMPLES 2
+// segments played from a variant before switching up again
+#define ABR_HOLD_SEGMENTS 3
+// samples shorter than this say more about latency than about throughput
+#define ABR_MIN_SAMPLE_BYTES 16000
+
+// ==============================================================
+
+void abr_init (struct abr *abr, int variant_count, int current)
+{
+memset (abr, 0, sizeof (*abr));
+abr->variant_count = variant_count;
+abr->current = current;
+} // abr_init()
+
+static void ewma_add (double *estimate, double *weight, double half_life, double duration, double value)
+// duration is the weight of this sample; the estimate is corrected for its zero start
+{
+double alpha = pow (0.5, duration / half_life);
+*estimate = alpha * *estimate + (1 - alpha) * value;
+*weight = alpha * *weight + (1 - alpha);
+} // ewma_add()
+
+void abr_add_sample (struct abr *abr, int64_t bytes, int64_t us, double duration)
+/* one segment of duration seconds took us microseconds to download bytes */
+{
+if (bytes < ABR_MIN_SAMPLE_BYTES || us <= 0)
+  return;
+double bps = bytes * 8.0 * 1000000.0 / us;
+if (duration <= 0)
+  duration = 1;
+ewma_add (&abr->fast, &abr->fast_weight, ABR_FAST_HALF_LIFE, duration, bps);
+ewma_add (&abr->slow, &abr->slow_weight, ABR_SLOW_HALF_LIFE, duration, bps);
+abr->samples++;
+abr->segments_since_switch++;
+} // abr_add_sample()
+
+long abr_estimate (struct abr *abr)
+// estimated throughput in bits per second, 0 if not known yet
+{
+if (abr->samples == 0)
+  return 0;
+double fast = abr->fast / abr->fast_weight;
+double slow = abr->slow / abr->slow_weight;
+return (long) (fast < slow ? fast : slow);
+} // abr_estimate()
+
+// ==============================================================
+
+int abr_select (struct abr *abr, const struct m3u8_variant *variants, int buffered_ms, int segment_ms)
+/* return the variant which the next segments should come from
+the caller switches when it differs from abr->current and then calls abr_switched() */
+{
+int i;
+int lowest = 0;
+for (i = 1; i < abr->variant_count; i++)
+  if (variants[i].bandwidth < variants[lowest].bandwidth)
+    lowest = i;
+if (abr->samples < ABR_MIN_SAMPLES)
+  return abr->current;
+// panic: less than one segment of audio left
+if (buffered_ms < segment_ms)
+  return lowest;
+
+// the highest variant the estimate can sustain
+long budget = (long) (abr_estimate (abr) * ABR_SAFETY_FACTOR);
+int best = lowest;
+for (i = 0; i < abr->variant_count; i++)
+  if (variants[i].bandwidth <= budget && variants[i].bandwidth > variants[best].bandwidth)
+    best = i;
+
+long current_bandwidth = variants[abr->current].bandwidth;
+if (variants[best].bandwidth < current_bandwidth)
+  return best;
+// switch up only with at least 2 segments buffered and a settled estimate
+if (variants[best].bandwidth > current_bandwidth &&
+    buffered_ms >= 2 * segment_ms && abr->segments_since_switch >= ABR_HOLD_SEGMENTS)
+  return best;
+return abr->current;
+} // abr_select()
+
+void abr_switched (struct abr *abr, int variant)
+{
+abr->current = variant;
+abr->segments_since_switch = 0;
+} // abr_switched()
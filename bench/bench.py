@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""
+File: bench/bench.py
+Description: offline benchmark of pi_radio (make bench)
+
+Each scenario starts hls_server.py with its network conditions, plays its
+stream with pi_radio into the null audio sink for a fixed time, and
+reports
+  time to first audio, inter-segment gaps, underruns  (from pi_radio -S)
+  CPU time and peak RSS                              (from wait4())
+The results are printed as a table and, with --json, saved for comparing
+two builds.
+"""
+
+import argparse
+import json
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+# name, path, server options
+SCENARIOS = [
+    ("icecast-mp3", "/icecast.mp3", []),
+    ("hls-lan", "/hls/master.m3u8", []),
+    ("hls-congested", "/hls/master.m3u8", ["--latency", "150", "--jitter", "300", "--bandwidth", "160"]),
+    ("hls-media-only", "/hls/128/live.m3u8", ["--latency", "50", "--jitter", "50"]),
+]
+
+
+def wait_for_port(port, timeout):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        try:
+            socket.create_connection(("127.0.0.1", port), 0.2).close()
+            return True
+        except OSError:
+            time.sleep(0.2)
+    return False
+
+
+def read_stats(filename):
+    stats = {}
+    try:
+        with open(filename) as f:
+            for line in f:
+                key, _, value = line.strip().partition("=")
+                if key:
+                    stats[key] = int(value)
+    except (OSError, ValueError):
+        pass
+    return stats
+
+
+def run_scenario(args, name, path, server_options):
+    server = subprocess.Popen([sys.executable, os.path.join(HERE, "hls_server.py"),
+                               "--port", str(args.port), "--media-dir", args.media_dir] + server_options,
+                              stdout=subprocess.DEVNULL)
+    try:
+        # the first start generates the media, which takes a while
+        if not wait_for_port(args.port, 120):
+            sys.exit("ERROR: hls_server.py does not start")
+        with tempfile.NamedTemporaryFile(suffix=".stats", delete=False) as f:
+            stats_file = f.name
+        player = subprocess.Popen([args.player, "-d", args.device, "-L", args.profile, "-t", str(args.seconds),
+                                   "-S", stats_file, "http://127.0.0.1:%d%s" % (args.port, path)],
+                                  stderr=subprocess.DEVNULL)
+        _, status, rusage = os.wait4(player.pid, 0)
+        player.returncode = os.waitstatus_to_exitcode(status)
+        result = read_stats(stats_file)
+        os.unlink(stats_file)
+    finally:
+        server.terminate()
+        server.wait()
+    result["exit_code"] = player.returncode
+    result["cpu_ms"] = int((rusage.ru_utime + rusage.ru_stime) * 1000)
+    result["cpu_percent"] = round(100.0 * (rusage.ru_utime + rusage.ru_stime) / args.seconds, 1)
+    result["max_rss_kb"] = rusage.ru_maxrss
+    return result
+
+
+COLUMNS = [
+    ("scenario", "scenario"),
+    ("first audio ms", "time_to_first_audio_ms"),
+    ("gap mean ms", "segment_gap_mean_ms"),
+    ("gap max ms", "segment_gap_max_ms"),
+    ("ring underruns", "pcm_ring_underruns"),
+    ("sink underruns", "sink_underruns"),
+    ("CPU ms", "cpu_ms"),
+    ("CPU %", "cpu_percent"),
+    ("peak RSS kB", "max_rss_kb"),
+]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="offline benchmark of pi_radio")
+    parser.add_argument("player", nargs="?", default="./pi_radio")
+    parser.add_argument("--seconds", type=int, default=30, help="playing time of each scenario")
+    parser.add_argument("--port", type=int, default=8765)
+    parser.add_argument("--device", default="null", help="audio sink of pi_radio (-d)")
+    parser.add_argument("--profile", default="default", help="buffer profile of the audio sink (-L)")
+    parser.add_argument("--media-dir", default=os.path.join(HERE, "media"))
+    parser.add_argument("--only", help="run the scenarios whose name contains this")
+    parser.add_argument("--json", help="also write the results to this file")
+    args = parser.parse_args()
+
+    results = []
+    for name, path, server_options in SCENARIOS:
+        if args.only and args.only not in name:
+            continue
+        print("running %s for %d s ..." % (name, args.seconds), file=sys.stderr, flush=True)
+        result = run_scenario(args, name, path, server_options)
+        result["scenario"] = name
+        results.append(result)
+
+    widths = [max(len(title), 14) for title, _ in COLUMNS]
+    widths[0] = max(len(r["scenario"]) for r in results + [{"scenario": "scenario"}])
+    print("  ".join(title.rjust(w) for (title, _), w in zip(COLUMNS, widths)))
+    for r in results:
+        print("  ".join(str(r.get(key, "-")).rjust(w) for (_, key), w in zip(COLUMNS, widths)))
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(results, f, indent=2)
+    # a player which crashed or never played is a failed benchmark
+    if any(r["exit_code"] != 0 or r.get("time_to_first_audio_ms", -1) < 0 for r in results):
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,109 @@
+/*
+File: bench/dsp_bench.c
+Description: throughput of the dsp.c kernels on one core (make dsp_bench)
+
+Each set of kernels the CPU runs (scalar, then NEON or SSE2, then AVX2) is
+timed on a buffer of 1024 frames, a playback period, which stays in the L1
+cache so that the numbers are those of the arithmetic, not of the memory.
+The results are printed in millions of samples per second and in how many
+48 kHz stereo streams one core could process at that rate; every output
+is also compared with that of the scalar kernels.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "../pi_radio.h"
+
+#define FRAMES 1024
+#define SAMPLES (2 * FRAMES)
+#define RUN_SECONDS 0.5
+
+static int16_t pcm[SAMPLES], from[SAMPLES], out[SAMPLES];
+static int16_t reference[6][SAMPLES];
+static float fbuf[SAMPLES], left[FRAMES], right[FRAMES];
+
+static double now (void)
+{
+struct timespec ts;
+clock_gettime (CLOCK_MONOTONIC, &ts);
+return ts.tv_sec + ts.tv_nsec / 1e9;
+} // now()
+
+static void fill (void)
+// a loud sine on the left, noise on the right, the same every time
+{
+uint32_t seed = 1;
+int i;
+for (i = 0; i < FRAMES; i++) {
+  seed = seed * 1664525 + 1013904223;
+  pcm[2 * i] = (int16_t) (30000 * sinf (i * 0.0627f));
+  pcm[2 * i + 1] = (int16_t) (seed >> 16);
+  from[2 * i] = pcm[2 * i + 1];
+  from[2 * i + 1] = pcm[2 * i];
+  left[i] = pcm[2 * i] / 32768.0f;
+  right[i] = pcm[2 * i + 1] / 32768.0f * 1.2f; // some out of range
+  }
+} // fill()
+
+static void run (int kernel)
+{
+switch (kernel) {
+  case 0: dsp_s16_to_float (pcm, fbuf, SAMPLES); break;
+  case 1: dsp_float_to_s16 (fbuf, out, SAMPLES); break;
+  case 2: dsp_interleave (left, right, out, FRAMES); break;
+  case 3: memcpy (out, pcm, sizeof (out)); dsp_gain (out, FRAMES, 0.7f); break;
+  case 4: memcpy (out, pcm, sizeof (out)); dsp_downmix_mono (out, FRAMES); break;
+  case 5: memcpy (out, pcm, sizeof (out)); dsp_crossfade (out, from, FRAMES, 100, 4 * FRAMES); break;
+  }
+} // run()
+
+static int max_diff (const int16_t *a, const int16_t *b)
+{
+int i, d = 0;
+for (i = 0; i < SAMPLES; i++)
+  if (abs (a[i] - b[i]) > d)
+    d = abs (a[i] - b[i]);
+return d;
+} // max_diff()
+
+int main (int argc, char **argv)
+{
+static const char *names[] = { "s16_to_float", "float_to_s16", "interleave", "gain+dither", "downmix_mono", "crossfade" };
+static const char *sets[] = { "scalar", "neon", "sse2", "avx2" };
+int s, k;
+fill ();
+printf ("%-8s %-14s %10s %12s %9s\n", "kernels", "kernel", "Msample/s", "48k streams", "max diff");
+for (s = 0; s < 4; s++) {
+  if (dsp_init (sets[s]) != 0)
+    continue;
+  for (k = 0; k < 6; k++) {
+    long n = 0;
+    double start = now (), elapsed;
+    fill ();
+    dsp_s16_to_float (pcm, fbuf, SAMPLES);
+    do {
+      int i;
+      for (i = 0; i < 256; i++)
+        run (k);
+      n += 256;
+      } while ((elapsed = now () - start) < RUN_SECONDS);
+    // the output of a single run, to compare with the scalar one
+    dsp_init (sets[s]); // the dither from its start
+    fill ();
+    dsp_s16_to_float (pcm, fbuf, SAMPLES);
+    run (k);
+    if (k == 0)
+      dsp_float_to_s16 (fbuf, out, SAMPLES);
+    if (s == 0)
+      memcpy (reference[k], out, sizeof (out));
+    double rate = n * (double) SAMPLES / elapsed;
+    printf ("%-8s %-14s %10.1f %12.0f %9d\n", sets[s], names[k], rate / 1e6, rate / (2 * 48000.0),
+      max_diff (reference[k], out));
+    }
+  }
+return 0;
+} // main()
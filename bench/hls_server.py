@@ -0,0 +1,205 @@
+#!/usr/bin/env python3
+"""
+File: bench/hls_server.py
+Description: local stand-in for the radio hosts, used by bench.py
+
+It serves
+  /icecast.mp3         an endless MP3 stream paced in real time (Icecast style)
+  /hls/master.m3u8     an HLS master playlist with one variant per bitrate
+  /hls/<kbps>/live.m3u8  a live media playlist sliding forward with the clock
+  /hls/<kbps>/<seq>.ts   the TS segments, looped from the generated ones
+
+The media is generated once with the ffmpeg command line tool (a sine tone)
+into --media-dir. Every response can be delayed (--latency, --jitter) and
+its body throttled (--bandwidth) to mimic a congested link.
+"""
+
+import argparse
+import math
+import os
+import random
+import re
+import subprocess
+import sys
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+SEGMENT_SECONDS = 4
+LIVE_WINDOW = 6          # segments listed in the live playlist
+MEDIA_SECONDS = 60       # length of the generated media, looped
+MP3_KBPS = 128
+HLS_KBPS = (64, 128)
+CHUNK = 4096
+
+
+def generate_media(media_dir):
+    """create the MP3 file and the TS segments of each variant unless they exist"""
+    tone = "sine=frequency=440:sample_rate=44100:duration=%d" % MEDIA_SECONDS
+    mp3 = os.path.join(media_dir, "stream.mp3")
+    jobs = []
+    if not os.path.exists(mp3):
+        jobs.append(["-f", "lavfi", "-i", tone, "-ac", "2", "-c:a", "libmp3lame",
+                     "-b:a", "%dk" % MP3_KBPS, mp3])
+    for kbps in HLS_KBPS:
+        d = os.path.join(media_dir, str(kbps))
+        if os.path.exists(os.path.join(d, "index.m3u8")):
+            continue
+        os.makedirs(d, exist_ok=True)
+        jobs.append(["-f", "lavfi", "-i", tone, "-ac", "2", "-c:a", "aac", "-b:a", "%dk" % kbps,
+                     "-f", "hls", "-hls_time", str(SEGMENT_SECONDS), "-hls_list_size", "0",
+                     "-hls_segment_filename", os.path.join(d, "seg%03d.ts"),
+                     os.path.join(d, "index.m3u8")])
+    for args in jobs:
+        try:
+            subprocess.run(["ffmpeg", "-hide_banner", "-loglevel", "error", "-y"] + args, check=True)
+        except FileNotFoundError:
+            sys.exit("ERROR: the ffmpeg command is needed to generate the media in %s" % media_dir)
+
+
+def load_segments(media_dir, kbps):
+    """return [(duration, bytes)] of the segments listed in the generated playlist"""
+    d = os.path.join(media_dir, str(kbps))
+    segments = []
+    duration = SEGMENT_SECONDS
+    with open(os.path.join(d, "index.m3u8")) as f:
+        for line in f:
+            line = line.strip()
+            m = re.match(r"#EXTINF:([0-9.]+)", line)
+            if m:
+                duration = float(m.group(1))
+            elif line and not line.startswith("#"):
+                with open(os.path.join(d, line), "rb") as seg:
+                    segments.append((duration, seg.read()))
+    return segments
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"   # keep-alive, as the CDNs do
+
+    def log_message(self, format, *args):
+        if self.server.options.verbose:
+            BaseHTTPRequestHandler.log_message(self, format, *args)
+
+    def network_delay(self):
+        o = self.server.options
+        delay = o.latency + random.uniform(0, o.jitter)
+        if delay > 0:
+            time.sleep(delay / 1000.0)
+
+    def send_body(self, data, content_type):
+        self.send_response(200)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.write_throttled(data)
+
+    def write_throttled(self, data):
+        """write at most --bandwidth kbit/s (0 for no limit)"""
+        bandwidth = self.server.options.bandwidth
+        start = time.monotonic()
+        sent = 0
+        for i in range(0, len(data), CHUNK):
+            self.wfile.write(data[i:i + CHUNK])
+            sent += len(data[i:i + CHUNK])
+            if bandwidth > 0:
+                ahead = sent * 8 / (bandwidth * 1000.0) - (time.monotonic() - start)
+                if ahead > 0:
+                    time.sleep(ahead)
+
+    def do_GET(self):
+        self.network_delay()
+        path = self.path.split("?")[0]
+        try:
+            if path == "/icecast.mp3":
+                return self.icecast()
+            if path == "/hls/master.m3u8":
+                return self.master()
+            m = re.match(r"^/hls/(\d+)/live\.m3u8$", path)
+            if m and int(m.group(1)) in self.server.segments:
+                return self.media_playlist(int(m.group(1)))
+            m = re.match(r"^/hls/(\d+)/(\d+)\.ts$", path)
+            if m and int(m.group(1)) in self.server.segments:
+                return self.segment(int(m.group(1)), int(m.group(2)))
+        except (BrokenPipeError, ConnectionResetError):
+            return
+        self.send_error(404)
+
+    def icecast(self):
+        """the MP3 file in a loop, paced at its bitrate like a live encoder"""
+        self.send_response(200)
+        self.send_header("Content-Type", "audio/mpeg")
+        self.send_header("Connection", "close")
+        self.end_headers()
+        self.close_connection = True
+        data = self.server.mp3
+        start = time.monotonic()
+        sent = 0
+        # a burst of a few seconds first, as Icecast servers send from their queue
+        burst = MP3_KBPS * 1000 // 8 * 4
+        while True:
+            for i in range(0, len(data), CHUNK):
+                self.wfile.write(data[i:i + CHUNK])
+                sent += len(data[i:i + CHUNK])
+                ahead = (sent - burst) * 8 / (MP3_KBPS * 1000.0) - (time.monotonic() - start)
+                if ahead > 0:
+                    time.sleep(ahead)
+
+    def master(self):
+        lines = ["#EXTM3U"]
+        for kbps in HLS_KBPS:
+            lines.append('#EXT-X-STREAM-INF:BANDWIDTH=%d,CODECS="mp4a.40.2"' % (kbps * 1000 + 10000))
+            lines.append("%d/live.m3u8" % kbps)
+        self.send_body(("\n".join(lines) + "\n").encode(), "application/vnd.apple.mpegurl")
+
+    def media_playlist(self, kbps):
+        """a live window which gains a segment every SEGMENT_SECONDS"""
+        last = LIVE_WINDOW + int((time.monotonic() - self.server.start) / SEGMENT_SECONDS)
+        first = last - LIVE_WINDOW + 1
+        segments = self.server.segments[kbps]
+        lines = ["#EXTM3U", "#EXT-X-VERSION:3",
+                 "#EXT-X-TARGETDURATION:%d" % math.ceil(max(d for d, _ in segments)),
+                 "#EXT-X-MEDIA-SEQUENCE:%d" % first]
+        for seq in range(first, last + 1):
+            if seq % len(segments) == 0 and seq != 0:
+                lines.append("#EXT-X-DISCONTINUITY")   # the media loops
+            lines.append("#EXTINF:%.3f," % segments[seq % len(segments)][0])
+            lines.append("%d.ts" % seq)
+        self.send_body(("\n".join(lines) + "\n").encode(), "application/vnd.apple.mpegurl")
+
+    def segment(self, kbps, seq):
+        segments = self.server.segments[kbps]
+        self.send_body(segments[seq % len(segments)][1], "video/MP2T")
+
+
+class Server(ThreadingHTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+
+def main():
+    parser = argparse.ArgumentParser(description="local HLS / Icecast server for the pi_radio benchmark")
+    parser.add_argument("--port", type=int, default=8765)
+    parser.add_argument("--media-dir", default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "media"))
+    parser.add_argument("--latency", type=float, default=0, help="delay before each response in ms")
+    parser.add_argument("--jitter", type=float, default=0, help="random extra delay up to this many ms")
+    parser.add_argument("--bandwidth", type=float, default=0, help="kbit/s per response, 0 for no limit")
+    parser.add_argument("--verbose", action="store_true")
+    options = parser.parse_args()
+
+    os.makedirs(options.media_dir, exist_ok=True)
+    generate_media(options.media_dir)
+    server = Server(("127.0.0.1", options.port), Handler)
+    server.options = options
+    server.start = time.monotonic()
+    with open(os.path.join(options.media_dir, "stream.mp3"), "rb") as f:
+        server.mp3 = f.read()
+    server.segments = {kbps: load_segments(options.media_dir, kbps) for kbps in HLS_KBPS}
+    print("serving on http://127.0.0.1:%d/" % options.port, flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,177 @@
+/*
+File: control.c
+Description: the control socket of the daemon mode (-C)
+
+A thread accepts the connections on a local UNIX stream socket and reads
+one command line from each. The command is carried out by the main thread
+when its event loop calls control_poll() (the thread wakes it up with
+fetch_wakeup()), and the reply is written back before the connection is
+closed, e.g.
+  echo "play http://stm.rthk.hk/radio1" | socat - UNIX-CONNECT:/tmp/pi_radio.sock
+The commands themselves are up to the handler given to control_open();
+its notify function is called from the control thread as soon as a
+command comes, to make the main thread let go of whatever it waits for.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "pi_radio.h"
+
+#define CONTROL_COMMAND_MAX 2100
+#define CONTROL_REPLY_MAX 4096
+// a client which does not send its line within this time is dropped
+#define CONTROL_READ_TIMEOUT_S 5
+
+static int listen_fd = -1;
+static char socket_path[108];
+static pthread_t control_thread;
+static control_fn command_handler;
+static control_notify_fn command_notify;
+
+// the command handed to the main thread, guarded by lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replied = PTHREAD_COND_INITIALIZER;
+static char command[CONTROL_COMMAND_MAX];
+static char reply[CONTROL_REPLY_MAX];
+static int pending;      // command waits for control_poll()
+static int closing;
+
+// ==============================================================
+
+static int read_line (int fd, char *line, size_t size)
+// read up to the first newline (or the end of the input); return -1 on error
+{
+size_t len = 0;
+while (len < size - 1) {
+  ssize_t n = read (fd, line + len, size - 1 - len);
+  if (n < 0 && errno == EINTR)
+    continue;
+  if (n < 0)
+    return -1;
+  if (n == 0)
+    break;
+  len += n;
+  if (memchr (line + len - n, '\n', n))
+    break;
+  }
+line[len] = '\0';
+char *nl = strchr (line, '\n');
+if (nl)
+  *nl = '\0';
+str_trim (line);
+return 0;
+} // read_line()
+
+static void *control_thread_main (void *arg)
+{
+char line[CONTROL_COMMAND_MAX];
+struct timeval tv = { CONTROL_READ_TIMEOUT_S, 0 };
+while (1) {
+  int fd = accept (listen_fd, NULL, NULL);
+  if (fd < 0) {
+    if (errno == EINTR || errno == ECONNABORTED)
+      continue;
+    break; // control_close() shut the socket down
+    }
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  if (read_line (fd, line, sizeof (line)) != 0 || line[0] == '\0') {
+    close (fd);
+    continue;
+    }
+  pi_radio_log ("control command \"%s\"\n", line);
+  pthread_mutex_lock (&lock);
+  strcpy (command, line);
+  reply[0] = '\0';
+  pending = 1;
+  if (command_notify)
+    command_notify (command);
+  fetch_wakeup ();
+  while (pending && !closing)
+    pthread_cond_wait (&replied, &lock);
+  strcpy (line, reply);
+  pthread_mutex_unlock (&lock);
+  // the client may be gone already: no SIGPIPE
+  send (fd, line, strlen (line), MSG_NOSIGNAL);
+  close (fd);
+  }
+return NULL;
+} // control_thread_main()
+
+// ==============================================================
+
+int control_open (const char *path, control_fn handler, control_notify_fn notify)
+// listen on the UNIX socket path; handler runs the commands in control_poll()
+{
+struct sockaddr_un addr;
+if (strlen (path) >= sizeof (addr.sun_path)) {
+  pi_radio_log ("ERROR: the control socket path \"%s\" is too long\n", path);
+  return -1;
+  }
+memset (&addr, 0, sizeof (addr));
+addr.sun_family = AF_UNIX;
+strcpy (addr.sun_path, path);
+if ((listen_fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0) {
+  pi_radio_log ("ERROR: socket() fails (%s)\n", strerror (errno));
+  return -1;
+  }
+unlink (path); // left by a daemon which did not exit cleanly
+if (bind (listen_fd, (struct sockaddr *) &addr, sizeof (addr)) != 0 || listen (listen_fd, 4) != 0) {
+  pi_radio_log ("ERROR: cannot listen on \"%s\" (%s)\n", path, strerror (errno));
+  close (listen_fd);
+  listen_fd = -1;
+  return -1;
+  }
+strcpy (socket_path, path);
+command_handler = handler;
+command_notify = notify;
+int err = pthread_create (&control_thread, NULL, control_thread_main, NULL);
+if (err != 0) {
+  pi_radio_log ("ERROR: pthread_create() fails (%s)\n", strerror (err));
+  close (listen_fd);
+  listen_fd = -1;
+  unlink (path);
+  return -1;
+  }
+pthread_detach (control_thread);
+pi_radio_log ("listening for commands on \"%s\"\n", path);
+return 0;
+} // control_open()
+
+void control_poll (void)
+// main thread: run the command received, if any, and hand its reply back
+{
+pthread_mutex_lock (&lock);
+if (!pending) {
+  pthread_mutex_unlock (&lock);
+  return;
+  }
+pthread_mutex_unlock (&lock);
+// command is not touched by the control thread until pending is cleared
+command_handler (command, reply, sizeof (reply));
+pthread_mutex_lock (&lock);
+pending = 0;
+pthread_cond_signal (&replied);
+pthread_mutex_unlock (&lock);
+} // control_poll()
+
+void control_close (void)
+/* at exit: stop listening and remove the socket file
+the thread is not waited for, as it may be reading a slow client */
+{
+if (listen_fd < 0)
+  return;
+pthread_mutex_lock (&lock);
+closing = 1;
+pthread_cond_signal (&replied);
+pthread_mutex_unlock (&lock);
+shutdown (listen_fd, SHUT_RDWR); // accept() returns
+unlink (socket_path);
+listen_fd = -1;
+} // control_close()
@@ -0,0 +1,249 @@
+/*
+File: decode_pool.c
+Description: worker threads decoding complete HLS segments in parallel
+
+When several downloaded segments wait behind the one being played (after a
+stall, or when a reload brings more than one), the player thread hands them
+to this pool instead of decoding them one after the other. Each worker has
+its own decoder and decodes a whole segment into a PCM buffer; the player
+writes the buffers to the PCM ring in media sequence order.
+
+AAC frames overlap, so a decoder starting cold on a segment would not give
+the samples a sequential decode gives. A worker first decodes the last
+DECODE_PRIME_FRAMES ADTS frames of the previous segment and throws their
+output away; the job also returns the last frames of its own segment so
+that the player can prime its decoder the same way for what follows.
+
+A worker's decoder goes from one station (or variant) to another, so unless
+the job follows the segment the worker decoded last it is reset before the
+priming: nothing of the codec, parser or resampler state of unrelated audio
+carries over.
+
+When the stream is resampled, a job ends by draining the frames the
+resampler holds back into its PCM, and the next one starts the resampler
+afresh. No frame is lost at the segment boundary, but the samples there are
+not those of a sequential decode: the output is bit-exact only without swr
+(stereo at the rate of the ring).
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pi_radio.h"
+
+#define DECODE_MAX_WORKERS 8
+
+struct decode_worker {
+  pthread_t thread;
+  struct ffmpeg_decoder *dec;
+  struct ts_demux demux;
+  struct adts_tail prime;
+  struct decode_job *job;
+  int priming;                // the output is thrown away
+  // the segment decoded last, which the decoder state follows
+  const struct station *last_station;
+  int last_sequence;
+};
+
+static struct decode_worker workers[DECODE_MAX_WORKERS];
+static int worker_count;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static struct decode_job *job_head, *job_tail;
+static int pool_closing;
+
+// ==============================================================
+
+static void adts_tail_add (struct adts_tail *tail, const uint8_t *frame, size_t size)
+// keep frame as the newest of the last DECODE_PRIME_FRAMES
+{
+if (size > ADTS_FRAME_MAX)
+  return;
+if (tail->count == DECODE_PRIME_FRAMES) {
+  memmove (tail->frames[0], tail->frames[1], sizeof (tail->frames[0]) * (DECODE_PRIME_FRAMES - 1));
+  memmove (tail->size, tail->size + 1, sizeof (tail->size[0]) * (DECODE_PRIME_FRAMES - 1));
+  tail->count--;
+  }
+memcpy (tail->frames[tail->count], frame, size);
+tail->size[tail->count++] = size;
+} // adts_tail_add()
+
+static int tail_frame (const uint8_t *frame, size_t size, int64_t pts, void *userdata)
+// ts_frame_callback_t collecting the end of the previous segment
+{
+adts_tail_add (userdata, frame, size);
+return 0;
+} // tail_frame()
+
+static int job_pcm (const uint8_t *pcm, int frames, void *userdata)
+// pcm_callback_t of the workers
+{
+struct decode_worker *w = userdata;
+if (w->priming)
+  return 0;
+return mem_buffer_append (&w->job->pcm, pcm, (size_t) frames * PCM_FRAME_BYTES);
+} // job_pcm()
+
+static int job_frame (const uint8_t *frame, size_t size, int64_t pts, void *userdata)
+// ts_frame_callback_t of the segment being decoded
+{
+struct decode_worker *w = userdata;
+adts_tail_add (&w->job->tail, frame, size);
+return ffmpeg_decoder_decode_adts (w->dec, frame, size, job_pcm, w);
+} // job_frame()
+
+static void decode_job_run (struct decode_worker *w, struct decode_job *job)
+{
+int i;
+w->job = job;
+ffmpeg_decoder_set_output_rate (w->dec, job->rate);
+job->pcm.size = 0;
+job->tail.count = 0;
+// a job which follows the previous one of the worker goes on from its state
+w->prime.count = 0;
+int follows = job->prev && !job->prev->failed && !job->seg->discontinuity &&
+  w->last_station == job->prev->station && w->last_sequence == job->prev->media_sequence;
+w->last_station = job->seg->station;
+w->last_sequence = job->seg->media_sequence;
+if (!follows) {
+  ffmpeg_decoder_reset (w->dec);
+  // prime with the end of the previous segment
+  if (job->prev && !job->prev->failed) {
+    ts_demux_init (&w->demux, tail_frame, &w->prime);
+    ts_demux_feed (&w->demux, job->prev->data.data, job->prev->data.size);
+    if (w->demux.unsupported)
+      w->prime.count = 0;
+    }
+  }
+w->priming = 1;
+for (i = 0; i < w->prime.count; i++)
+  ffmpeg_decoder_decode_adts (w->dec, w->prime.frames[i], w->prime.size[i], job_pcm, w);
+// what the resampler holds back of the priming is not of this segment either
+if (w->prime.count > 0)
+  ffmpeg_decoder_drain (w->dec, job_pcm, w);
+w->priming = 0;
+
+ts_demux_init (&w->demux, job_frame, w);
+job->result = ts_demux_feed (&w->demux, job->seg->data.data, job->seg->data.size);
+if (w->demux.unsupported || w->demux.audio_pid < 0) {
+  // not ADTS AAC: libavformat decodes the whole segment, without priming
+  job->pcm.size = 0;
+  job->tail.count = 0;
+  job->result = ffmpeg_decoder_decode_buffer (w->dec, job->seg->data.data, job->seg->data.size, job_pcm, w);
+  }
+// the resampler's delay belongs to this segment: the worker may take another station next
+int err = ffmpeg_decoder_drain (w->dec, job_pcm, w);
+if (job->result >= 0 && err < 0)
+  job->result = err;
+} // decode_job_run()
+
+static void *decode_worker_main (void *arg)
+{
+struct decode_worker *w = arg;
+while (1) {
+  pthread_mutex_lock (&pool_lock);
+  while (job_head == NULL && !pool_closing)
+    pthread_cond_wait (&pool_work, &pool_lock);
+  struct decode_job *job = job_head;
+  if (job == NULL) {
+    pthread_mutex_unlock (&pool_lock);
+    break;
+    }
+  if ((job_head = job->next) == NULL)
+    job_tail = NULL;
+  pthread_mutex_unlock (&pool_lock);
+
+  decode_job_run (w, job);
+
+  pthread_mutex_lock (&pool_lock);
+  job->done = 1;
+  pthread_cond_broadcast (&pool_done);
+  pthread_mutex_unlock (&pool_lock);
+  }
+return NULL;
+} // decode_worker_main()
+
+// ==============================================================
+
+int decode_pool_start (int count)
+// start count workers; with 0 the player decodes every segment itself
+{
+int err;
+if (count > DECODE_MAX_WORKERS)
+  count = DECODE_MAX_WORKERS;
+for (worker_count = 0; worker_count < count; worker_count++) {
+  struct decode_worker *w = &workers[worker_count];
+  if ((w->dec = ffmpeg_decoder_new ()) == NULL) {
+    pi_radio_log ("ERROR: ffmpeg_decoder_new() fails\n");
+    return -1;
+    }
+  if ((err = pthread_create (&w->thread, NULL, decode_worker_main, w)) != 0) {
+    pi_radio_log ("ERROR: pthread_create() fails (%s)\n", strerror (err));
+    ffmpeg_decoder_free (w->dec);
+    return -1;
+    }
+  }
+pi_radio_log ("%d decode workers started\n", worker_count);
+return 0;
+} // decode_pool_start()
+
+int decode_pool_workers (void)
+{
+return worker_count;
+} // decode_pool_workers()
+
+void decode_pool_submit (struct decode_job *job)
+{
+job->done = 0;
+job->next = NULL;
+pthread_mutex_lock (&pool_lock);
+if (job_tail)
+  job_tail->next = job;
+else
+  job_head = job;
+job_tail = job;
+pthread_cond_signal (&pool_work);
+pthread_mutex_unlock (&pool_lock);
+} // decode_pool_submit()
+
+void decode_pool_wait (struct decode_job *job)
+{
+pthread_mutex_lock (&pool_lock);
+while (!job->done)
+  pthread_cond_wait (&pool_done, &pool_lock);
+pthread_mutex_unlock (&pool_lock);
+} // decode_pool_wait()
+
+static int discard_pcm (const uint8_t *pcm, int frames, void *userdata)
+{
+return 0;
+} // discard_pcm()
+
+void decode_pool_prime (struct ffmpeg_decoder *dec, struct adts_tail *tail, struct pcm_ring *ring)
+/* the player's decoder continues after segments the workers decoded: bring it
+to their end state with their last frames, whose output is thrown away */
+{
+int i;
+ffmpeg_decoder_set_ring (dec, NULL);
+for (i = 0; i < tail->count; i++)
+  ffmpeg_decoder_decode_adts (dec, tail->frames[i], tail->size[i], discard_pcm, NULL);
+ffmpeg_decoder_set_ring (dec, ring);
+} // decode_pool_prime()
+
+void decode_pool_stop (void)
+// the queued jobs are still decoded
+{
+int i;
+pthread_mutex_lock (&pool_lock);
+pool_closing = 1;
+pthread_cond_broadcast (&pool_work);
+pthread_mutex_unlock (&pool_lock);
+for (i = 0; i < worker_count; i++) {
+  pthread_join (workers[i].thread, NULL);
+  ffmpeg_decoder_free (workers[i].dec);
+  }
+worker_count = 0;
+} // decode_pool_stop()
@@ -0,0 +1,162 @@
+/*
+File: drift.c
+Description: compensation of the drift between the clock of the station
+and that of the audio device (-D)
+
+A live station sends its audio at the rate of its own clock, the DAC plays
+it at the rate of the Pi's; the two differ by up to a few hundred ppm, so
+that over days the audio buffered in between grows until the station
+skips ahead, or shrinks until it underruns. The playback thread measures
+that audio before each write (the segments queued, the PCM ring and the
+delay of the sink) and this file keeps it at the level it had once the
+stream settled.
+
+The measure is smoothed over minutes, as the HLS segments make it jump by
+a segment at a time; a PI controller turns the error into a rate
+correction, at most DRIFT_MAX_PPM, which swr_set_compensation() applies
+by resampling the frames of the playback thread ever so slightly. The
+correction is slow on purpose: a second of error is taken back over about
+DRIFT_TAU_S, well below what is heard as a change of pitch.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <libswresample/swresample.h>
+#include <libavutil/opt.h>
+#include <libavutil/channel_layout.h>
+
+#include "pi_radio.h"
+
+// nothing is measured while the buffers fill after a (re)start
+#define DRIFT_SETTLE_S 60.0
+// then the level to keep is the mean of this long
+#define DRIFT_WINDOW_S 60.0
+// time constant of the smoothing of the measure
+#define DRIFT_SMOOTH_S 120.0
+// time constant of the proportional correction, and integral time
+#define DRIFT_TAU_S 1800.0
+#define DRIFT_TI_S (4 * DRIFT_TAU_S)
+#define DRIFT_MAX_PPM 1000.0
+#define DRIFT_UPDATE_S 1.0
+// the correction is spread over this much audio, renewed every DRIFT_UPDATE_S
+#define DRIFT_DISTANCE_S 10
+#define DRIFT_LOG_S 600.0
+
+static SwrContext *swr;
+static unsigned int rate;
+static uint8_t *out;
+static int out_capacity;           // frames
+static double elapsed;             // s since drift_reset()
+static double window_sum;          // ms x s
+static double target_ms;           // 0 until the window is over
+static double smoothed_ms;
+static double integral_ms;
+static double since_update, since_log;
+static atomic_int ppm_tenths;
+
+// ==============================================================
+
+int drift_reset (unsigned int r)
+/* playback thread: the sink plays at r from now on, after a (re)start or
+a switch; the level to keep is measured again */
+{
+rate = r;
+elapsed = 0;
+window_sum = 0;
+target_ms = 0;
+integral_ms = 0;
+since_update = 0;
+since_log = 0;
+atomic_store (&ppm_tenths, 0);
+swr_free (&swr);
+swr = swr_alloc_set_opts (NULL, AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT, AV_SAMPLE_FMT_S16, r,
+  AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT, AV_SAMPLE_FMT_S16, r, 0, NULL);
+if (swr == NULL)
+  return -1;
+// the rates are the same: without it swr would only copy and ignore the compensation
+av_opt_set_int (swr, "force_resampling", 1, 0);
+av_opt_set_int (swr, "filter_size", 16, 0);
+av_opt_set_int (swr, "linear_interp", 1, 0);
+if (swr_init (swr) < 0) {
+  pi_radio_log ("ERROR: swr_init() fails for the drift compensation\n");
+  swr_free (&swr);
+  return -1;
+  }
+return 0;
+} // drift_reset()
+
+void drift_update (double latency_ms, size_t frames)
+// playback thread: latency_ms of audio is buffered before frames are written
+{
+double dt = (double) frames / rate;
+elapsed += dt;
+if (elapsed < DRIFT_SETTLE_S)
+  return;
+if (elapsed < DRIFT_SETTLE_S + DRIFT_WINDOW_S) {
+  window_sum += latency_ms * dt;
+  return;
+  }
+if (target_ms == 0) {
+  target_ms = smoothed_ms = window_sum / DRIFT_WINDOW_S;
+  pi_radio_log ("drift compensation keeps %.0f ms buffered\n", target_ms);
+  }
+smoothed_ms += (latency_ms - smoothed_ms) * dt / DRIFT_SMOOTH_S;
+if ((since_update += dt) < DRIFT_UPDATE_S)
+  return;
+
+// ppm which take an error of 1 ms back in DRIFT_TAU_S: 1 ppm is 1 ms in 1000 s
+double kp = 1000.0 / DRIFT_TAU_S;
+double error = smoothed_ms - target_ms;
+integral_ms += error * since_update / DRIFT_TI_S;
+if (fabs (kp * integral_ms) > DRIFT_MAX_PPM)
+  integral_ms = copysign (DRIFT_MAX_PPM / kp, integral_ms);
+double ppm = kp * (error + integral_ms);
+if (fabs (ppm) > DRIFT_MAX_PPM)
+  ppm = copysign (DRIFT_MAX_PPM, ppm);
+since_update = 0;
+atomic_store (&ppm_tenths, (int) lround (ppm * 10));
+
+// too much buffered: fewer frames out than in, to play faster than the station sends
+int distance = DRIFT_DISTANCE_S * rate;
+if (swr)
+  swr_set_compensation (swr, (int) -lround (ppm * distance / 1e6), distance);
+if ((since_log += DRIFT_UPDATE_S) >= DRIFT_LOG_S) {
+  since_log = 0;
+  pi_radio_log ("drift compensation: %.0f ms buffered for %.0f, %+.1f ppm\n", smoothed_ms, target_ms, ppm);
+  }
+} // drift_update()
+
+size_t drift_convert (const uint8_t *pcm, size_t frames, const uint8_t **converted)
+/* playback thread: frames resampled by the correction into *converted, valid
+until the next call; return their number. Without the resampler they are left as they are */
+{
+int n = swr ? swr_get_out_samples (swr, (int) frames) : -1;
+if (n < 0) {
+  *converted = pcm;
+  return frames;
+  }
+if (n > out_capacity) {
+  uint8_t *p = realloc (out, (size_t) n * PCM_FRAME_BYTES);
+  if (p == NULL) {
+    *converted = pcm;
+    return frames;
+    }
+  out = p;
+  out_capacity = n;
+  }
+n = swr_convert (swr, &out, out_capacity, &pcm, (int) frames);
+if (n < 0) {
+  *converted = pcm;
+  return frames;
+  }
+*converted = out;
+return n;
+} // drift_convert()
+
+double drift_ppm (void)
+// any thread: the correction applied, positive when the station is played faster than the sink's clock says
+{
+return atomic_load (&ppm_tenths) / 10.0;
+} // drift_ppm()
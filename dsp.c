@@ -0,0 +1,634 @@
+/*
+File: dsp.c
+Description: vectorized post-processing of the PCM frames (volume, mono
+downmix, crossfade between stations, S16/float conversion) and the
+K-weighting filter of the loudness meter
+
+Every kernel has a scalar version and, when the compiler targets it, an ARM
+NEON or x86 SSE2 one; on x86 an AVX2 version is compiled as well and used
+when the CPU has it. dsp_init() picks the best set once at start-up (or the
+one named, for bench/dsp_bench.c) and the dsp_*() calls go through it.
+
+The S16 samples are interleaved stereo as in the PCM ring; the float
+samples are in [-1, 1) as FFmpeg gives them. The float to S16 conversions
+round to the nearest and saturate.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DSP_NEON 1
+#elif defined(__SSE2__)
+#include <immintrin.h>
+#define DSP_SSE2 1
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DSP_AVX2 1
+#define AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+#include "pi_radio.h"
+
+// triangular dither noise of +/- 1 LSB added by dsp_gain(), cycled through
+#define DSP_DITHER_SIZE 4096
+/* added to the input of the K-weighting filter, far below any sample: in
+silence its state would otherwise decay into denormals, which are slow */
+#define DSP_DENORMAL_GUARD 1e-15f
+
+struct dsp_ops {
+  const char *name;
+  void (*s16_to_float) (const int16_t *in, float *out, size_t n);
+  void (*float_to_s16) (const float *in, int16_t *out, size_t n);
+  void (*interleave) (const float *left, const float *right, int16_t *out, size_t frames);
+  void (*gain) (int16_t *pcm, size_t n, float gain, const float *dither);
+  void (*downmix_mono) (int16_t *pcm, size_t frames);
+  void (*crossfade) (int16_t *pcm, const int16_t *from, size_t frames, size_t pos, size_t len);
+  float (*kweight) (struct dsp_kweight *k, const int16_t *pcm, size_t frames);
+};
+
+static float dither_noise[DSP_DITHER_SIZE + 16];  // + 16 so that a vector read never wraps
+static size_t dither_pos;
+static const struct dsp_ops *ops;
+
+// ==============================================================
+
+static inline int16_t scalar_s16 (float f)
+// f in S16 units
+{
+if (f >= 32767.0f)
+  return 32767;
+if (f <= -32768.0f)
+  return -32768;
+return (int16_t) lrintf (f);
+} // scalar_s16()
+
+static void scalar_s16_to_float (const int16_t *in, float *out, size_t n)
+{
+size_t i;
+for (i = 0; i < n; i++)
+  out[i] = in[i] * (1.0f / 32768.0f);
+} // scalar_s16_to_float()
+
+static void scalar_float_to_s16 (const float *in, int16_t *out, size_t n)
+{
+size_t i;
+for (i = 0; i < n; i++)
+  out[i] = scalar_s16 (in[i] * 32768.0f);
+} // scalar_float_to_s16()
+
+static void scalar_interleave (const float *left, const float *right, int16_t *out, size_t frames)
+{
+size_t i;
+for (i = 0; i < frames; i++) {
+  out[2 * i] = scalar_s16 (left[i] * 32768.0f);
+  out[2 * i + 1] = scalar_s16 (right[i] * 32768.0f);
+  }
+} // scalar_interleave()
+
+static void scalar_gain (int16_t *pcm, size_t n, float gain, const float *dither)
+{
+size_t i;
+for (i = 0; i < n; i++)
+  pcm[i] = scalar_s16 (pcm[i] * gain + dither[i]);
+} // scalar_gain()
+
+static void scalar_downmix_mono (int16_t *pcm, size_t frames)
+{
+size_t i;
+for (i = 0; i < frames; i++)
+  pcm[2 * i] = pcm[2 * i + 1] = (int16_t) ((pcm[2 * i] + pcm[2 * i + 1]) >> 1);
+} // scalar_downmix_mono()
+
+static void scalar_crossfade (int16_t *pcm, const int16_t *from, size_t frames, size_t pos, size_t len)
+{
+size_t i;
+float step = 1.0f / len;
+for (i = 0; i < frames; i++) {
+  float t = (pos + i) * step;
+  pcm[2 * i] = scalar_s16 (from[2 * i] + (pcm[2 * i] - from[2 * i]) * t);
+  pcm[2 * i + 1] = scalar_s16 (from[2 * i + 1] + (pcm[2 * i + 1] - from[2 * i + 1]) * t);
+  }
+} // scalar_crossfade()
+
+static float scalar_kweight (struct dsp_kweight *k, const int16_t *pcm, size_t frames)
+{
+size_t i;
+int c, s;
+float sum = 0;
+for (i = 0; i < frames; i++)
+  for (c = 0; c < 2; c++) {
+    float x = pcm[2 * i + c] * (1.0f / 32768.0f) + DSP_DENORMAL_GUARD;
+    for (s = 0; s < 2; s++) {
+      const struct dsp_biquad *bq = &k->stage[s];
+      float y = bq->b0 * x + k->z[s][0][c];
+      k->z[s][0][c] = bq->b1 * x - bq->a1 * y + k->z[s][1][c];
+      k->z[s][1][c] = bq->b2 * x - bq->a2 * y;
+      x = y;
+      }
+    sum += x * x;
+    }
+return sum;
+} // scalar_kweight()
+
+static const struct dsp_ops scalar_ops = {
+  "scalar", scalar_s16_to_float, scalar_float_to_s16, scalar_interleave,
+  scalar_gain, scalar_downmix_mono, scalar_crossfade, scalar_kweight
+};
+
+// ==============================================================
+
+#ifdef DSP_NEON
+
+static inline int32x4_t neon_s32 (float32x4_t f)
+// f in S16 units, rounded to the nearest
+{
+#ifdef __aarch64__
+return vcvtnq_s32_f32 (f);
+#else
+// ARMv7 only truncates: add 0.5 with the sign of f
+uint32x4_t sign = vandq_u32 (vreinterpretq_u32_f32 (f), vdupq_n_u32 (0x80000000));
+return vcvtq_s32_f32 (vaddq_f32 (f, vreinterpretq_f32_u32 (vorrq_u32 (vreinterpretq_u32_f32 (vdupq_n_f32 (0.5f)), sign))));
+#endif
+} // neon_s32()
+
+static void neon_s16_to_float (const int16_t *in, float *out, size_t n)
+{
+size_t i;
+for (i = 0; i + 8 <= n; i += 8) {
+  int16x8_t v = vld1q_s16 (in + i);
+  vst1q_f32 (out + i, vmulq_n_f32 (vcvtq_f32_s32 (vmovl_s16 (vget_low_s16 (v))), 1.0f / 32768.0f));
+  vst1q_f32 (out + i + 4, vmulq_n_f32 (vcvtq_f32_s32 (vmovl_s16 (vget_high_s16 (v))), 1.0f / 32768.0f));
+  }
+scalar_s16_to_float (in + i, out + i, n - i);
+} // neon_s16_to_float()
+
+static void neon_float_to_s16 (const float *in, int16_t *out, size_t n)
+// the float to int32 conversion and the narrowing both saturate
+{
+size_t i;
+for (i = 0; i + 8 <= n; i += 8) {
+  int32x4_t a = neon_s32 (vmulq_n_f32 (vld1q_f32 (in + i), 32768.0f));
+  int32x4_t b = neon_s32 (vmulq_n_f32 (vld1q_f32 (in + i + 4), 32768.0f));
+  vst1q_s16 (out + i, vcombine_s16 (vqmovn_s32 (a), vqmovn_s32 (b)));
+  }
+scalar_float_to_s16 (in + i, out + i, n - i);
+} // neon_float_to_s16()
+
+static void neon_interleave (const float *left, const float *right, int16_t *out, size_t frames)
+{
+size_t i;
+for (i = 0; i + 4 <= frames; i += 4) {
+  int16x4x2_t v;
+  v.val[0] = vqmovn_s32 (neon_s32 (vmulq_n_f32 (vld1q_f32 (left + i), 32768.0f)));
+  v.val[1] = vqmovn_s32 (neon_s32 (vmulq_n_f32 (vld1q_f32 (right + i), 32768.0f)));
+  vst2_s16 (out + 2 * i, v);
+  }
+scalar_interleave (left + i, right + i, out + 2 * i, frames - i);
+} // neon_interleave()
+
+static void neon_gain (int16_t *pcm, size_t n, float gain, const float *dither)
+{
+size_t i;
+for (i = 0; i + 8 <= n; i += 8) {
+  int16x8_t v = vld1q_s16 (pcm + i);
+  float32x4_t a = vcvtq_f32_s32 (vmovl_s16 (vget_low_s16 (v)));
+  float32x4_t b = vcvtq_f32_s32 (vmovl_s16 (vget_high_s16 (v)));
+  a = vmlaq_n_f32 (vld1q_f32 (dither + i), a, gain);
+  b = vmlaq_n_f32 (vld1q_f32 (dither + i + 4), b, gain);
+  vst1q_s16 (pcm + i, vcombine_s16 (vqmovn_s32 (neon_s32 (a)), vqmovn_s32 (neon_s32 (b))));
+  }
+scalar_gain (pcm + i, n - i, gain, dither + i);
+} // neon_gain()
+
+static void neon_downmix_mono (int16_t *pcm, size_t frames)
+// vhaddq_s16() is (a + b) >> 1 without overflow, as in scalar_downmix_mono()
+{
+size_t i;
+for (i = 0; i + 8 <= frames; i += 8) {
+  int16x8x2_t v = vld2q_s16 (pcm + 2 * i);
+  v.val[0] = v.val[1] = vhaddq_s16 (v.val[0], v.val[1]);
+  vst2q_s16 (pcm + 2 * i, v);
+  }
+scalar_downmix_mono (pcm + 2 * i, frames - i);
+} // neon_downmix_mono()
+
+static void neon_crossfade (int16_t *pcm, const int16_t *from, size_t frames, size_t pos, size_t len)
+// 4 frames at a time, deinterleaved: one weight per frame for both channels
+{
+static const float steps[4] = { 0, 1, 2, 3 };
+size_t i;
+float step = 1.0f / len;
+for (i = 0; i + 4 <= frames; i += 4) {
+  float32x4_t t = vmulq_n_f32 (vaddq_f32 (vdupq_n_f32 ((float) (pos + i)), vld1q_f32 (steps)), step);
+  int16x4x2_t to = vld2_s16 (pcm + 2 * i);
+  int16x4x2_t fr = vld2_s16 (from + 2 * i);
+  int c;
+  for (c = 0; c < 2; c++) {
+    float32x4_t f = vcvtq_f32_s32 (vmovl_s16 (fr.val[c]));
+    float32x4_t d = vsubq_f32 (vcvtq_f32_s32 (vmovl_s16 (to.val[c])), f);
+    to.val[c] = vqmovn_s32 (neon_s32 (vmlaq_f32 (f, d, t)));
+    }
+  vst2_s16 (pcm + 2 * i, to);
+  }
+scalar_crossfade (pcm + 2 * i, from + 2 * i, frames - i, pos + i, len);
+} // neon_crossfade()
+
+static float neon_kweight (struct dsp_kweight *k, const int16_t *pcm, size_t frames)
+/* a recursive filter cannot run over several frames at once: the two
+channels go through it together, one in each lane of a float32x2_t */
+{
+float32x2_t z1[2], z2[2], acc = vdup_n_f32 (0);
+size_t i;
+int s;
+for (s = 0; s < 2; s++) {
+  z1[s] = vld1_f32 (k->z[s][0]);
+  z2[s] = vld1_f32 (k->z[s][1]);
+  }
+for (i = 0; i < frames; i++) {
+  uint32_t word;
+  memcpy (&word, pcm + 2 * i, sizeof (word));
+  int32x2_t v = vget_low_s32 (vmovl_s16 (vreinterpret_s16_u32 (vdup_n_u32 (word))));
+  float32x2_t x = vadd_f32 (vmul_n_f32 (vcvt_f32_s32 (v), 1.0f / 32768.0f), vdup_n_f32 (DSP_DENORMAL_GUARD));
+  for (s = 0; s < 2; s++) {
+    const struct dsp_biquad *bq = &k->stage[s];
+    float32x2_t y = vmla_n_f32 (z1[s], x, bq->b0);
+    z1[s] = vmls_n_f32 (vmla_n_f32 (z2[s], x, bq->b1), y, bq->a1);
+    z2[s] = vmls_n_f32 (vmul_n_f32 (x, bq->b2), y, bq->a2);
+    x = y;
+    }
+  acc = vmla_f32 (acc, x, x);
+  }
+for (s = 0; s < 2; s++) {
+  vst1_f32 (k->z[s][0], z1[s]);
+  vst1_f32 (k->z[s][1], z2[s]);
+  }
+return vget_lane_f32 (acc, 0) + vget_lane_f32 (acc, 1);
+} // neon_kweight()
+
+static const struct dsp_ops simd_ops = {
+  "neon", neon_s16_to_float, neon_float_to_s16, neon_interleave,
+  neon_gain, neon_downmix_mono, neon_crossfade, neon_kweight
+};
+
+#endif // DSP_NEON
+
+// ==============================================================
+
+#ifdef DSP_SSE2
+
+/* _mm_cvtps_epi32() rounds to the nearest but gives INT_MIN out of range,
+which _mm_packs_epi32() would turn into -32768: clamp the floats first */
+
+static inline __m128i sse2_s32 (__m128 f)
+// f in S16 units
+{
+return _mm_cvtps_epi32 (_mm_min_ps (_mm_max_ps (f, _mm_set1_ps (-32768.0f)), _mm_set1_ps (32767.0f)));
+} // sse2_s32()
+
+static void sse2_s16_to_float (const int16_t *in, float *out, size_t n)
+{
+size_t i;
+const __m128 scale = _mm_set1_ps (1.0f / 32768.0f);
+for (i = 0; i + 8 <= n; i += 8) {
+  __m128i v = _mm_loadu_si128 ((const __m128i *) (in + i));
+  // the samples to the high halves of 32 bit lanes, then shifted back with their sign
+  __m128i lo = _mm_srai_epi32 (_mm_unpacklo_epi16 (v, v), 16);
+  __m128i hi = _mm_srai_epi32 (_mm_unpackhi_epi16 (v, v), 16);
+  _mm_storeu_ps (out + i, _mm_mul_ps (_mm_cvtepi32_ps (lo), scale));
+  _mm_storeu_ps (out + i + 4, _mm_mul_ps (_mm_cvtepi32_ps (hi), scale));
+  }
+scalar_s16_to_float (in + i, out + i, n - i);
+} // sse2_s16_to_float()
+
+static void sse2_float_to_s16 (const float *in, int16_t *out, size_t n)
+{
+size_t i;
+const __m128 scale = _mm_set1_ps (32768.0f);
+for (i = 0; i + 8 <= n; i += 8) {
+  __m128i a = sse2_s32 (_mm_mul_ps (_mm_loadu_ps (in + i), scale));
+  __m128i b = sse2_s32 (_mm_mul_ps (_mm_loadu_ps (in + i + 4), scale));
+  _mm_storeu_si128 ((__m128i *) (out + i), _mm_packs_epi32 (a, b));
+  }
+scalar_float_to_s16 (in + i, out + i, n - i);
+} // sse2_float_to_s16()
+
+static void sse2_interleave (const float *left, const float *right, int16_t *out, size_t frames)
+{
+size_t i;
+const __m128 scale = _mm_set1_ps (32768.0f);
+for (i = 0; i + 4 <= frames; i += 4) {
+  __m128i l = sse2_s32 (_mm_mul_ps (_mm_loadu_ps (left + i), scale));
+  __m128i r = sse2_s32 (_mm_mul_ps (_mm_loadu_ps (right + i), scale));
+  // L0 R0 L1 R1 and L2 R2 L3 R3 in 32 bit lanes, then narrowed in that order
+  _mm_storeu_si128 ((__m128i *) (out + 2 * i), _mm_packs_epi32 (_mm_unpacklo_epi32 (l, r), _mm_unpackhi_epi32 (l, r)));
+  }
+scalar_interleave (left + i, right + i, out + 2 * i, frames - i);
+} // sse2_interleave()
+
+static void sse2_gain (int16_t *pcm, size_t n, float gain, const float *dither)
+{
+size_t i;
+const __m128 g = _mm_set1_ps (gain);
+for (i = 0; i + 8 <= n; i += 8) {
+  __m128i v = _mm_loadu_si128 ((const __m128i *) (pcm + i));
+  __m128 a = _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpacklo_epi16 (v, v), 16));
+  __m128 b = _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpackhi_epi16 (v, v), 16));
+  a = _mm_add_ps (_mm_mul_ps (a, g), _mm_loadu_ps (dither + i));
+  b = _mm_add_ps (_mm_mul_ps (b, g), _mm_loadu_ps (dither + i + 4));
+  _mm_storeu_si128 ((__m128i *) (pcm + i), _mm_packs_epi32 (sse2_s32 (a), sse2_s32 (b)));
+  }
+scalar_gain (pcm + i, n - i, gain, dither + i);
+} // sse2_gain()
+
+static void sse2_downmix_mono (int16_t *pcm, size_t frames)
+// one frame per 32 bit lane: L in the low half, R in the high half
+{
+size_t i;
+for (i = 0; i + 4 <= frames; i += 4) {
+  __m128i v = _mm_loadu_si128 ((const __m128i *) (pcm + 2 * i));
+  __m128i m = _mm_srai_epi32 (_mm_add_epi32 (_mm_srai_epi32 (_mm_slli_epi32 (v, 16), 16), _mm_srai_epi32 (v, 16)), 1);
+  m = _mm_or_si128 (_mm_and_si128 (m, _mm_set1_epi32 (0xffff)), _mm_slli_epi32 (m, 16));
+  _mm_storeu_si128 ((__m128i *) (pcm + 2 * i), m);
+  }
+scalar_downmix_mono (pcm + 2 * i, frames - i);
+} // sse2_downmix_mono()
+
+static void sse2_crossfade (int16_t *pcm, const int16_t *from, size_t frames, size_t pos, size_t len)
+// 2 frames per vector of 4 samples, each weight taken twice
+{
+size_t i;
+const __m128 step = _mm_set1_ps (1.0f / len);
+const __m128 frame_of_sample = _mm_setr_ps (0, 0, 1, 1);
+for (i = 0; i + 4 <= frames; i += 4) {
+  __m128i to = _mm_loadu_si128 ((const __m128i *) (pcm + 2 * i));
+  __m128i fr = _mm_loadu_si128 ((const __m128i *) (from + 2 * i));
+  __m128 t0 = _mm_mul_ps (_mm_add_ps (_mm_set1_ps ((float) (pos + i)), frame_of_sample), step);
+  __m128 t1 = _mm_mul_ps (_mm_add_ps (_mm_set1_ps ((float) (pos + i + 2)), frame_of_sample), step);
+  __m128 f0 = _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpacklo_epi16 (fr, fr), 16));
+  __m128 f1 = _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpackhi_epi16 (fr, fr), 16));
+  __m128 d0 = _mm_sub_ps (_mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpacklo_epi16 (to, to), 16)), f0);
+  __m128 d1 = _mm_sub_ps (_mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpackhi_epi16 (to, to), 16)), f1);
+  __m128i a = sse2_s32 (_mm_add_ps (f0, _mm_mul_ps (d0, t0)));
+  __m128i b = sse2_s32 (_mm_add_ps (f1, _mm_mul_ps (d1, t1)));
+  _mm_storeu_si128 ((__m128i *) (pcm + 2 * i), _mm_packs_epi32 (a, b));
+  }
+scalar_crossfade (pcm + 2 * i, from + 2 * i, frames - i, pos + i, len);
+} // sse2_crossfade()
+
+static float sse2_kweight (struct dsp_kweight *k, const int16_t *pcm, size_t frames)
+/* a recursive filter cannot run over several frames at once: the two
+channels go through it together in the low lanes of an __m128 */
+{
+__m128 z1[2], z2[2], b0[2], b1[2], b2[2], a1[2], a2[2], acc = _mm_setzero_ps ();
+const __m128 scale = _mm_set1_ps (1.0f / 32768.0f), guard = _mm_set1_ps (DSP_DENORMAL_GUARD);
+float lanes[4];
+size_t i;
+int s;
+for (s = 0; s < 2; s++) {
+  z1[s] = _mm_castsi128_ps (_mm_loadl_epi64 ((const __m128i *) k->z[s][0]));
+  z2[s] = _mm_castsi128_ps (_mm_loadl_epi64 ((const __m128i *) k->z[s][1]));
+  b0[s] = _mm_set1_ps (k->stage[s].b0);
+  b1[s] = _mm_set1_ps (k->stage[s].b1);
+  b2[s] = _mm_set1_ps (k->stage[s].b2);
+  a1[s] = _mm_set1_ps (k->stage[s].a1);
+  a2[s] = _mm_set1_ps (k->stage[s].a2);
+  }
+for (i = 0; i < frames; i++) {
+  int32_t word;
+  memcpy (&word, pcm + 2 * i, sizeof (word));
+  __m128i v = _mm_cvtsi32_si128 (word);
+  __m128 x = _mm_add_ps (_mm_mul_ps (_mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpacklo_epi16 (v, v), 16)), scale), guard);
+  for (s = 0; s < 2; s++) {
+    __m128 y = _mm_add_ps (_mm_mul_ps (b0[s], x), z1[s]);
+    z1[s] = _mm_add_ps (_mm_sub_ps (_mm_mul_ps (b1[s], x), _mm_mul_ps (a1[s], y)), z2[s]);
+    z2[s] = _mm_sub_ps (_mm_mul_ps (b2[s], x), _mm_mul_ps (a2[s], y));
+    x = y;
+    }
+  acc = _mm_add_ps (acc, _mm_mul_ps (x, x));
+  }
+for (s = 0; s < 2; s++) {
+  _mm_storel_epi64 ((__m128i *) k->z[s][0], _mm_castps_si128 (z1[s]));
+  _mm_storel_epi64 ((__m128i *) k->z[s][1], _mm_castps_si128 (z2[s]));
+  }
+_mm_storeu_ps (lanes, acc);
+return lanes[0] + lanes[1]; // the high lanes only filtered the guard
+} // sse2_kweight()
+
+static const struct dsp_ops simd_ops = {
+  "sse2", sse2_s16_to_float, sse2_float_to_s16, sse2_interleave,
+  sse2_gain, sse2_downmix_mono, sse2_crossfade, sse2_kweight
+};
+
+#endif // DSP_SSE2
+
+// ==============================================================
+
+#ifdef DSP_AVX2
+
+/* the 256 bit pack and unpack instructions work within each 128 bit half;
+where that leaves the samples out of order _mm256_permute4x64_epi64()
+puts the halves back */
+
+static inline AVX2 __m256i avx2_s32 (__m256 f)
+{
+return _mm256_cvtps_epi32 (_mm256_min_ps (_mm256_max_ps (f, _mm256_set1_ps (-32768.0f)), _mm256_set1_ps (32767.0f)));
+} // avx2_s32()
+
+static AVX2 void avx2_s16_to_float (const int16_t *in, float *out, size_t n)
+{
+size_t i;
+const __m256 scale = _mm256_set1_ps (1.0f / 32768.0f);
+for (i = 0; i + 16 <= n; i += 16) {
+  __m256i a = _mm256_cvtepi16_epi32 (_mm_loadu_si128 ((const __m128i *) (in + i)));
+  __m256i b = _mm256_cvtepi16_epi32 (_mm_loadu_si128 ((const __m128i *) (in + i + 8)));
+  _mm256_storeu_ps (out + i, _mm256_mul_ps (_mm256_cvtepi32_ps (a), scale));
+  _mm256_storeu_ps (out + i + 8, _mm256_mul_ps (_mm256_cvtepi32_ps (b), scale));
+  }
+sse2_s16_to_float (in + i, out + i, n - i);
+} // avx2_s16_to_float()
+
+static AVX2 void avx2_float_to_s16 (const float *in, int16_t *out, size_t n)
+{
+size_t i;
+const __m256 scale = _mm256_set1_ps (32768.0f);
+for (i = 0; i + 16 <= n; i += 16) {
+  __m256i a = avx2_s32 (_mm256_mul_ps (_mm256_loadu_ps (in + i), scale));
+  __m256i b = avx2_s32 (_mm256_mul_ps (_mm256_loadu_ps (in + i + 8), scale));
+  __m256i v = _mm256_permute4x64_epi64 (_mm256_packs_epi32 (a, b), 0xd8);
+  _mm256_storeu_si256 ((__m256i *) (out + i), v);
+  }
+sse2_float_to_s16 (in + i, out + i, n - i);
+} // avx2_float_to_s16()
+
+static AVX2 void avx2_interleave (const float *left, const float *right, int16_t *out, size_t frames)
+// the in-lane unpack and pack cancel out: the frames come out in order
+{
+size_t i;
+const __m256 scale = _mm256_set1_ps (32768.0f);
+for (i = 0; i + 8 <= frames; i += 8) {
+  __m256i l = avx2_s32 (_mm256_mul_ps (_mm256_loadu_ps (left + i), scale));
+  __m256i r = avx2_s32 (_mm256_mul_ps (_mm256_loadu_ps (right + i), scale));
+  __m256i v = _mm256_packs_epi32 (_mm256_unpacklo_epi32 (l, r), _mm256_unpackhi_epi32 (l, r));
+  _mm256_storeu_si256 ((__m256i *) (out + 2 * i), v);
+  }
+sse2_interleave (left + i, right + i, out + 2 * i, frames - i);
+} // avx2_interleave()
+
+static AVX2 void avx2_gain (int16_t *pcm, size_t n, float gain, const float *dither)
+{
+size_t i;
+const __m256 g = _mm256_set1_ps (gain);
+for (i = 0; i + 16 <= n; i += 16) {
+  __m256 a = _mm256_cvtepi32_ps (_mm256_cvtepi16_epi32 (_mm_loadu_si128 ((const __m128i *) (pcm + i))));
+  __m256 b = _mm256_cvtepi32_ps (_mm256_cvtepi16_epi32 (_mm_loadu_si128 ((const __m128i *) (pcm + i + 8))));
+  a = _mm256_add_ps (_mm256_mul_ps (a, g), _mm256_loadu_ps (dither + i));
+  b = _mm256_add_ps (_mm256_mul_ps (b, g), _mm256_loadu_ps (dither + i + 8));
+  __m256i v = _mm256_permute4x64_epi64 (_mm256_packs_epi32 (avx2_s32 (a), avx2_s32 (b)), 0xd8);
+  _mm256_storeu_si256 ((__m256i *) (pcm + i), v);
+  }
+sse2_gain (pcm + i, n - i, gain, dither + i);
+} // avx2_gain()
+
+static AVX2 void avx2_downmix_mono (int16_t *pcm, size_t frames)
+{
+size_t i;
+for (i = 0; i + 8 <= frames; i += 8) {
+  __m256i v = _mm256_loadu_si256 ((const __m256i *) (pcm + 2 * i));
+  __m256i m = _mm256_srai_epi32 (_mm256_add_epi32 (_mm256_srai_epi32 (_mm256_slli_epi32 (v, 16), 16), _mm256_srai_epi32 (v, 16)), 1);
+  m = _mm256_or_si256 (_mm256_and_si256 (m, _mm256_set1_epi32 (0xffff)), _mm256_slli_epi32 (m, 16));
+  _mm256_storeu_si256 ((__m256i *) (pcm + 2 * i), m);
+  }
+sse2_downmix_mono (pcm + 2 * i, frames - i);
+} // avx2_downmix_mono()
+
+static AVX2 void avx2_crossfade (int16_t *pcm, const int16_t *from, size_t frames, size_t pos, size_t len)
+// 4 frames per vector of 8 samples
+{
+size_t i;
+const __m256 step = _mm256_set1_ps (1.0f / len);
+const __m256 frame_of_sample = _mm256_setr_ps (0, 0, 1, 1, 2, 2, 3, 3);
+for (i = 0; i + 8 <= frames; i += 8) {
+  __m256 t0 = _mm256_mul_ps (_mm256_add_ps (_mm256_set1_ps ((float) (pos + i)), frame_of_sample), step);
+  __m256 t1 = _mm256_mul_ps (_mm256_add_ps (_mm256_set1_ps ((float) (pos + i + 4)), frame_of_sample), step);
+  __m256 f0 = _mm256_cvtepi32_ps (_mm256_cvtepi16_epi32 (_mm_loadu_si128 ((const __m128i *) (from + 2 * i))));
+  __m256 f1 = _mm256_cvtepi32_ps (_mm256_cvtepi16_epi32 (_mm_loadu_si128 ((const __m128i *) (from + 2 * i + 8))));
+  __m256 d0 = _mm256_sub_ps (_mm256_cvtepi32_ps (_mm256_cvtepi16_epi32 (_mm_loadu_si128 ((const __m128i *) (pcm + 2 * i)))), f0);
+  __m256 d1 = _mm256_sub_ps (_mm256_cvtepi32_ps (_mm256_cvtepi16_epi32 (_mm_loadu_si128 ((const __m128i *) (pcm + 2 * i + 8)))), f1);
+  __m256i a = avx2_s32 (_mm256_add_ps (f0, _mm256_mul_ps (d0, t0)));
+  __m256i b = avx2_s32 (_mm256_add_ps (f1, _mm256_mul_ps (d1, t1)));
+  _mm256_storeu_si256 ((__m256i *) (pcm + 2 * i), _mm256_permute4x64_epi64 (_mm256_packs_epi32 (a, b), 0xd8));
+  }
+sse2_crossfade (pcm + 2 * i, from + 2 * i, frames - i, pos + i, len);
+} // avx2_crossfade()
+
+static const struct dsp_ops avx2_ops = {
+  "avx2", avx2_s16_to_float, avx2_float_to_s16, avx2_interleave,
+  avx2_gain, avx2_downmix_mono, avx2_crossfade,
+  sse2_kweight // two lanes are all it uses
+};
+
+#endif // DSP_AVX2
+
+// ==============================================================
+
+int dsp_init (const char *name)
+/* pick the kernels: the best the CPU runs when name is NULL, otherwise
+"scalar", "neon", "sse2" or "avx2"; return -1 if that one is not available */
+{
+static const struct dsp_ops *all[4];
+int count = 0, i;
+#ifdef DSP_AVX2
+__builtin_cpu_init ();
+if (__builtin_cpu_supports ("avx2"))
+  all[count++] = &avx2_ops;
+#endif
+#if defined(DSP_NEON) || defined(DSP_SSE2)
+all[count++] = &simd_ops;
+#endif
+all[count++] = &scalar_ops;
+
+ops = NULL;
+for (i = 0; i < count && ops == NULL; i++)
+  if (name == NULL || strcmp (name, all[i]->name) == 0)
+    ops = all[i];
+if (ops == NULL) {
+  ops = all[0];
+  return -1;
+  }
+
+// triangular dither: the sum of two uniform values, from a fixed LCG
+dither_pos = 0;
+uint32_t seed = 22222;
+for (i = 0; i < DSP_DITHER_SIZE; i++) {
+  seed = seed * 1664525 + 1013904223;
+  float a = (seed >> 8) * (1.0f / 16777216.0f);
+  seed = seed * 1664525 + 1013904223;
+  float b = (seed >> 8) * (1.0f / 16777216.0f);
+  dither_noise[i] = a + b - 1.0f;
+  }
+memcpy (dither_noise + DSP_DITHER_SIZE, dither_noise, sizeof (dither_noise) - DSP_DITHER_SIZE * sizeof (float));
+return 0;
+} // dsp_init()
+
+const char *dsp_name (void)
+{
+return ops->name;
+} // dsp_name()
+
+// ==============================================================
+
+void dsp_s16_to_float (const int16_t *in, float *out, size_t n)
+// n samples
+{
+ops->s16_to_float (in, out, n);
+} // dsp_s16_to_float()
+
+void dsp_float_to_s16 (const float *in, int16_t *out, size_t n)
+{
+ops->float_to_s16 (in, out, n);
+} // dsp_float_to_s16()
+
+void dsp_interleave (const float *left, const float *right, int16_t *out, size_t frames)
+// two planes of float to interleaved S16 stereo (the AAC decoder output)
+{
+ops->interleave (left, right, out, frames);
+} // dsp_interleave()
+
+void dsp_gain (int16_t *pcm, size_t frames, float gain)
+/* scale the frames in place, with dither; the dither position carries on
+from one call to the next, so a single thread may call it */
+{
+size_t n = 2 * frames;
+while (n > 0) {
+  size_t chunk = DSP_DITHER_SIZE - dither_pos;
+  if (chunk > n)
+    chunk = n;
+  ops->gain (pcm, chunk, gain, dither_noise + dither_pos);
+  dither_pos = (dither_pos + chunk) % DSP_DITHER_SIZE;
+  pcm += chunk;
+  n -= chunk;
+  }
+} // dsp_gain()
+
+void dsp_downmix_mono (int16_t *pcm, size_t frames)
+// both channels become their average, in place
+{
+ops->downmix_mono (pcm, frames);
+} // dsp_downmix_mono()
+
+void dsp_crossfade (int16_t *pcm, const int16_t *from, size_t frames, size_t pos, size_t len)
+/* linear crossfade of len frames from the frames of from to those of pcm,
+in place; the frames given are number pos to pos + frames - 1 of it */
+{
+ops->crossfade (pcm, from, frames, pos, len);
+} // dsp_crossfade()
+
+float dsp_kweight (struct dsp_kweight *k, const int16_t *pcm, size_t frames)
+/* run the frames through the K-weighting filter of k and return the sum of
+the squares of its output, both channels, in full scale units */
+{
+return ops->kweight (k, pcm, frames);
+} // dsp_kweight()
@@ -0,0 +1,445 @@
+/*
+File: fetch.c
+Description: HTTP fetch layer on top of one curl multi handle
+
+A pool of easy handles is grown on demand, a handle at a time, and the
+handles are reused once their transfer is over, so that any number of
+stations (-R) can download at the same time. All of them are
+driven by the same multi handle, so they share its connection cache (HTTP
+keep-alive) and DNS cache, and with HTTP/2 the playlist and the segments
+on the same CDN host are multiplexed on one connection. TLS sessions are
+shared as well so that a new connection can resume instead of doing a
+full handshake.
+
+Every transfer carries its own write function and completion callback,
+so the write target no longer has to be switched inside the header
+callback.
+
+fetch_perform() is also the event loop of the main thread: one-shot timers
+are fired from it and its poll never sleeps past the next timer.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <curl/curl.h>
+
+#include "pi_radio.h"
+
+// handles created by fetch_init(): the segments and the playlist of the
+// playing station and of a standby one; more are created when needed
+#define FETCH_POOL_INITIAL 12
+// connections kept per host; HTTP/2 needs only one
+#define FETCH_MAX_HOST_CONNECTIONS 4
+#define FETCH_DNS_CACHE_SECONDS 300
+// a dead server is given up on after these, rather than by the kernel minutes later
+#define FETCH_CONNECT_TIMEOUT_S 10
+#define FETCH_STALL_TIMEOUT_S 15
+
+struct fetch {
+  CURL *easy;
+  int in_use;
+  int finished;               // set when there is no completion callback
+  int result;                 // CURLcode
+  int status;                 // of the HTTP response, 0 until its status line
+  char content_type[200];     // upper case, as sent in the Content-Type header
+  fetch_write_fn write;
+  fetch_done_fn done;
+  void *userdata;
+  struct fetch *next_free;    // in free_handles while not in use
+  struct fetch *next;         // in all_handles
+};
+
+static CURLM *multi_handle;
+static CURLSH *share_handle;
+static struct fetch *all_handles;   // every handle created, for fetch_cleanup()
+static struct fetch *free_handles;  // those not in use
+static long handle_count;
+static struct fetch_timer *timers;  // armed timers, soonest first
+
+// ==============================================================
+
+static size_t fetch_header_callback (char *buffer, size_t size, size_t nitems, void *userdata)
+{
+struct fetch *f = userdata;
+size_t numbytes = size * nitems;
+char b[1000];
+size_t n = (numbytes > 999) ? 999 : numbytes;
+memcpy (b, buffer, n);
+b[n] = '\0';
+str_trim (b);
+pi_radio_debug ("HTTP HEADER : [%s]\n", b);
+str_toupper (b);
+
+// a new response (e.g. after a redirect or "100 Continue") resets the type
+if (memcmp (b, "HTTP/", 5) == 0) {
+  char *p = strchr (b, ' ');
+  f->status = p ? atoi (p + 1) : 0;
+  f->content_type[0] = '\0';
+  }
+else if (memcmp (b, "CONTENT-TYPE:", 13) == 0) {
+  // drop parameters such as "; charset=UTF-8"
+  char *p = b + 13;
+  while (isspace (*p))
+    p++;
+  p[strcspn (p, "; \t")] = '\0';
+  snprintf (f->content_type, sizeof (f->content_type), "%s", p);
+  }
+return numbytes;
+} // fetch_header_callback()
+
+static size_t fetch_write_callback (char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+struct fetch *f = userdata;
+return f->write (f, (uint8_t *) ptr, size * nmemb);
+} // fetch_write_callback()
+
+static struct fetch *fetch_new (void)
+// an easy handle set up for the pool, NULL if out of memory
+{
+struct fetch *f = calloc (1, sizeof (*f));
+CURL *easy = curl_easy_init();
+if (f == NULL || easy == NULL) {
+  pi_radio_log ("ERROR: cannot create another fetch handle\n");
+  free (f);
+  if (easy)
+    curl_easy_cleanup (easy);
+  return NULL;
+  }
+f->easy = easy;
+curl_easy_setopt (easy, CURLOPT_PRIVATE, f);
+curl_easy_setopt (easy, CURLOPT_HEADERFUNCTION, fetch_header_callback);
+curl_easy_setopt (easy, CURLOPT_HEADERDATA, f);
+curl_easy_setopt (easy, CURLOPT_WRITEFUNCTION, fetch_write_callback);
+curl_easy_setopt (easy, CURLOPT_WRITEDATA, f);
+// curl_easy_setopt(easy, CURLOPT_VERBOSE, 1L);
+// RTHK does not like a null user-agent in libcurl
+curl_easy_setopt (easy, CURLOPT_USERAGENT, "curl/7.64.0");
+curl_easy_setopt (easy, CURLOPT_SHARE, share_handle);
+curl_easy_setopt (easy, CURLOPT_DNS_CACHE_TIMEOUT, (long) FETCH_DNS_CACHE_SECONDS);
+curl_easy_setopt (easy, CURLOPT_TCP_KEEPALIVE, 1L);
+curl_easy_setopt (easy, CURLOPT_CONNECTTIMEOUT, (long) FETCH_CONNECT_TIMEOUT_S);
+// a stream which sends nothing for this long is dropped, for the station to reconnect
+curl_easy_setopt (easy, CURLOPT_LOW_SPEED_LIMIT, 1L);
+curl_easy_setopt (easy, CURLOPT_LOW_SPEED_TIME, (long) FETCH_STALL_TIMEOUT_S);
+#ifdef CURL_HTTP_VERSION_2TLS
+curl_easy_setopt (easy, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+#endif
+// wait for an existing connection to multiplex on rather than open another one
+curl_easy_setopt (easy, CURLOPT_PIPEWAIT, 1L);
+f->next = all_handles;
+all_handles = f;
+handle_count++;
+// the connection cache keeps one connection per handle
+curl_multi_setopt (multi_handle, CURLMOPT_MAXCONNECTS, handle_count);
+return f;
+} // fetch_new()
+
+static void fetch_release (struct fetch *f)
+// the transfer is over: the handle goes back to the free list
+{
+f->in_use = 0;
+f->next_free = free_handles;
+free_handles = f;
+} // fetch_release()
+
+// ==============================================================
+
+int fetch_init (void)
+{
+int i;
+pi_radio_log ("Calling curl_global_init()\n");
+curl_global_init(CURL_GLOBAL_DEFAULT);
+
+multi_handle = curl_multi_init();
+if (multi_handle == NULL)
+  return -1;
+#ifdef CURLPIPE_MULTIPLEX
+curl_multi_setopt (multi_handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+curl_multi_setopt (multi_handle, CURLMOPT_MAX_HOST_CONNECTIONS, (long) FETCH_MAX_HOST_CONNECTIONS);
+
+// all the handles are used from the main thread only, so no share locks are needed
+share_handle = curl_share_init();
+curl_share_setopt (share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+curl_share_setopt (share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+for (i = 0; i < FETCH_POOL_INITIAL; i++) {
+  struct fetch *f = fetch_new ();
+  if (f == NULL)
+    return -1;
+  f->next_free = free_handles;
+  free_handles = f;
+  }
+return 0;
+} // fetch_init()
+
+void fetch_cleanup (void)
+{
+while (all_handles) {
+  struct fetch *f = all_handles;
+  all_handles = f->next;
+  if (f->in_use)
+    curl_multi_remove_handle (multi_handle, f->easy);
+  curl_easy_cleanup (f->easy);
+  free (f);
+  }
+free_handles = NULL;
+handle_count = 0;
+pi_radio_log ("Calling curl_multi_cleanup()\n");
+curl_multi_cleanup (multi_handle);
+curl_share_cleanup (share_handle);
+pi_radio_log ("Calling curl_global_cleanup()\n");
+curl_global_cleanup();
+} // fetch_cleanup()
+
+// ==============================================================
+
+struct fetch *fetch_start (const char *url, fetch_write_fn write, fetch_done_fn done, void *userdata)
+/* start a transfer; it makes progress whenever fetch_perform() is called
+done is called when it is over, after which the handle goes back to the pool.
+With done == NULL the caller must wait with fetch_wait() instead.
+Return NULL if no handle can be created */
+{
+return fetch_start_range (url, 0, -1, write, done, userdata);
+} // fetch_start()
+
+struct fetch *fetch_start_range (const char *url, int64_t offset, int64_t length, fetch_write_fn write, fetch_done_fn done, void *userdata)
+/* fetch_start() for length bytes from offset (an #EXT-X-BYTERANGE); length < 0 for
+the rest of the resource from offset, the whole of it from 0 */
+{
+struct fetch *f = free_handles;
+if (f)
+  free_handles = f->next_free;
+else if ((f = fetch_new ()) == NULL)
+  return NULL;
+f->in_use = 1;
+f->finished = 0;
+f->result = CURLE_OK;
+f->status = 0;
+f->content_type[0] = '\0';
+f->write = write;
+f->done = done;
+f->userdata = userdata;
+
+pi_radio_log ("fetch_start() with url = %s\n", url);
+curl_easy_setopt (f->easy, CURLOPT_URL, url);
+if (length >= 0) {
+  char range[64];
+  snprintf (range, sizeof (range), "%lld-%lld", (long long) offset, (long long) (offset + length - 1));
+  curl_easy_setopt (f->easy, CURLOPT_RANGE, range);
+  }
+else if (offset > 0) {
+  char range[32];
+  snprintf (range, sizeof (range), "%lld-", (long long) offset);
+  curl_easy_setopt (f->easy, CURLOPT_RANGE, range);
+  }
+else
+  curl_easy_setopt (f->easy, CURLOPT_RANGE, NULL);
+CURLMcode mc = curl_multi_add_handle (multi_handle, f->easy);
+if (mc) {
+  pi_radio_log ("ERROR: curl_multi_add_handle() failed, code %d.\n", (int) mc);
+  fetch_release (f);
+  return NULL;
+  }
+return f;
+} // fetch_start_range()
+
+static void fetch_complete (struct fetch *f, CURLcode result)
+{
+curl_multi_remove_handle (multi_handle, f->easy);
+f->result = result;
+if (result != CURLE_OK)
+  pi_radio_log ("ERROR: transfer failed (%s)\n", curl_easy_strerror (result));
+if (f->done) {
+  f->done (f, result);
+  fetch_release (f);
+  }
+else
+  f->finished = 1;
+} // fetch_complete()
+
+uint64_t monotonic_ms (void)
+{
+struct timespec ts;
+clock_gettime (CLOCK_MONOTONIC, &ts);
+return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+} // monotonic_ms()
+
+void fetch_timer_start (struct fetch_timer *t, int delay_ms, fetch_timer_fn fn, void *userdata)
+// (re)arm a one-shot timer fired by fetch_perform() in delay_ms
+{
+fetch_timer_stop (t);
+t->due_ms = monotonic_ms () + (delay_ms > 0 ? delay_ms : 0);
+t->fn = fn;
+t->userdata = userdata;
+struct fetch_timer **p = &timers;
+while (*p && (*p)->due_ms <= t->due_ms)
+  p = &(*p)->next;
+t->next = *p;
+*p = t;
+t->armed = 1;
+} // fetch_timer_start()
+
+void fetch_timer_stop (struct fetch_timer *t)
+{
+struct fetch_timer **p;
+if (!t->armed)
+  return;
+for (p = &timers; *p; p = &(*p)->next)
+  if (*p == t) {
+    *p = t->next;
+    break;
+    }
+t->armed = 0;
+} // fetch_timer_stop()
+
+static void fire_timers (void)
+{
+uint64_t now = monotonic_ms ();
+while (timers && timers->due_ms <= now) {
+  struct fetch_timer *t = timers;
+  timers = t->next;
+  t->armed = 0;
+  t->fn (t->userdata); // may re-arm t
+  }
+} // fire_timers()
+
+// ==============================================================
+
+int fetch_perform (int timeout_ms)
+/* let all the transfers progress and fire the timers which are due, then wait
+up to timeout_ms (or until the next timer) for network activity
+return the number of transfers still running, or -1 on a curl multi error */
+{
+int still_running = 0;
+CURLMcode mc = curl_multi_perform (multi_handle, &still_running);
+
+CURLMsg *msg;
+int msgs_left;
+while ((msg = curl_multi_info_read (multi_handle, &msgs_left)) != NULL) {
+  if (msg->msg != CURLMSG_DONE)
+    continue;
+  struct fetch *f;
+  curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, (char **) &f);
+  fetch_complete (f, msg->data.result);
+  }
+
+fire_timers ();
+if (timers) {
+  uint64_t now = monotonic_ms ();
+  if (timers->due_ms <= now)
+    timeout_ms = 0;
+  else if (timers->due_ms - now < (uint64_t) timeout_ms)
+    timeout_ms = timers->due_ms - now;
+  }
+
+if (!mc && timeout_ms > 0) {
+/* since the version of libcurl in Raspberry Pi is quite old */
+#if LIBCURL_VERSION_NUM >= 0x074200
+  // also waits without a transfer, and returns early on fetch_wakeup()
+  mc = curl_multi_poll(multi_handle, NULL, 0, timeout_ms, NULL);
+#else
+  if (still_running == 0)
+    usleep (timeout_ms * 1000); // curl_multi_wait() does not wait without a transfer
+  else
+    mc = curl_multi_wait (multi_handle, NULL, 0, timeout_ms, NULL);
+#endif
+  }
+
+if (mc) {
+  pi_radio_log("ERROR: curl_multi_poll() or curl_multi_wait() failed, code %d.\n", (int)mc);
+  return -1;
+  }
+return still_running;
+} // fetch_perform()
+
+int fetch_wait (struct fetch *f)
+// drive all the transfers until f (started without a done callback) is over, then release it
+{
+while (!f->finished) {
+  if (fetch_perform (1000) < 0) {
+    curl_multi_remove_handle (multi_handle, f->easy);
+    f->result = CURLE_RECV_ERROR;
+    break;
+    }
+  }
+fetch_release (f);
+return f->result;
+} // fetch_wait()
+
+void fetch_cancel (struct fetch *f)
+// abort a transfer; its done callback is not called and the handle goes back to the pool
+{
+if (!f->in_use)
+  return;
+curl_multi_remove_handle (multi_handle, f->easy);
+fetch_release (f);
+} // fetch_cancel()
+
+void fetch_wakeup (void)
+// make fetch_perform() return early when called from another thread; with an old libcurl it returns on its timeout
+{
+#if LIBCURL_VERSION_NUM >= 0x074400
+curl_multi_wakeup (multi_handle);
+#endif
+} // fetch_wakeup()
+
+// ==============================================================
+
+const char *fetch_content_type (struct fetch *f)
+{
+return f->content_type;
+}
+
+int fetch_transfer_stats (struct fetch *f, int64_t *bytes, int64_t *us)
+// size of the body and total time of a finished transfer (from its done callback); return -1 if unknown
+{
+#if LIBCURL_VERSION_NUM >= 0x073d00
+curl_off_t size, time;
+if (curl_easy_getinfo (f->easy, CURLINFO_SIZE_DOWNLOAD_T, &size) != CURLE_OK ||
+    curl_easy_getinfo (f->easy, CURLINFO_TOTAL_TIME_T, &time) != CURLE_OK)
+  return -1;
+*bytes = size;
+*us = time;
+#else
+double size, time;
+if (curl_easy_getinfo (f->easy, CURLINFO_SIZE_DOWNLOAD, &size) != CURLE_OK ||
+    curl_easy_getinfo (f->easy, CURLINFO_TOTAL_TIME, &time) != CURLE_OK)
+  return -1;
+*bytes = (int64_t) size;
+*us = (int64_t) (time * 1000000);
+#endif
+return 0;
+} // fetch_transfer_stats()
+
+int fetch_status (struct fetch *f)
+// the HTTP status of the response, e.g. 206 if a range was sent; 0 before it
+{
+return f->status;
+}
+
+int64_t fetch_content_length (struct fetch *f)
+// the Content-Length of the response, -1 if it has none (a live stream)
+{
+#if LIBCURL_VERSION_NUM >= 0x073700
+curl_off_t length;
+if (curl_easy_getinfo (f->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length) != CURLE_OK)
+  return -1;
+return length;
+#else
+double length;
+if (curl_easy_getinfo (f->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &length) != CURLE_OK)
+  return -1;
+return (int64_t) length;
+#endif
+} // fetch_content_length()
+
+void *fetch_userdata (struct fetch *f)
+{
+return f->userdata;
+}
@@ -1,5 +1,5 @@
 /* File: ffmpeg_decode.c
-Modified from 
+Modified from
 https://github.com/gavv/snippets/blob/master/decode_play/ffmpeg_decode.cpp
 
 with the following changes:
@@ -7,194 +7,683 @@ with the following changes:
 - degenerate to a function which output a vox file
 - output format is changed to AV_SAMPLE_FMT_S16 from AV_SAMPLE_FMT_FLT
 - change the deprecated API
+- the decoding loop calls back with the PCM samples so that the caller decides
+  where they go (a vox file, or straight to ALSA)
+- ffmpeg_decoder_decode_buffer() reads the TS segment from memory via a custom AVIOContext
+- the codec context and the resampler live in a struct ffmpeg_decoder which is
+  kept across the segments of a stream; errors are returned instead of exit()
+- ffmpeg_decoder_decode_adts() decodes the ADTS frames coming from ts_demux.c
+  while the segment is still downloading
+- with ffmpeg_decoder_set_ring(), swr_convert() writes straight into the free
+  space of the PCM ring instead of a buffer which the callback copies from
+- the output rate follows the stream unless ffmpeg_decoder_set_output_rate()
+  fixes it; stereo input at that rate is converted to S16 without swr, and
+  what has to be resampled goes through a lighter filter than the default
+- ffmpeg_decoder_feed_adts() decodes an ADTS AAC stream (Icecast) as it comes,
+  cut into frames by the libavcodec AAC parser
+- the time of the decoding and of the conversion of each packet goes to the
+  histograms of metrics.c
 */
 
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <limits.h>
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libswresample/swresample.h>
-
-int ffmpeg_decode (char *infile, char *outfile)
+#include <libavutil/opt.h>
+
+#include "pi_radio.h"
+
+// size of the buffer handed to the custom AVIOContext
+#define AVIO_BUFFER_SIZE 4096
+
+#define OUT_CHANNELS 2
+#define OUT_SAMPLES 512
+// the rate of the vox files of ffmpeg_decode()
+#define OUT_SAMPLE_RATE 44100
+// the PCM ring of pi_radio.c is sized for this rate; faster streams are resampled
+#define OUT_MAX_SAMPLE_RATE 48000
+// swr filter for the stations which are not at the output rate: half the taps
+// and a quarter of the phases of the default (32, 10), enough for radio on a Pi
+#define RESAMPLE_FILTER_SIZE 16
+#define RESAMPLE_PHASE_SHIFT 8
+
+struct ffmpeg_decoder {
+  AVCodecContext *codec_ctx;   // NULL until the first segment is probed
+  enum AVCodecID codec_id;
+  int out_rate;                // 0 until the first decoded frame sets it
+  SwrContext *swr_ctx;         // set up from the first decoded frame
+  int direct;                  // stereo input at out_rate: converted without swr_ctx
+  int in_sample_rate;          // the input format swr_ctx (or direct) was set up for
+  int in_sample_fmt;
+  uint64_t in_channel_layout;
+  AVFrame *frame;
+  uint8_t *buffer;             // output of swr_convert()
+  int max_buffer_size;
+  struct pcm_ring *ring;       // if set, the output goes here and not to the callback
+  AVCodecParserContext *parser;  // ffmpeg_decoder_feed_adts(): the partial frame of the stream
+  uint64_t decode_us;          // metrics_now_us() spent on the packet in the codec
+  uint64_t resample_us;        // and in the conversion of its frames
+};
+
+struct mem_reader {
+  const uint8_t *data;
+  size_t size;
+  size_t pos;
+};
+
+// ==============================================================
+
+static int mem_read_packet (void *opaque, uint8_t *buf, int buf_size)
+{
+struct mem_reader *reader = opaque;
+size_t remaining = reader->size - reader->pos;
+if (remaining == 0)
+  return AVERROR_EOF;
+if ((size_t) buf_size > remaining)
+  buf_size = remaining;
+memcpy (buf, reader->data + reader->pos, buf_size);
+reader->pos += buf_size;
+return buf_size;
+} // mem_read_packet()
+
+static int64_t mem_seek (void *opaque, int64_t offset, int whence)
 {
+struct mem_reader *reader = opaque;
+int64_t pos;
+switch (whence & ~AVSEEK_FORCE) {
+  case AVSEEK_SIZE:
+    return reader->size;
+  case SEEK_SET:
+    pos = offset;
+    break;
+  case SEEK_CUR:
+    pos = reader->pos + offset;
+    break;
+  case SEEK_END:
+    pos = reader->size + offset;
+    break;
+  default:
+    return -1;
+  }
+if (pos < 0 || pos > (int64_t) reader->size)
+  return -1;
+reader->pos = pos;
+return pos;
+} // mem_seek()
 
-FILE *out_fp;
+// ==============================================================
 
-out_fp = fopen (outfile, "w");
-if (out_fp == NULL) {
-  fprintf (stderr, "Cannot open file \"%s\"\n", outfile);
-  exit (1);
+static int write_pcm_to_file (const uint8_t *pcm, int frames, void *userdata)
+{
+FILE *out_fp = userdata;
+// 4 == 2 channels * 16 bits sample size / 8 bits per byte
+if (fwrite(pcm, frames * 4, 1, out_fp) != 1) {
+  fprintf(stderr, "error: fwrite()\n");
+  return -1;
   }
+return 0;
+} // write_pcm_to_file()
 
-int out_channels = 2, out_samples = 512, sample_rate = 44100;
+// ==============================================================
 
-int max_buffer_size =
-        av_samples_get_buffer_size(
-            NULL, out_channels, out_samples, AV_SAMPLE_FMT_S16, 1);
+struct ffmpeg_decoder *ffmpeg_decoder_new (void)
+{
+struct ffmpeg_decoder *dec = calloc (1, sizeof (*dec));
+if (dec == NULL)
+  return NULL;
 
-// register supported formats and codecs
-// av_register_all(); deprecated
+dec->max_buffer_size =
+        av_samples_get_buffer_size(
+            NULL, OUT_CHANNELS, OUT_SAMPLES, AV_SAMPLE_FMT_S16, 1);
 
-// allocate empty format context
-// provides methods for reading input packets
-AVFormatContext* fmt_ctx = avformat_alloc_context();
-assert(fmt_ctx);
+// allocate empty frame for decoding
+dec->frame = av_frame_alloc();
+// allocate buffer for output stream
+dec->buffer = (uint8_t*)av_malloc(dec->max_buffer_size);
+if (!dec->frame || !dec->buffer) {
+  ffmpeg_decoder_free (dec);
+  return NULL;
+  }
+return dec;
+} // ffmpeg_decoder_new()
 
-// determine input file type and initialize format context
-if (avformat_open_input(&fmt_ctx, infile, NULL, NULL) != 0) {
-  fprintf(stderr, "error: avformat_open_input()\n");
-  exit(1);
+static void close_codec (struct ffmpeg_decoder *dec)
+{
+if (dec->codec_ctx) {
+  avcodec_close(dec->codec_ctx);
+  avcodec_free_context(&dec->codec_ctx);
   }
+swr_free(&dec->swr_ctx);
+dec->codec_id = AV_CODEC_ID_NONE;
+} // close_codec()
 
-// determine supported codecs for input file streams and add them to format context
-if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
-  fprintf(stderr, "error: avformat_find_stream_info()\n");
-  exit(1);
+void ffmpeg_decoder_free (struct ffmpeg_decoder *dec)
+{
+if (dec == NULL)
+  return;
+close_codec (dec);
+if (dec->parser)
+  av_parser_close (dec->parser);
+av_free(dec->buffer);
+av_frame_free(&dec->frame);
+free (dec);
+} // ffmpeg_decoder_free()
+
+void ffmpeg_decoder_reset (struct ffmpeg_decoder *dec)
+/* forget the codec, the parser and the resampler, with the state they carry
+from the previous frames; they are set up again from the next frame */
+{
+close_codec (dec);
+if (dec->parser) {
+  av_parser_close (dec->parser);
+  dec->parser = NULL;
   }
+dec->direct = 0;
+dec->in_sample_rate = 0;
+} // ffmpeg_decoder_reset()
 
-// av_dump_format(fmt_ctx, 0, infile, 0);
+void ffmpeg_decoder_set_ring (struct ffmpeg_decoder *dec, struct pcm_ring *ring)
+// resample into ring from now on; the pcm_callback of the decode functions is then not called
+{
+dec->ring = ring;
+} // ffmpeg_decoder_set_ring()
 
-// find audio stream in format context
-size_t stream = 0;
-for (; stream < fmt_ctx->nb_streams; stream++) {
-  if (fmt_ctx->streams[stream]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
-    break;
-    }
-  }
-if (stream == fmt_ctx->nb_streams) {
-  fprintf(stderr, "error: no audio stream found\n");
-  exit(1);
-  }
+void ffmpeg_decoder_set_output_rate (struct ffmpeg_decoder *dec, int rate)
+// resample to rate from now on; with 0 the next decoded frame chooses
+{
+if (rate == dec->out_rate)
+  return;
+dec->out_rate = rate;
+swr_free(&dec->swr_ctx);
+dec->direct = 0;
+dec->in_sample_rate = 0;
+} // ffmpeg_decoder_set_output_rate()
+
+int ffmpeg_decoder_output_rate (struct ffmpeg_decoder *dec)
+// the rate of the PCM output, 0 before the first frame
+{
+return dec->out_rate;
+} // ffmpeg_decoder_output_rate()
+
+// ==============================================================
+
+static int open_codec (struct ffmpeg_decoder *dec, enum AVCodecID codec_id, AVCodecParameters *codecpar)
+/* (re)create the codec context; the resampler follows the first frame
+codecpar comes from the demuxer, or is NULL when the codec describes itself in-band (ADTS) */
+{
+close_codec (dec);
 
 // find decoder for audio stream
-// AVCodec* codec = avcodec_find_decoder(codec_ctx->codec_id);
-AVCodec* codec = avcodec_find_decoder(fmt_ctx->streams[stream]->codecpar->codec_id);
+AVCodec* codec = avcodec_find_decoder(codec_id);
 if (!codec) {
   fprintf(stderr, "error: avcodec_find_decoder()\n");
-  exit(1);
+  return AVERROR_DECODER_NOT_FOUND;
   }
 
-AVCodecContext* codec_ctx = avcodec_alloc_context3(codec);
-assert(codec_ctx);
+dec->codec_ctx = avcodec_alloc_context3(codec);
+if (!dec->codec_ctx)
+  return AVERROR(ENOMEM);
 
 // Fill the codecCtx with the parameters of the codec used in the read file.
 int err;
-if ((err = avcodec_parameters_to_context(codec_ctx, fmt_ctx->streams[stream]->codecpar)) != 0) {
-    // Something went wrong. Cleaning up...
-  avcodec_close(codec_ctx);
-  avcodec_free_context(&codec_ctx);
-  avformat_close_input(&fmt_ctx);
+if (codecpar && (err = avcodec_parameters_to_context(dec->codec_ctx, codecpar)) != 0) {
   fprintf(stderr, "Error in avcodec_parameters_to_context() returns %d\n", err);
-  exit (1);
+  close_codec (dec);
+  return err;
   }
 
 // initialize codec context with decoder we've found
-if (avcodec_open2(codec_ctx, codec, NULL) < 0) {
+if ((err = avcodec_open2(dec->codec_ctx, codec, NULL)) < 0) {
   fprintf(stderr, "error: avcodec_open2()\n");
-  exit(1);
+  close_codec (dec);
+  return err;
+  }
+dec->codec_id = codec_id;
+pi_radio_log ("ffmpeg decoder opened for codec %s\n", avcodec_get_name (dec->codec_id));
+return 0;
+} // open_codec()
+
+static int setup_resampler (struct ffmpeg_decoder *dec, AVFrame *frame)
+/* initialize converter from input audio stream to output stream
+it is only rebuilt when the input format changes so that its state (and
+the samples it holds back) carry over from one segment to the next.
+No converter is needed for stereo input at the output rate in one of the
+usual sample formats; convert_direct() then interleaves it to S16 */
+{
+uint64_t channel_layout = frame->channel_layout ?
+  frame->channel_layout : (uint64_t) av_get_default_channel_layout(frame->channels);
+
+if ((dec->swr_ctx || dec->direct) &&
+    dec->in_sample_rate == frame->sample_rate &&
+    dec->in_sample_fmt == frame->format &&
+    dec->in_channel_layout == channel_layout)
+  return 0;
+
+if (dec->out_rate == 0)
+  dec->out_rate = (frame->sample_rate <= OUT_MAX_SAMPLE_RATE) ? frame->sample_rate : OUT_MAX_SAMPLE_RATE;
+dec->in_sample_rate = frame->sample_rate;
+dec->in_sample_fmt = frame->format;
+dec->in_channel_layout = channel_layout;
+swr_free(&dec->swr_ctx);
+dec->direct = (frame->sample_rate == dec->out_rate && frame->channels == OUT_CHANNELS &&
+  (frame->format == AV_SAMPLE_FMT_FLTP || frame->format == AV_SAMPLE_FMT_FLT ||
+   frame->format == AV_SAMPLE_FMT_S16P || frame->format == AV_SAMPLE_FMT_S16));
+if (dec->direct) {
+  pi_radio_log ("no resampling: %d Hz %s is converted directly\n", frame->sample_rate, av_get_sample_fmt_name (frame->format));
+  return 0;
   }
 
-// initialize converter from input audio stream to output stream
-// provides methods for converting decoded packets to output stream
-SwrContext* swr_ctx =
+dec->swr_ctx =
    swr_alloc_set_opts(NULL,
                            AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT, // output
                            AV_SAMPLE_FMT_S16,                    // output
-                           sample_rate,                          // output
-                           codec_ctx->channel_layout,  // input
-                           codec_ctx->sample_fmt,      // input
-                           codec_ctx->sample_rate,     // input
+                           dec->out_rate,                        // output
+                           channel_layout,             // input
+                           frame->format,              // input
+                           frame->sample_rate,         // input
                            0,
                            NULL);
-if (!swr_ctx) {
+if (!dec->swr_ctx) {
   fprintf(stderr, "error: swr_alloc_set_opts()\n");
-  exit(1);
+  dec->in_sample_rate = 0;
+  return AVERROR(ENOMEM);
   }
-swr_init(swr_ctx);
-
-// create empty packet for input stream
-AVPacket packet;
-av_init_packet(&packet);
-packet.data = NULL;
-packet.size = 0;
+av_opt_set_int(dec->swr_ctx, "filter_size", RESAMPLE_FILTER_SIZE, 0);
+av_opt_set_int(dec->swr_ctx, "phase_shift", RESAMPLE_PHASE_SHIFT, 0);
+int err = swr_init(dec->swr_ctx);
+if (err < 0) {
+  fprintf(stderr, "error: swr_init()\n");
+  swr_free(&dec->swr_ctx);
+  dec->in_sample_rate = 0;
+  return err;
+  }
+pi_radio_log ("resampler set up for %d Hz %s to %d Hz\n", frame->sample_rate, av_get_sample_fmt_name (frame->format), dec->out_rate);
+return 0;
+} // setup_resampler()
 
-// allocate empty frame for decoding
-AVFrame* frame = av_frame_alloc();
-assert(frame);
+static void convert_direct (struct ffmpeg_decoder *dec, AVFrame *frame, int offset, int count, int16_t *out)
+// count samples of a stereo frame from offset, interleaved to S16 without swr
+{
+uint64_t start = metrics_now_us ();
+int i;
+switch (frame->format) {
+  case AV_SAMPLE_FMT_S16:
+    memcpy (out, (const int16_t *) frame->data[0] + 2 * offset, (size_t) count * PCM_FRAME_BYTES);
+    break;
+  case AV_SAMPLE_FMT_S16P: {
+    const int16_t *l = (const int16_t *) frame->data[0] + offset;
+    const int16_t *r = (const int16_t *) frame->data[1] + offset;
+    for (i = 0; i < count; i++) {
+      out[2 * i] = l[i];
+      out[2 * i + 1] = r[i];
+      }
+    break;
+    }
+  case AV_SAMPLE_FMT_FLT:
+    dsp_float_to_s16 ((const float *) frame->data[0] + 2 * offset, out, (size_t) 2 * count);
+    break;
+  default: // AV_SAMPLE_FMT_FLTP, what the AAC decoder gives
+    dsp_interleave ((const float *) frame->data[0] + offset, (const float *) frame->data[1] + offset, out, count);
+    break;
+  }
+dec->resample_us += metrics_now_us () - start;
+} // convert_direct()
 
-// allocate buffer for output stream
-uint8_t* buffer = (uint8_t*)av_malloc(max_buffer_size);
-assert(buffer);
+static int resample (struct ffmpeg_decoder *dec, uint8_t **out, int out_count, const uint8_t **in, int in_count)
+// swr_convert(), timed
+{
+uint64_t start = metrics_now_us ();
+int got_samples = swr_convert (dec->swr_ctx, out, out_count, in, in_count);
+dec->resample_us += metrics_now_us () - start;
+return got_samples;
+} // resample()
+
+static int receive_frame (struct ffmpeg_decoder *dec)
+// avcodec_receive_frame(), timed
+{
+uint64_t start = metrics_now_us ();
+int err = avcodec_receive_frame (dec->codec_ctx, dec->frame);
+dec->decode_us += metrics_now_us () - start;
+return err;
+} // receive_frame()
+
+int ffmpeg_decoder_drain (struct ffmpeg_decoder *dec, pcm_callback_t pcm_callback, void *userdata)
+/* hand to the callback the frames the resampler still holds back (its filter
+delay), as at the end of the stream; it is set up again from the next frame
+return 0 on success or a negative AVERROR code */
+{
+int got_samples;
+if (dec->swr_ctx == NULL)
+  return 0; // no resampler, or direct: nothing held back
+while ((got_samples = resample (dec, &dec->buffer, OUT_SAMPLES, NULL, 0)) > 0)
+  if (pcm_callback (dec->buffer, got_samples, userdata) != 0)
+    return AVERROR_EXTERNAL;
+swr_free (&dec->swr_ctx);
+dec->in_sample_rate = 0;
+return (got_samples < 0) ? got_samples : 0;
+} // ffmpeg_decoder_drain()
+
+// ==============================================================
+
+static int convert_to_ring (struct ffmpeg_decoder *dec)
+/* resample the decoded frame in place into the PCM ring, waiting for space
+when the free space ends at the end of the ring, swr keeps the rest for the next call */
+{
+const uint8_t **in = (const uint8_t **)dec->frame->data;
+int in_samples = dec->frame->nb_samples;
+int got_samples;
+size_t space;
+if (dec->direct) {
+  int done = 0;
+  while (done < in_samples) {
+    uint8_t *out;
+    if (pcm_ring_wait_space (dec->ring, 1) != 0)
+      return AVERROR_EXTERNAL; // the ring is closed
+    space = pcm_ring_write_begin (dec->ring, &out);
+    int n = ((size_t) (in_samples - done) < space) ? in_samples - done : (int) space;
+    convert_direct (dec, dec->frame, done, n, (int16_t *) out);
+    pcm_ring_write_commit (dec->ring, n);
+    done += n;
+    }
+  return 0;
+  }
+do {
+  uint8_t *out;
+  if (pcm_ring_wait_space (dec->ring, 1) != 0)
+    return AVERROR_EXTERNAL; // the ring is closed
+  space = pcm_ring_write_begin (dec->ring, &out);
+  if (space > INT_MAX)
+    space = INT_MAX;
+  got_samples = resample (dec, &out, (int) space, in, in_samples);
+  if (got_samples < 0) {
+    fprintf(stderr, "error: swr_convert()\n");
+    return got_samples;
+    }
+  pcm_ring_write_commit (dec->ring, got_samples);
+  in = NULL;
+  in_samples = 0;
+  } while ((size_t) got_samples == space); // swr may hold more
+return 0;
+} // convert_to_ring()
 
-// read packet from input audio file
-while (av_read_frame(fmt_ctx, &packet) >= 0) {
-  // skip non-audio packets
-  if (packet.stream_index != stream) {
+static int receive_frames (struct ffmpeg_decoder *dec, pcm_callback_t pcm_callback, void *userdata)
+/* drain the decoded frames of the codec context through the resampler to the callback
+the packet just sent is then counted in the metrics, its send included in decode_us */
+{
+int err;
+dec->resample_us = 0;
+while (receive_frame (dec) == 0) {
+  if ((err = setup_resampler (dec, dec->frame)) < 0)
+    return err;
+  if (dec->ring) {
+    if ((err = convert_to_ring (dec)) < 0)
+      return err;
+    continue;
+    }
+  if (dec->direct) {
+    int done;
+    for (done = 0; done < dec->frame->nb_samples; done += OUT_SAMPLES) {
+      int n = (dec->frame->nb_samples - done < OUT_SAMPLES) ? dec->frame->nb_samples - done : OUT_SAMPLES;
+      convert_direct (dec, dec->frame, done, n, (int16_t *) dec->buffer);
+      if (pcm_callback(dec->buffer, n, userdata) != 0) {
+        fprintf(stderr, "error: pcm_callback()\n");
+        return AVERROR_EXTERNAL;
+        }
+      }
     continue;
     }
 
-int ret = avcodec_send_packet(codec_ctx, &packet);
-if (ret < 0) {
-  fprintf (stderr, "ERROR: avcodec_send_packet() returns %d\n", ret);
-  exit (1);
-  }
-
-while (avcodec_receive_frame(codec_ctx, frame) == 0) {
   // convert input frame to output buffer
-  int got_samples = swr_convert(
-    swr_ctx,
-    &buffer, out_samples,
-    (const uint8_t **)frame->data, frame->nb_samples);
+  int got_samples = resample (dec, &dec->buffer, OUT_SAMPLES,
+    (const uint8_t **)dec->frame->data, dec->frame->nb_samples);
 
   if (got_samples < 0) {
     fprintf(stderr, "error: swr_convert()\n");
-    exit(1);
+    return got_samples;
     }
 
   while (got_samples > 0) {
     int buffer_size =
       av_samples_get_buffer_size(
-        NULL, out_channels, got_samples, AV_SAMPLE_FMT_S16, 1);
+        NULL, OUT_CHANNELS, got_samples, AV_SAMPLE_FMT_S16, 1);
 
-    assert(buffer_size <= max_buffer_size);
+    assert(buffer_size <= dec->max_buffer_size);
 
-    // write output buffer to stdout
-    if (fwrite(buffer, buffer_size, 1, out_fp) != 1) {
-      fprintf(stderr, "error: fwrite()\n");
-      exit(1);
+    // hand the output buffer to the caller (vox file or ALSA)
+    if (pcm_callback(dec->buffer, got_samples, userdata) != 0) {
+      fprintf(stderr, "error: pcm_callback()\n");
+      return AVERROR_EXTERNAL;
       }
 
     // process samples buffered inside swr context
-    // in and in_count are set to 0 to flush the last few samples out at the end
-    got_samples = swr_convert(swr_ctx, &buffer, out_samples, NULL, 0);
+    got_samples = resample (dec, &dec->buffer, OUT_SAMPLES, NULL, 0);
     if (got_samples < 0) {
       fprintf(stderr, "error: swr_convert()\n");
-      exit(1);
+      return got_samples;
       }
     } // while (got_samples > 0)
+  }
+metrics_observe (METRICS_DECODE, dec->decode_us);
+metrics_observe (METRICS_RESAMPLE, dec->resample_us);
+return 0;
+} // receive_frames()
 
+static int decode_format_context (struct ffmpeg_decoder *dec, AVFormatContext *fmt_ctx, pcm_callback_t pcm_callback, void *userdata)
+{
+int err;
+
+// find audio stream in format context
+// the mpegts demuxer knows the codec from the PMT, so the costly
+// avformat_find_stream_info() is only needed when the codec is new
+size_t stream = 0;
+for (; stream < fmt_ctx->nb_streams; stream++) {
+  if (fmt_ctx->streams[stream]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+    break;
+    }
+  }
+if (stream == fmt_ctx->nb_streams || dec->codec_ctx == NULL ||
+    fmt_ctx->streams[stream]->codecpar->codec_id != dec->codec_id) {
+  pi_radio_log ("probing the stream with avformat_find_stream_info()\n");
+  // determine supported codecs for input file streams and add them to format context
+  if ((err = avformat_find_stream_info(fmt_ctx, NULL)) < 0) {
+    fprintf(stderr, "error: avformat_find_stream_info()\n");
+    return err;
+    }
+  for (stream = 0; stream < fmt_ctx->nb_streams; stream++) {
+    if (fmt_ctx->streams[stream]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+      break;
+      }
+    }
+  if (stream == fmt_ctx->nb_streams) {
+    fprintf(stderr, "error: no audio stream found\n");
+    return AVERROR_STREAM_NOT_FOUND;
+    }
+  if ((err = open_codec (dec, fmt_ctx->streams[stream]->codecpar->codec_id, fmt_ctx->streams[stream]->codecpar)) < 0)
+    return err;
+  }
+
+// create empty packet for input stream
+AVPacket packet;
+av_init_packet(&packet);
+packet.data = NULL;
+packet.size = 0;
+
+// read packet from input audio file
+while (av_read_frame(fmt_ctx, &packet) >= 0) {
+  // skip non-audio packets
+  if (packet.stream_index != stream) {
+    av_packet_unref(&packet);
+    continue;
+    }
+
+  uint64_t start = metrics_now_us ();
+  err = avcodec_send_packet(dec->codec_ctx, &packet);
+  dec->decode_us = metrics_now_us () - start;
   // free packet created by decoder
-  // av_free_packet(&packet); deprecated
   av_packet_unref(&packet);
+  if (err < 0) {
+    // a corrupted packet only loses its own samples
+    pi_radio_log ("ERROR: avcodec_send_packet() returns %d\n", err);
+    continue;
+    }
+
+  if ((err = receive_frames (dec, pcm_callback, userdata)) < 0)
+    return err;
   } // while (av_read_frame(fmt_ctx, &packet) >= 0)
-}
 
-av_free(buffer);
-av_frame_free(&frame);
+return 0;
+} // decode_format_context()
+
+// ==============================================================
 
-swr_free(&swr_ctx);
+int ffmpeg_decode (char *infile, char *outfile)
+{
 
-avcodec_close(codec_ctx);
-avformat_close_input(&fmt_ctx);
+FILE *out_fp;
+int err;
 
+out_fp = fopen (outfile, "w");
+if (out_fp == NULL) {
+  fprintf (stderr, "Cannot open file \"%s\"\n", outfile);
+  return AVERROR(errno);
+  }
+
+struct ffmpeg_decoder *dec = ffmpeg_decoder_new ();
+if (dec == NULL) {
+  fclose (out_fp);
+  return AVERROR(ENOMEM);
+  }
+ffmpeg_decoder_set_output_rate (dec, OUT_SAMPLE_RATE); // a vox file has no header to tell
+
+// allocate empty format context
+// provides methods for reading input packets
+AVFormatContext* fmt_ctx = avformat_alloc_context();
+assert(fmt_ctx);
+
+// determine input file type and initialize format context
+if ((err = avformat_open_input(&fmt_ctx, infile, NULL, NULL)) != 0) {
+  fprintf(stderr, "error: avformat_open_input()\n");
+  }
+else {
+  err = decode_format_context (dec, fmt_ctx, write_pcm_to_file, out_fp);
+  avformat_close_input(&fmt_ctx);
+  }
+
+ffmpeg_decoder_free (dec);
 fclose (out_fp);
 
-return 0;
+return err;
 } // ffmpeg_decode()
 
+// ==============================================================
+
+int ffmpeg_decoder_decode_adts (struct ffmpeg_decoder *dec, const uint8_t *frame, size_t size, pcm_callback_t pcm_callback, void *userdata)
+/* decode one ADTS AAC frame (header included) as cut by ts_demux.c
+return 0 on success or a negative AVERROR code */
+{
+int err;
+if ((dec->codec_ctx == NULL || dec->codec_id != AV_CODEC_ID_AAC) &&
+    (err = open_codec (dec, AV_CODEC_ID_AAC, NULL)) < 0)
+  return err;
+
+AVPacket packet;
+av_init_packet(&packet);
+// not reference counted, so avcodec_send_packet() makes its own padded copy
+packet.data = (uint8_t *) frame;
+packet.size = size;
+
+uint64_t start = metrics_now_us ();
+err = avcodec_send_packet(dec->codec_ctx, &packet);
+dec->decode_us = metrics_now_us () - start;
+if (err < 0) {
+  // a corrupted frame only loses its own samples
+  pi_radio_log ("ERROR: avcodec_send_packet() returns %d\n", err);
+  return 0;
+  }
+return receive_frames (dec, pcm_callback, userdata);
+} // ffmpeg_decoder_decode_adts()
+
+int ffmpeg_decoder_feed_adts (struct ffmpeg_decoder *dec, const uint8_t *data, size_t size)
+/* decode the next bytes of an ADTS AAC stream; the parser cuts them into
+frames and keeps the incomplete last one, so any split of the stream will do
+return 0 on success or a negative AVERROR code */
+{
+int err;
+// the parser reads the stream parameters into the codec context
+if ((dec->codec_ctx == NULL || dec->codec_id != AV_CODEC_ID_AAC) &&
+    (err = open_codec (dec, AV_CODEC_ID_AAC, NULL)) < 0)
+  return err;
+if (dec->parser == NULL && (dec->parser = av_parser_init (AV_CODEC_ID_AAC)) == NULL)
+  return AVERROR(ENOMEM);
+while (size > 0) {
+  uint8_t *frame;
+  int frame_size;
+  int n = av_parser_parse2 (dec->parser, dec->codec_ctx, &frame, &frame_size,
+    data, (size > INT_MAX) ? INT_MAX : (int) size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+  if (n < 0)
+    return n;
+  data += n;
+  size -= n;
+  if (frame_size > 0 && (err = ffmpeg_decoder_decode_adts (dec, frame, frame_size, NULL, NULL)) < 0)
+    return err;
+  }
+return 0;
+} // ffmpeg_decoder_feed_adts()
+
+// ==============================================================
+
+int ffmpeg_decoder_decode_buffer (struct ffmpeg_decoder *dec, const uint8_t *data, size_t size, pcm_callback_t pcm_callback, void *userdata)
+/* decode a TS segment already held in memory
+the PCM output (S16, stereo, at the output rate) is passed to pcm_callback
+so nothing touches the filesystem
+return 0 on success or a negative AVERROR code */
+{
+struct mem_reader reader = { data, size, 0 };
+int err;
+
+// the AVIOContext buffer must be allocated by av_malloc() as libavformat may replace it
+uint8_t *avio_buffer = av_malloc (AVIO_BUFFER_SIZE);
+if (!avio_buffer)
+  return AVERROR(ENOMEM);
+
+AVIOContext *avio_ctx = avio_alloc_context (avio_buffer, AVIO_BUFFER_SIZE, 0, &reader, mem_read_packet, NULL, mem_seek);
+if (!avio_ctx) {
+  fprintf(stderr, "error: avio_alloc_context()\n");
+  av_free (avio_buffer);
+  return AVERROR(ENOMEM);
+  }
+
+AVFormatContext* fmt_ctx = avformat_alloc_context();
+if (!fmt_ctx) {
+  av_freep (&avio_ctx->buffer);
+  avio_context_free (&avio_ctx);
+  return AVERROR(ENOMEM);
+  }
+fmt_ctx->pb = avio_ctx;
+fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+// HLS segments are MPEG-TS; naming the demuxer skips the format probing
+if ((err = avformat_open_input(&fmt_ctx, NULL, av_find_input_format ("mpegts"), NULL)) != 0) {
+  fprintf(stderr, "error: avformat_open_input()\n");
+  }
+else {
+  err = decode_format_context (dec, fmt_ctx, pcm_callback, userdata);
+  avformat_close_input(&fmt_ctx);
+  }
+
+// with AVFMT_FLAG_CUSTOM_IO the AVIOContext is left for the caller to free
+av_freep (&avio_ctx->buffer);
+avio_context_free (&avio_ctx);
+
+return err;
+} // ffmpeg_decoder_decode_buffer()
+
 /*
 int main (int argc, char **argv)
 {
@@ -0,0 +1,260 @@
+/*
+File: log.c
+Description: asynchronous logger behind pi_radio_log()
+
+A log call formats its line into a ring owned by the calling thread and
+returns; it takes no lock, makes no system call and never waits. If the
+ring is full the line is dropped and counted. A background thread drains
+the rings every LOG_FLUSH_INTERVAL_US in timestamp order, adds the wall
+clock time and writes them to the log file with one fflush() per pass.
+
+Timestamps come from CLOCK_MONOTONIC_COARSE (read from the vDSO, no system
+call); the flusher turns them into local time, calling localtime() once
+per second of log rather than once per line. The offset to the wall clock
+is taken again at every pass, as the clock of a Pi without RTC steps when
+NTP syncs.
+
+The ring of a thread which exits is handed back to the list, and taken by
+the next new thread once the flusher has drained it, so that the player
+and replay threads started at every switch do not add a ring each.
+
+Lines above the runtime level (log_level) return before formatting, and
+pi_radio_debug() lines are compiled out entirely when LOG_COMPILE_LEVEL is
+below LOG_LEVEL_DEBUG.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pi_radio.h"
+
+// lines each thread may have waiting for the flusher; a power of 2
+#define LOG_RING_SLOTS 512
+// longer lines are truncated
+#define LOG_LINE_MAX 240
+#define LOG_FLUSH_INTERVAL_US 100000
+
+struct log_record {
+  uint64_t ns;                // CLOCK_MONOTONIC_COARSE
+  int level;
+  int len;
+  char text[LOG_LINE_MAX];
+};
+
+struct log_ring {
+  struct log_record slots[LOG_RING_SLOTS];
+  atomic_size_t write_pos;    // owned by the thread which logs
+  atomic_size_t read_pos;     // owned by the flusher
+  atomic_uint dropped;        // lines lost because the ring was full
+  atomic_int released;        // its thread exited; free for another once drained
+  struct log_ring *next;
+};
+
+atomic_int log_level = LOG_LEVEL_INFO;
+
+static _Atomic (struct log_ring *) rings;  // one per thread which ever logged
+static _Thread_local struct log_ring *thread_ring;
+static pthread_key_t ring_key;             // its destructor releases the ring of an exiting thread
+static FILE *log_fp;
+static pthread_t flusher_thread;
+static atomic_int flusher_running;
+static int64_t realtime_offset_ns;         // CLOCK_REALTIME - CLOCK_MONOTONIC_COARSE, flusher only
+
+// ==============================================================
+
+static uint64_t log_clock_ns (void)
+{
+struct timespec ts;
+clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+} // log_clock_ns()
+
+static void log_ring_release (void *ring)
+// destructor of ring_key, at the exit of a thread which logged
+{
+struct log_ring *r = ring;
+atomic_store (&r->released, 1);
+} // log_ring_release()
+
+static struct log_ring *log_ring_new (void)
+/* first log call of a thread: take a ring released and drained, or create
+one and hand it to the flusher */
+{
+struct log_ring *r;
+for (r = atomic_load (&rings); r; r = r->next) {
+  int released = 1;
+  // drained: the flusher no longer reads its slots
+  if (atomic_load (&r->released) &&
+      atomic_load_explicit (&r->read_pos, memory_order_acquire) == atomic_load_explicit (&r->write_pos, memory_order_relaxed) &&
+      atomic_compare_exchange_strong (&r->released, &released, 0))
+    break;
+  }
+if (r == NULL) {
+  if ((r = calloc (1, sizeof (*r))) == NULL)
+    return NULL;
+  r->next = atomic_load (&rings);
+  while (!atomic_compare_exchange_weak (&rings, &r->next, r))
+    ;
+  }
+pthread_setspecific (ring_key, r);
+thread_ring = r;
+return r;
+} // log_ring_new()
+
+static void log_sync_clock (void)
+// CLOCK_REALTIME - CLOCK_MONOTONIC_COARSE, which changes when the wall clock is set
+{
+struct timespec real, mono;
+clock_gettime (CLOCK_REALTIME, &real);
+clock_gettime (CLOCK_MONOTONIC_COARSE, &mono);
+realtime_offset_ns = ((int64_t) real.tv_sec - mono.tv_sec) * 1000000000 + (real.tv_nsec - mono.tv_nsec);
+} // log_sync_clock()
+
+// ==============================================================
+
+void pi_radio_vlog (int level, const char *format, va_list args)
+{
+if (level > atomic_load_explicit (&log_level, memory_order_relaxed))
+  return;
+if (log_fp == NULL) {
+  // before log_open(): write directly
+  vfprintf (stderr, format, args);
+  return;
+  }
+struct log_ring *r = thread_ring ? thread_ring : log_ring_new ();
+if (r == NULL)
+  return;
+size_t write_pos = atomic_load_explicit (&r->write_pos, memory_order_relaxed);
+size_t read_pos = atomic_load_explicit (&r->read_pos, memory_order_acquire);
+if (write_pos - read_pos == LOG_RING_SLOTS) {
+  atomic_fetch_add_explicit (&r->dropped, 1, memory_order_relaxed);
+  return;
+  }
+struct log_record *rec = &r->slots[write_pos & (LOG_RING_SLOTS - 1)];
+rec->ns = log_clock_ns ();
+rec->level = level;
+int n = vsnprintf (rec->text, LOG_LINE_MAX, format, args);
+if (n < 0)
+  n = 0;
+rec->len = (n < LOG_LINE_MAX) ? n : LOG_LINE_MAX - 1;
+atomic_store_explicit (&r->write_pos, write_pos + 1, memory_order_release);
+} // pi_radio_vlog()
+
+void pi_radio_log_level (int level, const char *format, ... )
+{
+va_list args;
+va_start (args, format);
+pi_radio_vlog (level, format, args);
+va_end (args);
+} // pi_radio_log_level()
+
+void pi_radio_log (char * format, ... )
+// the level is taken from an "ERROR" or "WARNING" prefix of the message, INFO otherwise
+{
+int level = LOG_LEVEL_INFO;
+if (format[0] == 'E' && memcmp (format, "ERROR", 5) == 0)
+  level = LOG_LEVEL_ERROR;
+else if (format[0] == 'W' && memcmp (format, "WARNING", 7) == 0)
+  level = LOG_LEVEL_WARNING;
+va_list args;
+va_start (args, format);
+pi_radio_vlog (level, format, args);
+va_end (args);
+} // pi_radio_log()
+
+// ==============================================================
+
+static void write_record (struct log_record *rec)
+{
+static time_t cached_second = -1;
+static char cached_time[32];
+int64_t ns = (int64_t) rec->ns + realtime_offset_ns;
+time_t second = ns / 1000000000;
+if (second != cached_second) {
+  struct tm tm1;
+  localtime_r (&second, &tm1);
+  strftime (cached_time, sizeof (cached_time), "%Y-%m-%d %H:%M:%S", &tm1);
+  cached_second = second;
+  }
+// ERROR and WARNING lines already say so
+fprintf (log_fp, "%s.%03d %s%.*s", cached_time, (int) (ns / 1000000 % 1000),
+  (rec->level == LOG_LEVEL_DEBUG) ? "DEBUG " : "", rec->len, rec->text);
+if (rec->len == 0 || rec->text[rec->len - 1] != '\n')
+  fputc ('\n', log_fp);
+} // write_record()
+
+static void log_drain (void)
+// write out what all the rings hold, oldest line first
+{
+struct log_ring *r;
+log_sync_clock ();
+for (r = atomic_load (&rings); r; r = r->next) {
+  unsigned int dropped = atomic_exchange_explicit (&r->dropped, 0, memory_order_relaxed);
+  if (dropped)
+    fprintf (log_fp, "WARNING: %u log lines dropped as the logging thread was too fast\n", dropped);
+  }
+while (1) {
+  struct log_ring *oldest = NULL;
+  struct log_record *oldest_rec = NULL;
+  for (r = atomic_load (&rings); r; r = r->next) {
+    size_t read_pos = atomic_load_explicit (&r->read_pos, memory_order_relaxed);
+    if (read_pos == atomic_load_explicit (&r->write_pos, memory_order_acquire))
+      continue;
+    struct log_record *rec = &r->slots[read_pos & (LOG_RING_SLOTS - 1)];
+    if (oldest_rec == NULL || rec->ns < oldest_rec->ns) {
+      oldest = r;
+      oldest_rec = rec;
+      }
+    }
+  if (oldest == NULL)
+    break;
+  write_record (oldest_rec);
+  atomic_fetch_add_explicit (&oldest->read_pos, 1, memory_order_release);
+  }
+fflush (log_fp);
+} // log_drain()
+
+static void *log_flusher_main (void *arg)
+{
+while (atomic_load (&flusher_running)) {
+  usleep (LOG_FLUSH_INTERVAL_US);
+  log_drain ();
+  }
+return NULL;
+} // log_flusher_main()
+
+// ==============================================================
+
+int log_open (const char *filename)
+{
+if (pthread_key_create (&ring_key, log_ring_release) != 0)
+  return -1;
+log_fp = fopen (filename, "w");
+if (log_fp == NULL)
+  return -1;
+log_sync_clock ();
+atomic_store (&flusher_running, 1);
+if (pthread_create (&flusher_thread, NULL, log_flusher_main, NULL) != 0) {
+  fclose (log_fp);
+  log_fp = NULL;
+  return -1;
+  }
+return 0;
+} // log_open()
+
+void log_close (void)
+// stop the flusher and write out what is left
+{
+if (log_fp == NULL)
+  return;
+atomic_store (&flusher_running, 0);
+pthread_join (flusher_thread, NULL);
+log_drain ();
+fclose (log_fp);
+log_fp = NULL;
+} // log_close()
@@ -0,0 +1,309 @@
+/*
+File: loudness.c
+Description: loudness normalization of the stations (-N), after EBU R128
+
+The playback thread measures the frames it plays as in ITU-R BS.1770: the
+K-weighted mean square of both channels over 400 ms blocks which start
+every 100 ms, gated at -70 LUFS and then 10 LU below the loudness of the
+blocks left. The blocks go into a histogram of 0.1 LU bins, so that the
+integrated loudness of the station is recomputed at every block without
+keeping them. The gain which brings it to the target is reached smoothly,
+at most LOUDNESS_SLEW_DB_PER_S.
+
+The integrated loudness of each station is kept by URL and saved in
+LOUDNESS_CACHE_FILENAME, so that a station played before starts at its
+level rather than at 0 dB while its own measure builds up.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "pi_radio.h"
+
+#define LOUDNESS_CACHE_FILENAME "/var/tmp/pi_radio.loudness"
+#define LOUDNESS_CACHE_SIZE 64
+#define LOUDNESS_URL_MAX 2048
+#define LOUDNESS_ABSOLUTE_GATE (-70.0)
+#define LOUDNESS_RELATIVE_GATE (-10.0)
+#define LOUDNESS_MAX_LUFS 5.0
+#define LOUDNESS_BINS 750  // of 0.1 LU from the absolute gate to LOUDNESS_MAX_LUFS
+// the measure replaces the cached loudness after this many blocks (10 s)
+#define LOUDNESS_MIN_BLOCKS 100
+#define LOUDNESS_SLEW_DB_PER_S 2.0
+#define LOUDNESS_MAX_BOOST_DB 10.0
+#define LOUDNESS_MAX_CUT_DB (-20.0)
+
+struct loudness_entry {
+  char url[LOUDNESS_URL_MAX];
+  double lufs;
+};
+
+static double target_lufs;
+static double bin_energy[LOUDNESS_BINS];  // mean square at the middle of each bin
+
+// the station whose frames play next, set by the main thread
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char pending_url[LOUDNESS_URL_MAX];
+
+// the rest belongs to the playback thread (or to the main thread before and after it)
+static struct loudness_entry cache[LOUDNESS_CACHE_SIZE];
+static int cache_count;
+static int measuring;                // station_start() was called
+static char url[LOUDNESS_URL_MAX];   // the station measured
+static unsigned int rate;
+static struct dsp_kweight kweight;
+static size_t block_frames, block_fill;  // 100 ms
+static double block_sum;
+static double sub_blocks[4];   // the last four 100 ms blocks make a 400 ms one
+static int sub_block_count;
+static unsigned int histogram[LOUDNESS_BINS];
+static unsigned long blocks;   // above the absolute gate
+static double cached_lufs;     // NAN if the station is not in the cache
+static double gain_db;
+
+// ==============================================================
+
+static double energy_to_lufs (double energy)
+{
+return -0.691 + 10.0 * log10 (energy);
+} // energy_to_lufs()
+
+static double lufs_to_energy (double lufs)
+{
+return pow (10.0, (lufs + 0.691) / 10.0);
+} // lufs_to_energy()
+
+static void kweight_init (unsigned int r)
+// the coefficients of BS.1770 for 48 kHz, derived again for the rate r
+{
+double f0 = 1681.974450955533, g = 3.999843853973347, q = 0.7071752369554196;
+double k = tan (M_PI * f0 / r);
+double vh = pow (10.0, g / 20.0);
+double vb = pow (vh, 0.4996667741545416);
+double a0 = 1.0 + k / q + k * k;
+memset (&kweight, 0, sizeof (kweight));
+kweight.stage[0].b0 = (vh + vb * k / q + k * k) / a0;
+kweight.stage[0].b1 = 2.0 * (k * k - vh) / a0;
+kweight.stage[0].b2 = (vh - vb * k / q + k * k) / a0;
+kweight.stage[0].a1 = 2.0 * (k * k - 1.0) / a0;
+kweight.stage[0].a2 = (1.0 - k / q + k * k) / a0;
+// the high-pass of the second stage
+f0 = 38.13547087602444;
+q = 0.5003270373238773;
+k = tan (M_PI * f0 / r);
+a0 = 1.0 + k / q + k * k;
+kweight.stage[1].b0 = 1.0;
+kweight.stage[1].b1 = -2.0;
+kweight.stage[1].b2 = 1.0;
+kweight.stage[1].a1 = 2.0 * (k * k - 1.0) / a0;
+kweight.stage[1].a2 = (1.0 - k / q + k * k) / a0;
+} // kweight_init()
+
+// ==============================================================
+
+static struct loudness_entry *cache_find (const char *u)
+{
+int i;
+for (i = 0; i < cache_count; i++)
+  if (strcmp (cache[i].url, u) == 0)
+    return &cache[i];
+return NULL;
+} // cache_find()
+
+static void cache_store (const char *u, double lufs)
+// the least recently stored entry makes room when the cache is full
+{
+struct loudness_entry *e = cache_find (u);
+if (e)
+  memmove (e, e + 1, (cache + cache_count - (e + 1)) * sizeof (*e));
+else if (cache_count == LOUDNESS_CACHE_SIZE)
+  memmove (cache, cache + 1, (LOUDNESS_CACHE_SIZE - 1) * sizeof (*e));
+if (e || cache_count == LOUDNESS_CACHE_SIZE)
+  cache_count--;
+e = &cache[cache_count++];
+snprintf (e->url, sizeof (e->url), "%s", u);
+e->lufs = lufs;
+} // cache_store()
+
+static double integrated_lufs (void)
+// the loudness of the blocks above both gates, NAN before LOUDNESS_MIN_BLOCKS
+{
+double sum = 0, gate;
+unsigned long n = 0;
+int i, first;
+if (blocks < LOUDNESS_MIN_BLOCKS)
+  return NAN;
+for (i = 0; i < LOUDNESS_BINS; i++)
+  sum += histogram[i] * bin_energy[i];
+gate = energy_to_lufs (sum / blocks) + LOUDNESS_RELATIVE_GATE;
+first = (int) ((gate - LOUDNESS_ABSOLUTE_GATE) * 10.0);
+if (first < 0)
+  first = 0;
+sum = 0;
+for (i = first; i < LOUDNESS_BINS; i++) {
+  sum += histogram[i] * bin_energy[i];
+  n += histogram[i];
+  }
+return n ? energy_to_lufs (sum / n) : NAN;
+} // integrated_lufs()
+
+static void add_block (double energy)
+// a 100 ms block of mean square energy is over
+{
+int i;
+memmove (sub_blocks, sub_blocks + 1, sizeof (sub_blocks) - sizeof (sub_blocks[0]));
+sub_blocks[3] = energy;
+if (++sub_block_count < 4)
+  return;
+double lufs = energy_to_lufs ((sub_blocks[0] + sub_blocks[1] + sub_blocks[2] + sub_blocks[3]) / 4);
+if (lufs < LOUDNESS_ABSOLUTE_GATE)
+  return;
+i = (int) ((lufs - LOUDNESS_ABSOLUTE_GATE) * 10.0);
+histogram[(i < LOUDNESS_BINS) ? i : LOUDNESS_BINS - 1]++;
+blocks++;
+} // add_block()
+
+static void station_start (const char *u)
+// forget the measure of the previous station, keeping its result
+{
+double lufs = integrated_lufs ();
+if (url[0] && !isnan (lufs)) {
+  pi_radio_log ("\"%s\" measures %.1f LUFS\n", url, lufs);
+  cache_store (url, lufs);
+  }
+snprintf (url, sizeof (url), "%s", u);
+memset (histogram, 0, sizeof (histogram));
+blocks = 0;
+sub_block_count = 0;
+block_fill = 0;
+block_sum = 0;
+rate = 0; // the filter is set up again for the rate of the new frames
+struct loudness_entry *e = cache_find (url);
+cached_lufs = e ? e->lufs : NAN;
+if (e) {
+  // no slewing from the previous station: the new one starts at its level
+  gain_db = target_lufs - cached_lufs;
+  if (gain_db > LOUDNESS_MAX_BOOST_DB)
+    gain_db = LOUDNESS_MAX_BOOST_DB;
+  if (gain_db < LOUDNESS_MAX_CUT_DB)
+    gain_db = LOUDNESS_MAX_CUT_DB;
+  pi_radio_log ("\"%s\" starts at %.1f dB, from its cached %.1f LUFS\n", url, gain_db, cached_lufs);
+  }
+else
+  gain_db = 0; // until enough of it is measured
+measuring = 1;
+} // station_start()
+
+// ==============================================================
+
+void loudness_init (double target)
+// read the cache; the frames are then brought to target LUFS
+{
+char line[LOUDNESS_URL_MAX + 32];
+int i;
+target_lufs = target;
+for (i = 0; i < LOUDNESS_BINS; i++)
+  bin_energy[i] = lufs_to_energy (LOUDNESS_ABSOLUTE_GATE + (i + 0.5) / 10.0);
+FILE *fp = fopen (LOUDNESS_CACHE_FILENAME, "r");
+if (fp == NULL)
+  return; // nothing measured yet
+// "LUFS URL" lines
+while (fgets (line, sizeof (line), fp)) {
+  char *space = strchr (line, ' ');
+  str_trim (line);
+  if (space == NULL || space[1] == '\0')
+    continue;
+  cache_store (space + 1, atof (line));
+  }
+fclose (fp);
+pi_radio_log ("%d stations in the loudness cache\n", cache_count);
+} // loudness_init()
+
+void loudness_set_station (const char *u)
+// any thread: the frames of the next station switch are those of u
+{
+pthread_mutex_lock (&lock);
+snprintf (pending_url, sizeof (pending_url), "%s", u);
+pthread_mutex_unlock (&lock);
+} // loudness_set_station()
+
+void loudness_switch (void)
+// playback thread: the frames from now on are those of the station last set
+{
+char u[LOUDNESS_URL_MAX];
+pthread_mutex_lock (&lock);
+strcpy (u, pending_url);
+pthread_mutex_unlock (&lock);
+station_start (u);
+} // loudness_switch()
+
+float loudness_process (const int16_t *pcm, size_t frames, unsigned int r)
+// playback thread: measure frames about to play at rate r; return the gain to apply to them
+{
+size_t total = frames;
+if (!measuring)
+  loudness_switch (); // the first station
+if (r != rate) {
+  rate = r;
+  kweight_init (r);
+  block_frames = r / 10;
+  block_fill = 0;
+  block_sum = 0;
+  }
+while (frames > 0) {
+  size_t n = block_frames - block_fill;
+  if (n > frames)
+    n = frames;
+  block_sum += dsp_kweight (&kweight, pcm, n);
+  block_fill += n;
+  pcm += 2 * n;
+  frames -= n;
+  if (block_fill == block_frames) {
+    add_block (block_sum / block_frames);
+    block_fill = 0;
+    block_sum = 0;
+    }
+  }
+
+// the measure when there is enough of it, else the cache
+double lufs = integrated_lufs ();
+if (isnan (lufs))
+  lufs = cached_lufs;
+if (!isnan (lufs)) {
+  double want = target_lufs - lufs;
+  double step = LOUDNESS_SLEW_DB_PER_S * total / r;
+  if (want > LOUDNESS_MAX_BOOST_DB)
+    want = LOUDNESS_MAX_BOOST_DB;
+  if (want < LOUDNESS_MAX_CUT_DB)
+    want = LOUDNESS_MAX_CUT_DB;
+  if (want > gain_db + step)
+    gain_db += step;
+  else if (want < gain_db - step)
+    gain_db -= step;
+  else
+    gain_db = want;
+  }
+return (float) pow (10.0, gain_db / 20.0);
+} // loudness_process()
+
+void loudness_save (void)
+// at exit, once the playback thread is over
+{
+int i;
+double lufs = integrated_lufs ();
+if (url[0] && !isnan (lufs))
+  cache_store (url, lufs);
+if (cache_count == 0)
+  return;
+FILE *fp = fopen (LOUDNESS_CACHE_FILENAME, "w");
+if (fp == NULL) {
+  pi_radio_log ("WARNING: cannot write \"%s\"\n", LOUDNESS_CACHE_FILENAME);
+  return;
+  }
+for (i = 0; i < cache_count; i++)
+  fprintf (fp, "%.1f %s\n", cache[i].lufs, cache[i].url);
+fclose (fp);
+} // loudness_save()
@@ -0,0 +1,341 @@
+/*
+File: m3u8.c
+Description: one-pass parser of m3u / HLS m3u8 playlists held in memory
+
+The HTTP body is scanned once, line by line, without copying the lines.
+Media playlists give a list of segments with their media sequence number,
+duration, discontinuity flag and byte range; master playlists give the
+variant streams with their bandwidth and codecs. All the URIs are resolved
+against the URL of the playlist.
+
+The strings are kept in an arena of blocks owned by the playlist, and the
+segment and variant arrays grow as needed. Both are reused by the next
+parse of the same playlist, so reloading a live playlist of hundreds of
+entries (a DVR window) does not allocate memory in the steady state.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pi_radio.h"
+
+#define M3U8_ARENA_BLOCK_SIZE 16384
+
+struct m3u8_arena_block {
+  struct m3u8_arena_block *next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+// ==============================================================
+
+void m3u8_init (struct m3u8_playlist *pl)
+{
+memset (pl, 0, sizeof (*pl));
+} // m3u8_init()
+
+void m3u8_free (struct m3u8_playlist *pl)
+{
+struct m3u8_arena_block *b = pl->arena;
+while (b) {
+  struct m3u8_arena_block *next = b->next;
+  free (b);
+  b = next;
+  }
+free (pl->segments);
+free (pl->variants);
+m3u8_init (pl);
+} // m3u8_free()
+
+// ==============================================================
+
+static char *arena_alloc (struct m3u8_playlist *pl, size_t size)
+// the blocks are only released by m3u8_free(); a new parse sets used back to 0
+{
+struct m3u8_arena_block *b;
+struct m3u8_arena_block **p = &pl->arena;
+for (b = pl->arena; b; b = b->next) {
+  if (b->size - b->used >= size) {
+    char *s = b->data + b->used;
+    b->used += size;
+    return s;
+    }
+  p = &b->next;
+  }
+size_t block_size = (size > M3U8_ARENA_BLOCK_SIZE) ? size : M3U8_ARENA_BLOCK_SIZE;
+b = malloc (sizeof (*b) + block_size);
+if (b == NULL)
+  return NULL;
+b->next = NULL;
+b->size = block_size;
+b->used = size;
+*p = b;
+return b->data;
+} // arena_alloc()
+
+static const char *arena_strndup (struct m3u8_playlist *pl, const char *s, size_t len)
+{
+char *d = arena_alloc (pl, len + 1);
+if (d == NULL)
+  return NULL;
+memcpy (d, s, len);
+d[len] = '\0';
+return d;
+} // arena_strndup()
+
+static int has_scheme (const char *uri, size_t len)
+// "http:", "https:" and so on before any '/', '?' or '#'
+{
+size_t i;
+for (i = 0; i < len; i++) {
+  if (uri[i] == ':')
+    return i > 0;
+  if (uri[i] == '/' || uri[i] == '?' || uri[i] == '#')
+    return 0;
+  }
+return 0;
+} // has_scheme()
+
+static const char *resolve_uri (struct m3u8_playlist *pl, const char *base_url, const char *uri, size_t len)
+/* return uri made absolute against base_url (RFC 3986 section 5.2, without
+removing "." and ".." segments which the servers resolve anyway) */
+{
+const char *scheme_end = base_url ? strstr (base_url, "://") : NULL;
+if (scheme_end == NULL || has_scheme (uri, len))
+  return arena_strndup (pl, uri, len);
+
+const char *host = scheme_end + 3;
+const char *path = host + strcspn (host, "/?#");
+size_t prefix;
+int add_root = 0;
+if (len >= 2 && uri[0] == '/' && uri[1] == '/')
+  prefix = scheme_end + 1 - base_url;  // network-path reference: keep "scheme:"
+else if (uri[0] == '/')
+  prefix = path - base_url;
+else {
+  // relative to the directory of the playlist, without its query string
+  const char *last = path;
+  const char *q;
+  for (q = path; *q && *q != '?' && *q != '#'; q++)
+    if (*q == '/')
+      last = q + 1;
+  prefix = last - base_url;
+  add_root = (last == path);  // "http://host" has no path
+  }
+char *d = arena_alloc (pl, prefix + add_root + len + 1);
+if (d == NULL)
+  return NULL;
+memcpy (d, base_url, prefix);
+if (add_root)
+  d[prefix] = '/';
+memcpy (d + prefix + add_root, uri, len);
+d[prefix + add_root + len] = '\0';
+return d;
+} // resolve_uri()
+
+// ==============================================================
+
+static int tag_value (const char *line, size_t len, const char *tag, const char **value, size_t *value_len)
+// if line starts with tag, point value at what follows it
+{
+size_t n = strlen (tag);
+if (len < n || memcmp (line, tag, n) != 0)
+  return 0;
+*value = line + n;
+*value_len = len - n;
+return 1;
+} // tag_value()
+
+static long long parse_integer (const char *s, size_t len, size_t *used)
+{
+long long v = 0;
+size_t i = 0;
+while (i < len && s[i] >= '0' && s[i] <= '9')
+  v = v * 10 + (s[i++] - '0');
+if (used)
+  *used = i;
+return v;
+} // parse_integer()
+
+static double parse_decimal (const char *s, size_t len)
+// #EXTINF duration; strtod() cannot be used as the line is not terminated
+{
+size_t i;
+double v = (double) parse_integer (s, len, &i);
+if (i < len && s[i] == '.') {
+  double scale = 0.1;
+  for (i++; i < len && s[i] >= '0' && s[i] <= '9'; i++) {
+    v += (s[i] - '0') * scale;
+    scale /= 10;
+    }
+  }
+return v;
+} // parse_decimal()
+
+static int attribute (const char *list, size_t len, const char *name, const char **value, size_t *value_len)
+/* find name=value in an attribute list such as BANDWIDTH=128000,CODECS="mp4a.40.2"
+the quotes of a quoted-string are removed */
+{
+size_t n = strlen (name);
+size_t i = 0;
+while (i < len) {
+  size_t start = i;
+  int quoted = 0;
+  // the end of this attribute, skipping the commas inside quotes
+  while (i < len && (quoted || list[i] != ',')) {
+    if (list[i] == '"')
+      quoted = !quoted;
+    i++;
+    }
+  if (i - start > n && memcmp (list + start, name, n) == 0 && list[start + n] == '=') {
+    const char *v = list + start + n + 1;
+    size_t vlen = i - (start + n + 1);
+    if (vlen >= 2 && v[0] == '"' && v[vlen - 1] == '"') {
+      v++;
+      vlen -= 2;
+      }
+    *value = v;
+    *value_len = vlen;
+    return 1;
+    }
+  i++; // the comma
+  }
+return 0;
+} // attribute()
+
+// ==============================================================
+
+static struct m3u8_segment *add_segment (struct m3u8_playlist *pl)
+{
+if (pl->segment_count == pl->segment_capacity) {
+  int capacity = pl->segment_capacity ? pl->segment_capacity * 2 : 64;
+  struct m3u8_segment *s = realloc (pl->segments, capacity * sizeof (*s));
+  if (s == NULL)
+    return NULL;
+  pl->segments = s;
+  pl->segment_capacity = capacity;
+  }
+return &pl->segments[pl->segment_count++];
+} // add_segment()
+
+static struct m3u8_variant *add_variant (struct m3u8_playlist *pl)
+{
+if (pl->variant_count == pl->variant_capacity) {
+  int capacity = pl->variant_capacity ? pl->variant_capacity * 2 : 8;
+  struct m3u8_variant *v = realloc (pl->variants, capacity * sizeof (*v));
+  if (v == NULL)
+    return NULL;
+  pl->variants = v;
+  pl->variant_capacity = capacity;
+  }
+return &pl->variants[pl->variant_count++];
+} // add_variant()
+
+// ==============================================================
+
+int m3u8_parse (struct m3u8_playlist *pl, const uint8_t *data, size_t size, const char *base_url)
+/* parse an m3u or m3u8 body into pl, replacing what it held before
+relative URIs are resolved against base_url (the URL of the playlist)
+a plain m3u file gives one segment per URL
+return 0, or -1 if out of memory */
+{
+const char *p = (const char *) data;
+const char *end = p + size;
+struct m3u8_arena_block *b;
+for (b = pl->arena; b; b = b->next)
+  b->used = 0;
+pl->target_duration = 0;
+pl->media_sequence = 0;
+pl->endlist = 0;
+pl->segment_count = 0;
+pl->variant_count = 0;
+
+// what the tags say about the next URI line
+double duration = 0;
+int discontinuity = 0;
+int64_t byterange_length = -1;
+int64_t byterange_offset = -1;
+int64_t byterange_next = 0;     // where a byte range without an offset starts
+const char *stream_inf = NULL;  // attribute list of #EXT-X-STREAM-INF
+size_t stream_inf_len = 0;
+
+while (p < end) {
+  const char *eol = memchr (p, '\n', end - p);
+  if (eol == NULL)
+    eol = end;
+  const char *line = p;
+  size_t len = eol - p;
+  p = eol + 1;
+  // trim the white space and the CR of CRLF line ends
+  while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' ' || line[len - 1] == '\t'))
+    len--;
+  while (len > 0 && (*line == ' ' || *line == '\t')) {
+    line++;
+    len--;
+    }
+  if (len == 0)
+    continue;
+
+  const char *v;
+  size_t vlen;
+  if (line[0] == '#') {
+    if (tag_value (line, len, "#EXTINF:", &v, &vlen))
+      duration = parse_decimal (v, vlen);
+    else if (tag_value (line, len, "#EXT-X-MEDIA-SEQUENCE:", &v, &vlen))
+      pl->media_sequence = (int) parse_integer (v, vlen, NULL);
+    else if (tag_value (line, len, "#EXT-X-TARGETDURATION:", &v, &vlen))
+      pl->target_duration = (int) parse_integer (v, vlen, NULL);
+    else if (tag_value (line, len, "#EXT-X-DISCONTINUITY", &v, &vlen) && vlen == 0)
+      discontinuity = 1;
+    else if (tag_value (line, len, "#EXT-X-BYTERANGE:", &v, &vlen)) {
+      size_t n;
+      byterange_length = parse_integer (v, vlen, &n);
+      byterange_offset = (n < vlen && v[n] == '@') ? parse_integer (v + n + 1, vlen - n - 1, NULL) : byterange_next;
+      }
+    else if (tag_value (line, len, "#EXT-X-ENDLIST", &v, &vlen) && vlen == 0)
+      pl->endlist = 1;
+    else if (tag_value (line, len, "#EXT-X-STREAM-INF:", &v, &vlen)) {
+      stream_inf = v;
+      stream_inf_len = vlen;
+      }
+    // other tags and comments are ignored
+    continue;
+    }
+
+  // a URI line
+  const char *uri = resolve_uri (pl, base_url, line, len);
+  if (uri == NULL)
+    return -1;
+  if (stream_inf) {
+    struct m3u8_variant *var = add_variant (pl);
+    if (var == NULL)
+      return -1;
+    var->uri = uri;
+    var->bandwidth = attribute (stream_inf, stream_inf_len, "BANDWIDTH", &v, &vlen) ? (long) parse_integer (v, vlen, NULL) : 0;
+    var->codecs = attribute (stream_inf, stream_inf_len, "CODECS", &v, &vlen) ? arena_strndup (pl, v, vlen) : "";
+    if (var->codecs == NULL)
+      return -1;
+    stream_inf = NULL;
+    continue;
+    }
+  struct m3u8_segment *seg = add_segment (pl);
+  if (seg == NULL)
+    return -1;
+  seg->media_sequence = pl->media_sequence + pl->segment_count - 1;
+  seg->duration = duration;
+  seg->uri = uri;
+  seg->discontinuity = discontinuity;
+  seg->byterange_length = byterange_length;
+  seg->byterange_offset = (byterange_length >= 0) ? byterange_offset : 0;
+  byterange_next = (byterange_length >= 0) ? byterange_offset + byterange_length : 0;
+  duration = 0;
+  discontinuity = 0;
+  byterange_length = -1;
+  } // while
+
+pi_radio_log ("m3u8_parse(): %d segments from media sequence %d, %d variants, target duration %d s%s\n",
+  pl->segment_count, pl->media_sequence, pl->variant_count, pl->target_duration, pl->endlist ? ", end of list" : "");
+return 0;
+} // m3u8_parse()
@@ -0,0 +1,209 @@
+/*
+File: metrics.c
+Description: latency histograms of the pipeline and their endpoint (-M)
+
+The stages time themselves with metrics_now_us() and hand the span to
+metrics_observe(), which only increments atomic counters: the bucket of
+the span, the count and the sum. The buckets are fixed, from 100 us to
+10 s, so that nothing is allocated or locked on the way. Without -M the
+clock is not even read.
+
+A thread serves the histograms on 127.0.0.1:port in the Prometheus text
+format, to any HTTP request, e.g.
+  curl http://127.0.0.1:9100/metrics
+followed by what the metrics_fn given to metrics_open() writes (the
+counters of the rest of the program).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pi_radio.h"
+
+#define METRICS_BUCKETS 16
+#define METRICS_REQUEST_MAX 4096
+// a client which does not send its request within this time is dropped
+#define METRICS_READ_TIMEOUT_S 5
+
+struct histogram {
+  atomic_ulong buckets[METRICS_BUCKETS + 1];  // the last one is +Inf
+  atomic_ullong sum_us;
+};
+
+// upper bounds of the buckets, in microseconds
+static const uint64_t bounds[METRICS_BUCKETS] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+  100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000 };
+
+// the metric and the stage label of each histogram; those of a metric follow each other
+static const struct {
+  const char *name;
+  const char *stage;
+  const char *help;
+} names[METRICS_HISTOGRAMS] = {
+  { "pi_radio_stage_seconds", "fetch", "Time of each call of a pipeline stage; fetch is a whole segment download, sink_write includes the wait for room in the device" },
+  { "pi_radio_stage_seconds", "demux", NULL },
+  { "pi_radio_stage_seconds", "decode", NULL },
+  { "pi_radio_stage_seconds", "resample", NULL },
+  { "pi_radio_stage_seconds", "sink_write", NULL },
+  { "pi_radio_switch_seconds", NULL, "Time from a station switch to its first audio in the sink" },
+  { "pi_radio_reconnect_seconds", NULL, "Time from a dropped stream, playlist or segment download to its data again" },
+  { "pi_radio_outage_seconds", NULL, "Time from a PCM ring underrun to audio in the sink again" },
+};
+
+static struct histogram histograms[METRICS_HISTOGRAMS];
+static int enabled;
+static int listen_fd = -1;
+static pthread_t metrics_thread;
+static metrics_fn write_more;
+
+// ==============================================================
+
+uint64_t metrics_now_us (void)
+// CLOCK_MONOTONIC in microseconds; 0 without -M
+{
+struct timespec ts;
+if (!enabled)
+  return 0;
+clock_gettime (CLOCK_MONOTONIC, &ts);
+return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+} // metrics_now_us()
+
+void metrics_observe (int histogram, uint64_t us)
+// any thread: count a span of us microseconds
+{
+int i;
+if (!enabled)
+  return;
+for (i = 0; i < METRICS_BUCKETS && us > bounds[i]; i++)
+  ;
+struct histogram *h = &histograms[histogram];
+atomic_fetch_add_explicit (&h->buckets[i], 1, memory_order_relaxed);
+atomic_fetch_add_explicit (&h->sum_us, us, memory_order_relaxed);
+} // metrics_observe()
+
+// ==============================================================
+
+static void write_histograms (FILE *fp)
+// the buckets of the Prometheus text format are cumulative
+{
+int h, i;
+for (h = 0; h < METRICS_HISTOGRAMS; h++) {
+  char labels[64] = "";
+  unsigned long count = 0;
+  if (names[h].help) {
+    fprintf (fp, "# HELP %s %s\n", names[h].name, names[h].help);
+    fprintf (fp, "# TYPE %s histogram\n", names[h].name);
+    }
+  if (names[h].stage)
+    snprintf (labels, sizeof (labels), "stage=\"%s\",", names[h].stage);
+  for (i = 0; i <= METRICS_BUCKETS; i++) {
+    count += atomic_load_explicit (&histograms[h].buckets[i], memory_order_relaxed);
+    if (i < METRICS_BUCKETS)
+      fprintf (fp, "%s_bucket{%sle=\"%g\"} %lu\n", names[h].name, labels, bounds[i] / 1e6, count);
+    else
+      fprintf (fp, "%s_bucket{%sle=\"+Inf\"} %lu\n", names[h].name, labels, count);
+    }
+  // the labels without their trailing comma
+  if (labels[0])
+    labels[strlen (labels) - 1] = '\0';
+  fprintf (fp, "%s_sum%s%s%s %.6f\n", names[h].name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+    atomic_load_explicit (&histograms[h].sum_us, memory_order_relaxed) / 1e6);
+  fprintf (fp, "%s_count%s%s%s %lu\n", names[h].name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "", count);
+  }
+} // write_histograms()
+
+static void *metrics_thread_main (void *arg)
+// one response per connection, whatever the request
+{
+char request[METRICS_REQUEST_MAX];
+struct timeval tv = { METRICS_READ_TIMEOUT_S, 0 };
+while (1) {
+  int fd = accept (listen_fd, NULL, NULL);
+  if (fd < 0) {
+    if (errno == EINTR || errno == ECONNABORTED)
+      continue;
+    break; // metrics_close() shut the socket down
+    }
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  // the request line and headers are not looked at, only waited for
+  ssize_t n = read (fd, request, sizeof (request));
+  if (n <= 0) {
+    close (fd);
+    continue;
+    }
+  char *body = NULL;
+  size_t size = 0;
+  FILE *fp = open_memstream (&body, &size);
+  if (fp == NULL) {
+    close (fd);
+    continue;
+    }
+  write_histograms (fp);
+  if (write_more)
+    write_more (fp);
+  fclose (fp);
+  char header[128];
+  int len = snprintf (header, sizeof (header), "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", size);
+  // the client may be gone already: no SIGPIPE
+  if (send (fd, header, len, MSG_NOSIGNAL) == len)
+    send (fd, body, size, MSG_NOSIGNAL);
+  free (body);
+  close (fd);
+  }
+return NULL;
+} // metrics_thread_main()
+
+// ==============================================================
+
+int metrics_open (int port, metrics_fn fn)
+// start timing the stages and serve them on 127.0.0.1:port; fn adds to what is served
+{
+struct sockaddr_in addr;
+int on = 1;
+memset (&addr, 0, sizeof (addr));
+addr.sin_family = AF_INET;
+addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+addr.sin_port = htons (port);
+if ((listen_fd = socket (AF_INET, SOCK_STREAM, 0)) < 0) {
+  pi_radio_log ("ERROR: socket() fails (%s)\n", strerror (errno));
+  return -1;
+  }
+setsockopt (listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+if (bind (listen_fd, (struct sockaddr *) &addr, sizeof (addr)) != 0 || listen (listen_fd, 4) != 0) {
+  pi_radio_log ("ERROR: cannot listen on 127.0.0.1:%d (%s)\n", port, strerror (errno));
+  close (listen_fd);
+  listen_fd = -1;
+  return -1;
+  }
+write_more = fn;
+int err = pthread_create (&metrics_thread, NULL, metrics_thread_main, NULL);
+if (err != 0) {
+  pi_radio_log ("ERROR: pthread_create() fails (%s)\n", strerror (err));
+  close (listen_fd);
+  listen_fd = -1;
+  return -1;
+  }
+pthread_detach (metrics_thread);
+enabled = 1;
+pi_radio_log ("serving the metrics on http://127.0.0.1:%d/metrics\n", port);
+return 0;
+} // metrics_open()
+
+void metrics_close (void)
+// at exit: stop listening; the thread is not waited for, as it may be writing to a slow client
+{
+if (listen_fd < 0)
+  return;
+shutdown (listen_fd, SHUT_RDWR); // accept() returns
+listen_fd = -1;
+} // metrics_close()
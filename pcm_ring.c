@@ -0,0 +1,236 @@
+/*
+File: pcm_ring.c
+Description: single-producer/single-consumer lock-free ring buffer of
+interleaved S16 stereo frames between the decoders and the ALSA writer
+
+write_pos and read_pos only ever increase; the producer owns write_pos and
+the consumer owns read_pos, so each side only needs to load the other side's
+position (acquire) and publish its own (release). No lock is taken.
+
+Besides the copying pcm_ring_write() and pcm_ring_read(), either side can
+work in place: *_begin() returns the contiguous part of the ring it may
+fill (or play) and *_commit() publishes what it did with it. The decoders
+produce straight into the ring that way and the playback thread hands the
+ring memory to the sink, so a frame is copied once between the decoder
+and the sound card.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pi_radio.h"
+
+// how long a blocked producer sleeps before checking for free space again
+#define PCM_RING_WAIT_US 5000
+
+// ==============================================================
+
+int pcm_ring_init (struct pcm_ring *ring, size_t min_frames)
+// the capacity is rounded up to a power of 2 so that positions can be masked
+{
+size_t capacity = 1024;
+while (capacity < min_frames)
+  capacity *= 2;
+ring->data = malloc (capacity * PCM_FRAME_BYTES);
+if (ring->data == NULL)
+  return -1;
+ring->capacity = capacity;
+atomic_init (&ring->write_pos, 0);
+atomic_init (&ring->read_pos, 0);
+atomic_init (&ring->closed, 0);
+atomic_init (&ring->interrupted, 0);
+atomic_init (&ring->discard, 0);
+atomic_init (&ring->discard_pos, 0);
+atomic_init (&ring->underruns, 0);
+atomic_init (&ring->max_fill, 0);
+return 0;
+} // pcm_ring_init()
+
+// ==============================================================
+
+size_t pcm_ring_fill (struct pcm_ring *ring)
+// number of frames waiting to be played
+{
+return atomic_load_explicit (&ring->write_pos, memory_order_acquire) -
+       atomic_load_explicit (&ring->read_pos, memory_order_acquire);
+} // pcm_ring_fill()
+
+// ==============================================================
+
+size_t pcm_ring_write (struct pcm_ring *ring, const uint8_t *pcm, size_t frames)
+// producer: copy as many frames as fit and return that number
+{
+size_t write_pos = atomic_load_explicit (&ring->write_pos, memory_order_relaxed);
+size_t read_pos = atomic_load_explicit (&ring->read_pos, memory_order_acquire);
+size_t space = ring->capacity - (write_pos - read_pos);
+if (frames > space)
+  frames = space;
+if (frames == 0)
+  return 0;
+
+size_t index = write_pos & (ring->capacity - 1);
+size_t first = ring->capacity - index;
+if (first > frames)
+  first = frames;
+memcpy (ring->data + index * PCM_FRAME_BYTES, pcm, first * PCM_FRAME_BYTES);
+memcpy (ring->data, pcm + first * PCM_FRAME_BYTES, (frames - first) * PCM_FRAME_BYTES);
+
+atomic_store_explicit (&ring->write_pos, write_pos + frames, memory_order_release);
+
+size_t fill = write_pos + frames - read_pos;
+if (fill > atomic_load_explicit (&ring->max_fill, memory_order_relaxed))
+  atomic_store_explicit (&ring->max_fill, fill, memory_order_relaxed);
+return frames;
+} // pcm_ring_write()
+
+int pcm_ring_write_all (struct pcm_ring *ring, const uint8_t *pcm, size_t frames)
+/* producer: write all the frames, sleeping while the ring is full
+return -1 if the ring is closed or interrupted in the meantime */
+{
+while (frames > 0) {
+  if (atomic_load_explicit (&ring->closed, memory_order_relaxed) ||
+      atomic_load_explicit (&ring->interrupted, memory_order_relaxed))
+    return -1;
+  size_t n = pcm_ring_write (ring, pcm, frames);
+  if (n == 0) {
+    usleep (PCM_RING_WAIT_US);
+    continue;
+    }
+  pcm += n * PCM_FRAME_BYTES;
+  frames -= n;
+  }
+return 0;
+} // pcm_ring_write_all()
+
+int pcm_ring_wait_space (struct pcm_ring *ring, size_t frames)
+/* producer: sleep until at least frames frames are free
+return -1 if the ring is closed or interrupted in the meantime */
+{
+while (1) {
+  if (atomic_load_explicit (&ring->closed, memory_order_relaxed) ||
+      atomic_load_explicit (&ring->interrupted, memory_order_relaxed))
+    return -1;
+  if (ring->capacity - pcm_ring_fill (ring) >= frames)
+    return 0;
+  usleep (PCM_RING_WAIT_US);
+  }
+} // pcm_ring_wait_space()
+
+size_t pcm_ring_write_begin (struct pcm_ring *ring, uint8_t **pcm)
+/* producer: point *pcm at the free space after the last frame written
+return the number of frames which fit there without wrapping, 0 if the ring is full */
+{
+size_t write_pos = atomic_load_explicit (&ring->write_pos, memory_order_relaxed);
+size_t read_pos = atomic_load_explicit (&ring->read_pos, memory_order_acquire);
+size_t space = ring->capacity - (write_pos - read_pos);
+size_t index = write_pos & (ring->capacity - 1);
+if (space > ring->capacity - index)
+  space = ring->capacity - index;
+*pcm = ring->data + index * PCM_FRAME_BYTES;
+return space;
+} // pcm_ring_write_begin()
+
+void pcm_ring_write_commit (struct pcm_ring *ring, size_t frames)
+// producer: publish frames frames written at the pointer of pcm_ring_write_begin()
+{
+size_t write_pos = atomic_load_explicit (&ring->write_pos, memory_order_relaxed);
+atomic_store_explicit (&ring->write_pos, write_pos + frames, memory_order_release);
+size_t fill = write_pos + frames - atomic_load_explicit (&ring->read_pos, memory_order_acquire);
+if (fill > atomic_load_explicit (&ring->max_fill, memory_order_relaxed))
+  atomic_store_explicit (&ring->max_fill, fill, memory_order_relaxed);
+} // pcm_ring_write_commit()
+
+// ==============================================================
+
+size_t pcm_ring_read (struct pcm_ring *ring, uint8_t *pcm, size_t frames)
+// consumer: copy out at most frames frames and return the number copied
+{
+size_t read_pos = atomic_load_explicit (&ring->read_pos, memory_order_relaxed);
+size_t write_pos = atomic_load_explicit (&ring->write_pos, memory_order_acquire);
+size_t fill = write_pos - read_pos;
+if (frames > fill)
+  frames = fill;
+if (frames == 0)
+  return 0;
+
+size_t index = read_pos & (ring->capacity - 1);
+size_t first = ring->capacity - index;
+if (first > frames)
+  first = frames;
+memcpy (pcm, ring->data + index * PCM_FRAME_BYTES, first * PCM_FRAME_BYTES);
+memcpy (pcm + first * PCM_FRAME_BYTES, ring->data, (frames - first) * PCM_FRAME_BYTES);
+
+atomic_store_explicit (&ring->read_pos, read_pos + frames, memory_order_release);
+return frames;
+} // pcm_ring_read()
+
+size_t pcm_ring_read_begin (struct pcm_ring *ring, const uint8_t **pcm)
+/* consumer: point *pcm at the oldest frame
+return the number of frames readable there without wrapping, 0 if the ring is empty */
+{
+size_t read_pos = atomic_load_explicit (&ring->read_pos, memory_order_relaxed);
+size_t fill = atomic_load_explicit (&ring->write_pos, memory_order_acquire) - read_pos;
+size_t index = read_pos & (ring->capacity - 1);
+if (fill > ring->capacity - index)
+  fill = ring->capacity - index;
+*pcm = ring->data + index * PCM_FRAME_BYTES;
+return fill;
+} // pcm_ring_read_begin()
+
+void pcm_ring_read_commit (struct pcm_ring *ring, size_t frames)
+// consumer: the frames at the pointer of pcm_ring_read_begin() are played; free them
+{
+size_t read_pos = atomic_load_explicit (&ring->read_pos, memory_order_relaxed);
+atomic_store_explicit (&ring->read_pos, read_pos + frames, memory_order_release);
+} // pcm_ring_read_commit()
+
+// ==============================================================
+
+void pcm_ring_close (struct pcm_ring *ring)
+// no more frames will be written; blocked producers give up
+{
+atomic_store_explicit (&ring->closed, 1, memory_order_release);
+} // pcm_ring_close()
+
+void pcm_ring_interrupt (struct pcm_ring *ring, int on)
+/* any thread: while on, the producers give up as if the ring were closed
+but the consumer keeps going; used to stop a station's decoder */
+{
+atomic_store_explicit (&ring->interrupted, on, memory_order_release);
+} // pcm_ring_interrupt()
+
+void pcm_ring_discard (struct pcm_ring *ring)
+/* any thread, while no producer writes: drop every frame written so far
+the consumer skips them at its next pcm_ring_take_discard() */
+{
+atomic_store_explicit (&ring->discard_pos, atomic_load_explicit (&ring->write_pos, memory_order_acquire), memory_order_relaxed);
+atomic_store_explicit (&ring->discard, 1, memory_order_release);
+} // pcm_ring_discard()
+
+int pcm_ring_take_discard (struct pcm_ring *ring)
+// consumer: carry out a pending pcm_ring_discard(); return 1 if there was one
+{
+if (!atomic_exchange_explicit (&ring->discard, 0, memory_order_acquire))
+  return 0;
+size_t discard_pos = atomic_load_explicit (&ring->discard_pos, memory_order_relaxed);
+// the consumer may already have read past it into the frames of the next producer
+if (discard_pos - atomic_load_explicit (&ring->read_pos, memory_order_relaxed) <= ring->capacity)
+  atomic_store_explicit (&ring->read_pos, discard_pos, memory_order_release);
+return 1;
+} // pcm_ring_take_discard()
+
+size_t pcm_ring_read_discarded (struct pcm_ring *ring, uint8_t *pcm, size_t frames)
+/* consumer, before pcm_ring_take_discard(): copy out at most frames of the
+frames to be dropped, the ones the consumer would have played next */
+{
+if (!atomic_load_explicit (&ring->discard, memory_order_acquire))
+  return 0;
+size_t read_pos = atomic_load_explicit (&ring->read_pos, memory_order_relaxed);
+size_t left = atomic_load_explicit (&ring->discard_pos, memory_order_relaxed) - read_pos;
+if (left > ring->capacity)
+  return 0; // already read past it, see pcm_ring_take_discard()
+if (frames > left)
+  frames = left;
+return pcm_ring_read (ring, pcm, frames);
+} // pcm_ring_read_discarded()
@@ -3,6 +3,31 @@ File: pi_radio.c
 Description: an internet radio on Raspberry Pi
 Modification history
 2021-10-13  copy from pi_rthk and add logic to play m3u8 playlist streaming mpeg ts 
+2026-10-16  decode the TS segments from memory and play them directly without temp files
+2026-10-16  prefetch the segments in the main thread while a player thread decodes and plays
+2026-10-16  the decoders fill a lock-free PCM ring which a playback thread feeds to ALSA
+2026-10-16  keep one ffmpeg decoder open across the segments of the stream
+2026-10-16  demux and decode the TS segments while they are still downloading
+2026-10-16  fetch through a pool of keep-alive/HTTP2 handles with several segments in flight
+2026-10-16  reload the live playlist on a timer following EXT-X-TARGETDURATION
+2026-10-16  parse the playlists with m3u8.c: any number of segments, relative URIs, byte ranges
+2026-10-16  switch between the variants of a master playlist with abr.c
+2026-10-16  log through the asynchronous logger of log.c; -v for the per-frame debug lines
+2026-10-16  -d ALSA device, -t run time and -S statistics file for the benchmark in bench/
+2026-10-16  play through the audio sinks of sink.c (ALSA with mmap, WAV file, null)
+2026-10-16  decode in place into the PCM ring and hand the ring memory to the sink
+2026-10-16  -L sink buffer profile (low-latency, default, resilient); recovery and delay statistics
+2026-10-16  -C daemon mode: play/preload/stop/status/quit on a control socket, warm standby station
+2026-10-16  -R record mode: many stations at once into files, processed by a worker pool (record.c)
+2026-10-16  decode the complete segments waiting behind the playing one in parallel (decode_pool.c)
+2026-10-16  HLS output at the stream's own rate; no swr when it is already stereo at that rate, a lighter resampling filter otherwise
+2026-10-16  dsp.c: SIMD volume with dither, mono downmix, crossfade on station switch, float to S16
+2026-10-16  -N loudness normalization: EBU R128 measure of the frames played, per station cache
+2026-10-16  -T timeshift store: pause, rewind, live over a memory-mapped ring file (timeshift.c)
+2026-10-16  play the ADTS AAC streams of Icecast/Shoutcast as they come, as the MP3 ones
+2026-10-16  -D clock drift compensation: the audio buffered kept constant by a slight resampling (drift.c)
+2026-10-16  -M latency histograms of fetch, demux, decode, resample and sink write on a Prometheus endpoint (metrics.c)
+2026-10-16  reconnect dropped streams with backoff, resume broken segments, conceal the outage with fades and silence
 */
 
 /* the following is the MIME and filename extension mapping used in this program
@@ -14,6 +39,7 @@ mp3  audio/mpeg
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 #include <unistd.h>
@@ -22,85 +48,75 @@ mp3  audio/mpeg
 #include <stdarg.h>
 #include <time.h>
 #include <libgen.h>
+#include <pthread.h>
 
 #include <curl/curl.h>
 #include <mpg123.h>
 #include <alsa/asoundlib.h>
 
-int ffmpeg_decode (char *, char *);
+#include "pi_radio.h"
 
 #define LOG_FILENAME "/tmp/pi_radio.log"
-#define VOX_FILENAME "/tmp/pi_radio.vox"
-#define TS_FILENAME  "/tmp/pi_radio.ts"
-#define M3U8_FILENAME  "/tmp/pi_radio.m3u8"
-// ALSA on Pi only support 44100 ?!?
-#define VOX_SAMPLING_RATE 44100
-
-char refresh_url[1000];
-char last_url[1000];
+#define TIMESHIFT_FILENAME "/var/tmp/pi_radio.timeshift"
+// how much audio the PCM ring holds before the playback starts (or restarts after an underrun)
+#define DEFAULT_BUFFER_MS 2000
+// the PCM ring is sized for this rate so that any stream rate fits
+#define PCM_RING_MAX_RATE 48000
+// frames handed to the audio sink at a time
+#define PLAYBACK_PERIOD_FRAMES 1024
+// the buffer filled again after a station switch; more builds up while playing
+#define SWITCH_BUFFER_MS 200
+// the previous station fades out over the start of the new one
+#define CROSSFADE_MS 300
+// an underrun fades out over what is left of the ring below this, the audio back fades in over it,
+// and in between the sink is kept this far ahead with silence
+#define CONCEAL_MS 50
+// fetch_perform() failures in a row before the program gives up
+#define MAX_FETCH_FAILURES 10
+// above 100 the louder samples clip
+#define MAX_VOLUME 200
 
 mpg123_handle *mh = NULL;
-snd_pcm_t *playback_handle;
-CURL *http_handle;
-CURLM *multi_handle;
+size_t mp3_outblock;     // mpg123_outblock(): the most one frame decodes to
+uint8_t *mp3_bounce;     // decoded into when the ring has no contiguous mp3_outblock free
+struct ffmpeg_decoder *aac_dec;  // the AAC streams, decoded like the MP3 ones in the main thread
+struct audio_sink *sink;
 int channels;
 
-char content_type[2000];
-FILE *curl_output_fp;
-char playlist_url[10][2000];  // maximum 10 playlist each 2000 char long
-int media_sequence_fetched;
-int media_sequence_played;
-
-FILE *log_fp;
-
-// ==============================================================
-
-void pi_radio_log (char * format, ... )
-{
-time_t t1;
-struct tm *tm1;
-time( &t1 );
-tm1 = localtime( &t1 );
-fprintf ((log_fp ? log_fp : stderr), "%04d-%02d-%02d %02d:%02d:%02d ", tm1->tm_year+1900, tm1->tm_mon+1, tm1->tm_mday, tm1->tm_hour, tm1->tm_min, tm1->tm_sec);
-
-va_list args;
-va_start (args, format);
-
-vfprintf ((log_fp ? log_fp : stderr), format, args);
-va_end (args);
-if (log_fp)
-  fflush (log_fp);
-}
+struct station *station;  // the station playing, if any
+struct station *standby;  // -C: the station preloaded for the next switch
+char *control_path;       // -C: the control socket; the program then runs as a daemon
+int quit_requested;       // the quit command
+char *record_spec;        // -R: record the stations into this directory instead of playing
+
+struct pcm_ring pcm_ring;
+pthread_t playback_thread;
+int playback_started;
+atomic_int playback_abort;  // stop at once, dropping what is buffered
+atomic_uint pcm_rate;  // rate of the frames in pcm_ring; 0 until the decoder knows it
+int buffer_ms = DEFAULT_BUFFER_MS;
+atomic_ullong switch_ms;  // monotonic_ms() of the last station switch, until its audio plays
+atomic_int volume = 100;  // -V and the volume command: percent of the decoded level
+int mono;                 // -m: both channels play their average
+int normalize;            // -N: bring the stations to normalize_lufs
+double normalize_lufs;
+int drift;                // -D: compensate the drift between the station's clock and the sink's
+atomic_int upstream_ms;   // -D: the segments of the playing station not decoded yet, set by the main thread
+int16_t *fade;            // the frames of the previous station kept for the crossfade
+size_t fade_len, fade_pos;
+unsigned int fade_rate;
+int timeshift_mb;         // -T: size of the timeshift store
+uint64_t paused_ms;       // the pause command: the arrival in the store of what played last, 0 if not paused
+
+char *sink_spec = "default";  // -d: ALSA device, "null" or "wav:FILE"
+char *sink_profile = "default";  // -L: buffer profile of the sink
+char *stats_filename;          // -S: where to write the statistics at exit
+int metrics_port;              // -M: serve the metrics on 127.0.0.1 at this port
+uint64_t start_ms;             // monotonic_ms() when main() starts
+atomic_ullong first_audio_ms;  // monotonic_ms() of the first write to the sink, 0 before
 
 // ==============================================================
 
-int parse_m3u8_file (char *m3u8_filename)
-/* parse an m3u8 file and return the following
-0 : fail
-1 : if return one URL (result stored in playlisturl[0])
->1: if it contains multiple ts files 
-*/
-{
-FILE *fp;
-char line[2000];
-int url_count = 0;
-fp = fopen (m3u8_filename, "r");
-while (fgets(line, 2000, fp) != NULL) {
-  pi_radio_log ("m3u8 contains: %s", line);
-  if (memcmp (line, "#EXT-X-MEDIA-SEQUENCE:", 22) == 0) {
-    sscanf (line+22, "%d", &media_sequence_fetched);
-    continue;
-    }
-  if (line [0] == '#')
-    continue;
-  sscanf (line, "%s", playlist_url[url_count]);
-  url_count++;
-  if (media_sequence_fetched == 0)
-    break;
-  } // while
-return url_count;
-}
-
 void str_trim (char *s)
 // triming the trailing white spaces by modifying the original string
 {
@@ -136,20 +152,37 @@ int encoding;
 int err = MPG123_OK;
 int frames;
 
-pi_radio_log ("Inside %s() with %d bytes\n", __func__, nmemb);
+pi_radio_debug ("Inside %s() with %d bytes\n", __func__, nmemb);
 
-pi_radio_log ("calling mpg123_feed()\n");
+pi_radio_debug ("calling mpg123_feed()\n");
 err = mpg123_feed (mh, ptr, nmemb); // size is always 1 in curl
 if (err != MPG123_OK) {
-  pi_radio_log ("ERROR: mpg123_feed fails (%s)", mpg123_plain_strerror(err));
-  return 0; // return 0 means error to curl
+  // the stream goes on: the decoder starts again at the next frame header
+  pi_radio_log ("ERROR: mpg123_feed fails (%s); dropping %zu bytes\n", mpg123_plain_strerror(err), nmemb);
+  mpg123_open_feed (mh);
+  return nmemb;
   }
 
 off_t frame_offset;
 unsigned char *audio;
+uint8_t *out;
 do {
-  pi_radio_log ("calling mpg123_decode_frame()\n");
+  /* decode in place into the PCM ring if a whole frame fits before its end,
+  otherwise into mp3_bounce and copy; this also throttles the download when the ring is full */
+  if (pcm_ring_wait_space (&pcm_ring, mp3_outblock / PCM_FRAME_BYTES) != 0) {
+    if (!atomic_load (&pcm_ring.closed))
+      return nmemb; // interrupted by a command, which stops the decoding but not the download
+    pi_radio_log ("ERROR: pcm_ring_wait_space() fails as the ring is closed\n");
+    return 0; // return 0 means error to curl
+    }
+  if (pcm_ring_write_begin (&pcm_ring, &out) < mp3_outblock / PCM_FRAME_BYTES)
+    out = mp3_bounce;
+  mpg123_replace_buffer (mh, out, mp3_outblock);
+  pi_radio_debug ("calling mpg123_decode_frame()\n");
+  uint64_t start = metrics_now_us ();
   err = mpg123_decode_frame (mh, &frame_offset, &audio, &decoded_bytes);
+  if (err == MPG123_OK)
+    metrics_observe (METRICS_DECODE, metrics_now_us () - start);
   switch (err) {
     case MPG123_NEW_FORMAT:
       pi_radio_log ("mpg123_decode_frame returns MPG123_NEW_FORMAT\n");
@@ -160,34 +193,28 @@ do {
         }
       pi_radio_log ("rate = %ld channels = %d encoding = %d (%s)\n", rate, channels, encoding,
         (encoding == MPG123_ENC_SIGNED_16 ? "MPG123_ENC_SIGNED_16" : " "));
-      pi_radio_log ("calling mpg123_format()\n");
-      if (MPG123_OK != mpg123_format (mh, rate, channels, encoding)) {
-        pi_radio_log ("mpg123_format fails\n");
-        return 0; // return 0 means error to curl
-        }
-      pi_radio_log ("calling snd_pcm_set_params\n");
-      if ((err = snd_pcm_set_params(playback_handle,
-             SND_PCM_FORMAT_S16_LE,
-             SND_PCM_ACCESS_RW_INTERLEAVED,
-             channels,
-             (unsigned int) rate,
-             0, /* disallow resampling */
-             5000000)) < 0) {   /* 5sec */
-        pi_radio_log("ERROR: snd_pcm_set_params() fails: %s\n", snd_strerror(err));
-        return 0; // return 0 means error to curl
-        }
+      // the output format is restricted to stereo S16 in main(); only the rate follows the stream
+      if (atomic_load (&pcm_rate) == 0)
+        atomic_store (&pcm_rate, rate);
+      else if (atomic_load (&pcm_rate) != rate)
+        pi_radio_log ("WARNING: rate changes from %u to %ld in the middle of the stream\n", atomic_load (&pcm_rate), rate);
        break;
      case MPG123_NEED_MORE:
-       pi_radio_log ("mpg123_decode_frame returns MPG123_NEED_MORE with decoded_bytes = %d\n", decoded_bytes);
+       pi_radio_debug ("mpg123_decode_frame returns MPG123_NEED_MORE with decoded_bytes = %d\n", decoded_bytes);
        break;
      case MPG123_OK :
-       pi_radio_log ("mpg123_decode_frame() returns MPG124_OK with decoded_bytes = %d\n", decoded_bytes);
+       pi_radio_debug ("mpg123_decode_frame() returns MPG124_OK with decoded_bytes = %d\n", decoded_bytes);
        if (decoded_bytes > 0) {
          frames = decoded_bytes / 2 / channels; /* 2 == 16(sample size) / 8(bits per byte) */
-         pi_radio_log ("calling snd_pcm_writei()\n");
-         err = snd_pcm_writei (playback_handle, audio, frames);
-         if (err != frames) {
-           pi_radio_log ("ERROR: snd_pcm_writei() fails (%s)\n", snd_strerror (err));
+         if (audio != mp3_bounce) {
+           pcm_ring_write_commit (&pcm_ring, frames);
+           break;
+           }
+         pi_radio_debug ("calling pcm_ring_write_all() with %d frames\n", frames);
+         if (pcm_ring_write_all (&pcm_ring, audio, frames) != 0) {
+           if (!atomic_load (&pcm_ring.closed))
+             return nmemb;
+           pi_radio_log ("ERROR: pcm_ring_write_all() fails as the ring is closed\n");
            return 0; // return 0 means error to curl
            }
          }
@@ -201,97 +228,341 @@ do {
 return nmemb;
 } // curl_write_callback_handler()
 
+size_t aac_write_handler (const uint8_t *data, size_t size)
+/* the counterpart of curl_write_callback_handler() for an ADTS AAC stream:
+the bytes are parsed and decoded straight into the PCM ring, which throttles
+the download when it is full; only a partial frame is kept in between */
+{
+int err = ffmpeg_decoder_feed_adts (aac_dec, data, size);
+// the decoder follows the rate of the stream
+if (atomic_load (&pcm_rate) == 0 && ffmpeg_decoder_output_rate (aac_dec) != 0)
+  atomic_store (&pcm_rate, ffmpeg_decoder_output_rate (aac_dec));
+if (err < 0 && atomic_load (&pcm_ring.closed)) {
+  pi_radio_log ("ERROR: the AAC stream cannot be decoded as the ring is closed\n");
+  return 0; // return 0 means error to curl
+  }
+if (err < 0 && !atomic_load (&pcm_ring.interrupted))
+  pi_radio_log ("ERROR: ffmpeg_decoder_feed_adts() returns %d\n", err);
+return size;
+} // aac_write_handler()
+
+int aac_decoder_reset (void)
+// forget the frames and the format of the previous AAC stream
+{
+ffmpeg_decoder_free (aac_dec);
+if ((aac_dec = ffmpeg_decoder_new ()) == NULL) {
+  pi_radio_log ("ERROR: ffmpeg_decoder_new() fails\n");
+  return -1;
+  }
+ffmpeg_decoder_set_ring (aac_dec, &pcm_ring);
+return 0;
+} // aac_decoder_reset()
+
 // ==============================================================
 
-static size_t curl_header_callback (char *buffer, size_t size, size_t nitems, void *userdata)
+int mem_buffer_append (struct mem_buffer *buf, const uint8_t *data, size_t size)
+// append data to a mem_buffer, growing it if needed; return -1 if out of memory
 {
-size_t numbytes = size * nitems;
-char b[1000];
-memcpy (b, buffer, (numbytes>999) ? 999 : numbytes);
-b[numbytes]= '\0';
-str_trim (b);
-pi_radio_log ("HTTP HEADER : [%s]\n", b);
-str_toupper (b);
-
-if (memcmp (b, "CONTENT-TYPE:", 13) == 0) {
-  sscanf (b+13, "%s", content_type);
-  if (strcmp (content_type, "APPLICATION/VND.APPLE.MPEGURL") == 0) {
-    pi_radio_log ("Content-Type (%s) is m3u8\n", content_type);
-    curl_easy_setopt (http_handle, CURLOPT_WRITEFUNCTION, fwrite);
-    curl_output_fp = fopen (M3U8_FILENAME, "w");
-    curl_easy_setopt (http_handle, CURLOPT_WRITEDATA, curl_output_fp);
-    }
-  else if (strcmp (content_type, "VIDEO/MP2T") == 0) {
-    pi_radio_log ("Content-Type (%s) is TS stream\n", content_type);
-    curl_easy_setopt (http_handle, CURLOPT_WRITEFUNCTION, fwrite);
-    curl_output_fp = fopen (TS_FILENAME, "w");
-    curl_easy_setopt (http_handle, CURLOPT_WRITEDATA, curl_output_fp);
-    }
-  else if (strcmp (content_type, "AUDIO/X-MPEGURL") == 0) {
-    pi_radio_log ("Content-Type (%s) is m3u\n", content_type);
-    curl_easy_setopt (http_handle, CURLOPT_WRITEFUNCTION, fwrite);
-    curl_output_fp = fopen ("tmp.m3u", "w");
-    curl_easy_setopt (http_handle, CURLOPT_WRITEDATA, curl_output_fp);
-    }
-  else if (strcmp (content_type, "AUDIO/MPEG") == 0) {
-    pi_radio_log ("Content-Type (%s) is MP3\n", content_type);
-    curl_easy_setopt (http_handle, CURLOPT_WRITEFUNCTION, curl_write_callback_handler);
-    }
-  else if (strcmp (content_type, "AUDIO/AAC") == 0) {
-    pi_radio_log ("Content-Type (%s) is not supported\n", content_type);
-    return 0; // error exit
+if (buf->size + size > buf->capacity) {
+  size_t capacity = (buf->capacity ? buf->capacity : 65536);
+  while (capacity < buf->size + size)
+    capacity *= 2;
+  uint8_t *p = realloc (buf->data, capacity);
+  if (p == NULL) {
+    pi_radio_log ("ERROR: realloc() fails for %zu bytes\n", capacity);
+    return -1;
     }
+  buf->data = p;
+  buf->capacity = capacity;
   }
-return numbytes;
-} // curl_header_callback ()
+memcpy (buf->data + buf->size, data, size);
+buf->size += size;
+return 0;
+} // mem_buffer_append()
 
 // ==============================================================
 
-int pi_aplay (char *vox_filename, int rate)
+size_t buffer_target_frames (unsigned int rate, int ms)
 {
-int err;
-FILE *vox_fp;
-vox_fp = fopen (vox_filename, "r");
-if (vox_fp == NULL) {
-  pi_radio_log ("ERROR: cannot open %s\n", vox_filename);
-  return 0;
+return (size_t) rate * ms / 1000;
+}
+
+int playback_prefill (int ms, unsigned int silence_rate)
+/* wait until the PCM ring holds ms of audio
+return 0 when it does, 1 if a station switch comes first, or -1 if the ring is closed.
+After an underrun silence_rate is that of the sink, which is fed silence
+meanwhile as it plays it: the device does not underrun in turn, and the audio
+back plays at once */
+{
+static const int16_t silence[2 * PLAYBACK_PERIOD_FRAMES];
+uint64_t start = monotonic_ms ();
+uint64_t silence_frames = 0;
+while (atomic_load (&pcm_rate) == 0 || pcm_ring_fill (&pcm_ring) < buffer_target_frames (atomic_load (&pcm_rate), ms)) {
+  if (atomic_load (&pcm_ring.discard))
+    return 1;
+  if (atomic_load (&pcm_ring.closed))
+    return (pcm_ring_fill (&pcm_ring) > 0 && atomic_load (&pcm_rate) != 0) ? 0 : -1;
+  // not faster than real time, for the sinks which take anything at once
+  if (silence_rate && audio_sink_delay_ms (sink) < CONCEAL_MS &&
+      silence_frames * 1000 / silence_rate < monotonic_ms () - start + CONCEAL_MS) {
+    if (audio_sink_write_all (sink, (const uint8_t *) silence, PLAYBACK_PERIOD_FRAMES) != 0)
+      silence_rate = 0;
+    silence_frames += PLAYBACK_PERIOD_FRAMES;
+    continue;
+    }
+  usleep (10000);
   }
+return 0;
+} // playback_prefill()
 
-while (1) {
-  char buffer[409600];
-  int n = fread (buffer, 1, 409600, vox_fp);
-  if (n == 0)
-    break;
-  int frames = n / 4;
-  pi_radio_log ("calling snd_pcm_writei() with %d frames\n", frames);
-    err = snd_pcm_writei (playback_handle, buffer, frames);
-  if (err != frames) {
-    pi_radio_log ("ERROR: snd_pcm_writei() failed (%s)\n", snd_strerror (err));
-    return 0;
+void playback_ramp (int16_t *pcm, size_t frames, float from, float to)
+// the gain goes from from to to over the frames: the fades around an underrun
+{
+size_t i;
+float step = (to - from) / frames;
+for (i = 0; i < frames; i++) {
+  float g = from + step * (i + 1);
+  pcm[2 * i] = (int16_t) (pcm[2 * i] * g);
+  pcm[2 * i + 1] = (int16_t) (pcm[2 * i + 1] * g);
+  }
+} // playback_ramp()
+
+void playback_effects (int16_t *pcm, size_t frames, unsigned int rate)
+/* the crossfade after a switch, then -m and the volume, in place on the frames about to play
+-N measures them first, as the station gives them */
+{
+float gain = atomic_load (&volume) / 100.0f;
+if (normalize)
+  gain *= loudness_process (pcm, frames, rate);
+if (fade_pos < fade_len) {
+  size_t n = (frames < fade_len - fade_pos) ? frames : fade_len - fade_pos;
+  dsp_crossfade (pcm, fade + 2 * fade_pos, n, fade_pos, fade_len);
+  fade_pos += n;
+  }
+if (mono)
+  dsp_downmix_mono (pcm, frames);
+if (gain != 1.0f)
+  dsp_gain (pcm, frames, gain);
+} // playback_effects()
+
+double playback_latency_ms (unsigned int rate)
+// -D: what is buffered from the network to the DAC
+{
+return (double) pcm_ring_fill (&pcm_ring) * 1000 / rate + audio_sink_delay_ms (sink) + atomic_load (&upstream_ms);
+} // playback_latency_ms()
+
+void *playback_thread_main (void *arg)
+/* consumer side of pcm_ring: feed the audio sink with up to PLAYBACK_PERIOD_FRAMES at a time
+the sink reads the ring memory in place; the frames are freed once it took them.
+After a station switch the sink is flushed and only SWITCH_BUFFER_MS is
+waited for; it is configured again if the new station has another rate.
+The frames the switch drops are kept for the crossfade into the new station.
+When the ring runs low while the station is still coming (a stream which
+dropped), the last frames fade out and silence follows until the ring is
+full again; the audio then fades back in.
+With -D they are resampled by drift.c on their way to the sink */
+{
+const uint8_t *pcm;
+int prefill_ms = buffer_ms;
+unsigned int rate = 0;  // that of the sink
+float conceal_gain = 1.0f;  // below 1 while fading out before an underrun, and in after it
+uint64_t outage_ms = 0;     // monotonic_ms() of the underrun, until the audio plays again
+
+pi_radio_log ("playback thread waits for %d ms of audio\n", buffer_ms);
+while (!atomic_load (&playback_abort)) {
+  // a play command, not a stop: keep the start of what the previous station had buffered
+  if (rate != 0 && atomic_load (&pcm_ring.discard) && atomic_load (&switch_ms) != 0) {
+    fade_len = pcm_ring_read_discarded (&pcm_ring, (uint8_t *) fade, buffer_target_frames (rate, CROSSFADE_MS));
+    fade_pos = 0;
+    fade_rate = rate;
+    }
+  if (pcm_ring_take_discard (&pcm_ring)) {
+    pi_radio_log ("station switch: flushing the sink\n");
+    audio_sink_flush (sink);
+    if (normalize)
+      loudness_switch ();
+    prefill_ms = (buffer_ms < SWITCH_BUFFER_MS) ? buffer_ms : SWITCH_BUFFER_MS;
+    // not an outage: the new station starts at its level, crossfaded
+    conceal_gain = 1.0f;
+    outage_ms = 0;
+    }
+  if (prefill_ms > 0) {
+    int err = playback_prefill (prefill_ms, outage_ms ? rate : 0);
+    if (err < 0)
+      break;
+    if (err > 0)
+      continue; // another switch
+    prefill_ms = 0;
+    // the decoders resample to this rate; it changes only with the station
+    rate = atomic_load (&pcm_rate);
+    if (audio_sink_configure (sink, rate) != 0) {
+      pi_radio_log ("ERROR: audio_sink_configure() fails\n");
+      exit (1);
+      }
+    if (fade_pos < fade_len && fade_rate != rate)
+      fade_len = 0; // no crossfade between two rates
+    // the level to keep is measured again once the buffers are full
+    if (drift && drift_reset (rate) != 0)
+      pi_radio_log ("ERROR: drift_reset() fails; no drift compensation\n");
+    }
+  size_t frames = pcm_ring_read_begin (&pcm_ring, &pcm);
+  if (frames == 0) {
+    if (atomic_load (&pcm_ring.closed))
+      break;
+    if (atomic_load (&pcm_ring.discard))
+      continue;
+    atomic_fetch_add (&pcm_ring.underruns, 1);
+    pi_radio_log ("PCM ring underrun (%u so far, max fill %zu frames); prefill again\n",
+      atomic_load (&pcm_ring.underruns), atomic_load (&pcm_ring.max_fill));
+    prefill_ms = buffer_ms;
+    outage_ms = monotonic_ms ();
+    continue;
+    }
+  if (frames > PLAYBACK_PERIOD_FRAMES)
+    frames = PLAYBACK_PERIOD_FRAMES;
+  // the frames belong to the consumer until they are committed
+  playback_effects ((int16_t *) pcm, frames, rate);
+  size_t fill = pcm_ring_fill (&pcm_ring);
+  if (fill < buffer_target_frames (rate, CONCEAL_MS) && !atomic_load (&pcm_ring.closed)) {
+    // down to 0 at the last frame of the ring, unless more comes in the meantime
+    float to = conceal_gain * (fill - frames) / fill;
+    playback_ramp ((int16_t *) pcm, frames, conceal_gain, to);
+    conceal_gain = to;
+    }
+  else if (conceal_gain < 1.0f) {
+    float to = conceal_gain + (float) frames / buffer_target_frames (rate, CONCEAL_MS);
+    if (to > 1.0f)
+      to = 1.0f;
+    playback_ramp ((int16_t *) pcm, frames, conceal_gain, to);
+    conceal_gain = to;
+    }
+  const uint8_t *out = pcm;
+  size_t out_frames = frames;
+  if (drift) {
+    drift_update (playback_latency_ms (rate), frames);
+    out_frames = drift_convert (pcm, frames, &out);
     }
-  } // while (1)
-fclose (vox_fp);
-} // pi_aplay
+  uint64_t start = metrics_now_us ();
+  if (audio_sink_write_all (sink, out, out_frames) != 0)
+    pi_radio_log ("ERROR: audio_sink_write_all() fails; %zu frames lost\n", out_frames);
+  metrics_observe (METRICS_SINK_WRITE, metrics_now_us () - start);
+  pcm_ring_read_commit (&pcm_ring, frames);
+  if (atomic_load (&first_audio_ms) == 0)
+    atomic_store (&first_audio_ms, monotonic_ms ());
+  if (outage_ms) {
+    pi_radio_log ("the audio is back after %d ms of silence\n", (int) (monotonic_ms () - outage_ms));
+    metrics_observe (METRICS_OUTAGE, (monotonic_ms () - outage_ms) * 1000);
+    outage_ms = 0;
+    }
+  uint64_t switched = atomic_exchange (&switch_ms, 0);
+  if (switched) {
+    pi_radio_log ("the new station plays %d ms after the switch\n", (int) (monotonic_ms () - switched));
+    metrics_observe (METRICS_SWITCH, (monotonic_ms () - switched) * 1000);
+    }
+  } // while (!playback_abort)
+
+if (!atomic_load (&playback_abort)) {
+  pi_radio_log ("going to call audio_sink_drain()\n");
+  audio_sink_drain (sink);
+  }
+pi_radio_log ("playback thread exits\n");
+return NULL;
+} // playback_thread_main()
+
+void playback_finish (void)
+// no more audio will be decoded; play what is left in the ring and wait for it
+{
+pcm_ring_close (&pcm_ring);
+if (playback_started) {
+  pthread_join (playback_thread, NULL);
+  playback_started = 0;
+  }
+} // playback_finish()
 
 // ==============================================================
 
+void write_stats (void)
+// -S: key=value lines read by bench/bench.py
+{
+FILE *fp = fopen (stats_filename, "w");
+if (fp == NULL) {
+  pi_radio_log ("ERROR: cannot open \"%s\"\n", stats_filename);
+  return;
+  }
+uint64_t first_audio = atomic_load (&first_audio_ms);
+fprintf (fp, "time_to_first_audio_ms=%lld\n", first_audio ? (long long) (first_audio - start_ms) : -1LL);
+station_write_stats (fp);
+fprintf (fp, "pcm_ring_underruns=%u\n", atomic_load (&pcm_ring.underruns));
+fprintf (fp, "pcm_ring_max_fill_frames=%zu\n", atomic_load (&pcm_ring.max_fill));
+fprintf (fp, "sink_underruns=%u\n", sink ? audio_sink_underruns (sink) : 0);
+fprintf (fp, "sink_recoveries=%u\n", sink ? audio_sink_recoveries (sink) : 0);
+fprintf (fp, "sink_delay_ms=%d\n", sink ? audio_sink_delay_ms (sink) : 0);
+if (drift)
+  fprintf (fp, "drift_ppm=%.1f\n", drift_ppm ());
+fclose (fp);
+} // write_stats()
+
+void write_metrics (FILE *fp)
+// metrics_fn of -M: the counters of write_stats(), in the Prometheus text format
+{
+uint64_t first_audio = atomic_load (&first_audio_ms);
+unsigned int rate = atomic_load (&pcm_rate);
+fprintf (fp, "# HELP pi_radio_time_to_first_audio_seconds From the start of the program to its first audio in the sink\n");
+fprintf (fp, "# TYPE pi_radio_time_to_first_audio_seconds gauge\n");
+if (first_audio)
+  fprintf (fp, "pi_radio_time_to_first_audio_seconds %.3f\n", (first_audio - start_ms) / 1e3);
+fprintf (fp, "# HELP pi_radio_pcm_ring_underruns_total The PCM ring ran dry while playing\n");
+fprintf (fp, "# TYPE pi_radio_pcm_ring_underruns_total counter\n");
+fprintf (fp, "pi_radio_pcm_ring_underruns_total %u\n", atomic_load (&pcm_ring.underruns));
+fprintf (fp, "# HELP pi_radio_pcm_ring_fill_seconds Audio decoded and not yet handed to the sink\n");
+fprintf (fp, "# TYPE pi_radio_pcm_ring_fill_seconds gauge\n");
+fprintf (fp, "pi_radio_pcm_ring_fill_seconds %.3f\n", rate ? (double) pcm_ring_fill (&pcm_ring) / rate : 0.0);
+fprintf (fp, "# HELP pi_radio_sink_underruns_total Underruns of the audio device\n");
+fprintf (fp, "# TYPE pi_radio_sink_underruns_total counter\n");
+fprintf (fp, "pi_radio_sink_underruns_total %u\n", audio_sink_underruns (sink));
+fprintf (fp, "# HELP pi_radio_sink_recoveries_total Errors the audio device was recovered from, underruns included\n");
+fprintf (fp, "# TYPE pi_radio_sink_recoveries_total counter\n");
+fprintf (fp, "pi_radio_sink_recoveries_total %u\n", audio_sink_recoveries (sink));
+fprintf (fp, "# HELP pi_radio_sink_delay_seconds Audio queued in the device after the last write\n");
+fprintf (fp, "# TYPE pi_radio_sink_delay_seconds gauge\n");
+fprintf (fp, "pi_radio_sink_delay_seconds %.3f\n", audio_sink_delay_ms (sink) / 1e3);
+if (drift) {
+  fprintf (fp, "# HELP pi_radio_drift_ppm Rate correction of the drift compensation, positive when the station is played faster\n");
+  fprintf (fp, "# TYPE pi_radio_drift_ppm gauge\n");
+  fprintf (fp, "pi_radio_drift_ppm %.1f\n", drift_ppm ());
+  }
+} // write_metrics()
+
 void radio_clean_up()
 {
+control_close ();
+metrics_close ();
+record_finish ();
+if (stats_filename)
+  write_stats ();
 pi_radio_log ("Calling mpg123_delete()\n");
 mpg123_delete (mh);
-pi_radio_log ("Calling snd_pcm_drop()\n");
-snd_pcm_drop(playback_handle);
-pi_radio_log ("Calling snd_pcm_close()\n");
-snd_pcm_close (playback_handle);
-pi_radio_log ("Calling curl_multi_remove_handle()\n");
-curl_multi_remove_handle(multi_handle, http_handle);
-pi_radio_log ("Calling curl_easy_cleanup()\n");
-curl_easy_cleanup(http_handle);
-pi_radio_log ("Calling curl_multi_cleanup()\n");
-curl_multi_cleanup(multi_handle);
-pi_radio_log ("Calling curl_global_cleanup()\n");
-curl_global_cleanup();
-fclose (log_fp);
+ffmpeg_decoder_free (aac_dec);
+// the playback thread must be done with the sink before it is closed
+if (playback_started && !pthread_equal (pthread_self (), playback_thread)) {
+  atomic_store (&playback_abort, 1);
+  pcm_ring_close (&pcm_ring);
+  pthread_join (playback_thread, NULL);
+  playback_started = 0;
+  }
+if (normalize && !playback_started)
+  loudness_save ();
+// the replay thread writes to the PCM ring, closed above
+timeshift_close ();
+if (sink) {
+  pi_radio_log ("Calling audio_sink_close()\n");
+  audio_sink_close (sink);
+  sink = NULL;
+  }
+decode_pool_stop ();
+pi_radio_log ("Calling fetch_cleanup()\n");
+fetch_cleanup();
+log_close ();
 }
 
 // ==============================================================
@@ -310,52 +581,361 @@ void default_signal_handler(int signal_number)
   exit(0);  // will call pi_radio_exit()
 }
 
+// ==============================================================
 // ==============================================================
 
-int start_curl (char *url)
+void stop_station (void)
+/* stop the station playing and drop its audio from the PCM ring
+the ring is interrupted first so that the decoder gives up the room it waits for */
 {
-strcpy (last_url, url);
-int still_running = 1; /* keep number of running handles */
-
-pi_radio_log ("start_curl() starts with url = %s\n", url);
-
-curl_easy_setopt (http_handle, CURLOPT_URL, url);
+pcm_ring_interrupt (&pcm_ring, 1);
+timeshift_stop_replay ();
+paused_ms = 0;
+if (station) {
+  pi_radio_log ("stopping station \"%s\"\n", station->url);
+  station_free (station);
+  station = NULL;
+  }
+atomic_store (&pcm_rate, 0); // the next station sets it
+pcm_ring_discard (&pcm_ring);
+pcm_ring_interrupt (&pcm_ring, 0);
+} // stop_station()
+
+int play_station (const char *url)
+/* switch to url, taking the standby station if it is the one preloaded
+the audio device, the mpg123 handle and the curl handles stay open */
+{
+atomic_store (&switch_ms, monotonic_ms ());
+if (normalize)
+  loudness_set_station (url);
+stop_station ();
+if (standby && strcmp (standby->url, url) == 0 && !standby->failed) {
+  pi_radio_log ("playing the standby station \"%s\" (%s)\n", url, station_state_name (standby));
+  station = standby;
+  standby = NULL;
+  }
+else if ((station = station_new (url)) == NULL) {
+  pi_radio_log ("ERROR: cannot load \"%s\"\n", url);
+  return -1;
+  }
+mpg123_open_feed (mh); // forget the frames of the previous MP3 stream
+aac_decoder_reset ();
+timeshift_new_epoch ();
+station_play (station);
+return 0;
+} // play_station()
 
-// curl_easy_setopt(http_handle, CURLOPT_NOSIGNAL, 1L);
+// ==============================================================
 
-curl_multi_add_handle(multi_handle, http_handle);
+uint64_t timeshift_position (void)
+/* -T: the arrival in the store of what plays now, as monotonic_ms(), to
+the segment (HLS) or the second (MP3), less what is buffered after it */
+{
+unsigned int rate = atomic_load (&pcm_rate);
+uint64_t ms = 0;
+if (timeshift_replaying ())
+  ms = timeshift_replay_ms ();
+else if (atomic_load (&station->playing_sequence) >= 0)
+  ms = timeshift_sequence_ms (atomic_load (&station->playing_sequence));
+if (ms == 0)
+  ms = monotonic_ms ();
+if (rate != 0)
+  ms -= pcm_ring_fill (&pcm_ring) * 1000 / rate;
+return ms - audio_sink_delay_ms (sink);
+} // timeshift_position()
+
+void timeshift_live (void)
+// back to the station decoding as it downloads
+{
+pcm_ring_interrupt (&pcm_ring, 1);
+timeshift_stop_replay ();
+atomic_store (&pcm_rate, 0);
+pcm_ring_discard (&pcm_ring);
+pcm_ring_interrupt (&pcm_ring, 0);
+mpg123_open_feed (mh); // the MP3 stream starts again at the next frame header
+aac_decoder_reset ();
+station_shift (station, 0);
+} // timeshift_live()
+
+int timeshift_shift (uint64_t ms)
+/* stop decoding the station, which keeps downloading into the store, and
+replay the store from ms; only pause if ms is 0
+return -1 if the store is empty or the replay cannot start: the station then plays live */
+{
+if (timeshift_oldest_ms () == 0) {
+  if (atomic_load (&station->shifted))
+    timeshift_live ();
+  return -1;
+  }
+pcm_ring_interrupt (&pcm_ring, 1);
+station_shift (station, 1);
+timeshift_stop_replay ();
+atomic_store (&pcm_rate, 0); // the replay sets it
+pcm_ring_discard (&pcm_ring);
+pcm_ring_interrupt (&pcm_ring, 0);
+if (ms != 0 && timeshift_replay (ms) != 0) {
+  timeshift_live ();
+  return -1;
+  }
+return 0;
+} // timeshift_shift()
 
-do {
-  CURLMcode mc = curl_multi_perform(multi_handle, &still_running);
-  if(!mc)
-/* since the version of libcurl in Raspberry Pi is quite old */
-#if LIBCURL_VERSION_NUM >= 0x076600
-    mc = curl_multi_poll(multi_handle, NULL, 0, 1000, NULL);
-#else
-    mc = curl_multi_wait (multi_handle, NULL, 0, 1000, NULL);
-#endif
+// ==============================================================
 
-  if (mc) {
-    pi_radio_log("ERROR: curl_multi_poll() or curl_multi_wait() failed, code %d.\n", (int)mc);
-    break;
+void control_notify (const char *command)
+// control_notify_fn: the main thread may be stuck in the MP3 decoder waiting for room in the ring
+{
+if (strncmp (command, "play ", 5) == 0 || strcmp (command, "stop") == 0 || strcmp (command, "quit") == 0 ||
+    strcmp (command, "pause") == 0 || strcmp (command, "resume") == 0 || strncmp (command, "rewind ", 7) == 0 ||
+    strcmp (command, "live") == 0)
+  pcm_ring_interrupt (&pcm_ring, 1);
+} // control_notify()
+
+void control_command (const char *command, char *reply, size_t size)
+/* control_fn of the control socket:
+  play URL     switch to URL
+  preload URL  load URL as the standby station, to switch to it quickly later
+  stop         stop playing
+  volume N     set the volume to N percent of the decoded level
+  pause        -T: stop playing, the station going on into the timeshift store
+  resume       -T: play from where it was paused
+  rewind N     -T: play from N minutes before what plays (or was paused)
+  live         -T: back to the live stream
+  status       the stations and their state
+  quit         exit */
+{
+if (strncmp (command, "play ", 5) == 0) {
+  if (play_station (command + 5) != 0)
+    snprintf (reply, size, "error: cannot load %s\n", command + 5);
+  else
+    snprintf (reply, size, "ok\n");
+  }
+else if (strncmp (command, "preload ", 8) == 0) {
+  if (standby)
+    station_free (standby);
+  if ((standby = station_new (command + 8)) == NULL)
+    snprintf (reply, size, "error: cannot load %s\n", command + 8);
+  else
+    snprintf (reply, size, "ok\n");
+  }
+else if (strcmp (command, "stop") == 0) {
+  stop_station ();
+  snprintf (reply, size, "ok\n");
+  }
+else if (strncmp (command, "volume ", 7) == 0) {
+  int v = atoi (command + 7);
+  if (v < 0 || v > MAX_VOLUME)
+    snprintf (reply, size, "error: the volume is from 0 to %d\n", MAX_VOLUME);
+  else {
+    atomic_store (&volume, v);
+    snprintf (reply, size, "ok\n");
     }
+  }
+else if ((strcmp (command, "pause") == 0 || strcmp (command, "resume") == 0 || strncmp (command, "rewind ", 7) == 0 ||
+    strcmp (command, "live") == 0) && (!timeshift_enabled () || station == NULL))
+  snprintf (reply, size, "error: no station playing with -T\n");
+else if (strcmp (command, "pause") == 0) {
+  uint64_t ms = timeshift_position ();
+  if (paused_ms == 0 && timeshift_shift (0) != 0)
+    snprintf (reply, size, "error: nothing in the timeshift store\n");
+  else {
+    if (paused_ms == 0)
+      paused_ms = ms;
+    snprintf (reply, size, "ok\n");
+    }
+  }
+else if (strcmp (command, "resume") == 0) {
+  if (paused_ms == 0)
+    snprintf (reply, size, "error: not paused\n");
+  else if (timeshift_shift (paused_ms) != 0) {
+    paused_ms = 0;
+    snprintf (reply, size, "error: nothing in the timeshift store; playing live\n");
+    }
+  else {
+    paused_ms = 0;
+    snprintf (reply, size, "ok\n");
+    }
+  }
+else if (strncmp (command, "rewind ", 7) == 0) {
+  uint64_t back = (uint64_t) atoi (command + 7) * 60000;
+  uint64_t ms = paused_ms ? paused_ms : timeshift_position ();
+  uint64_t oldest = timeshift_oldest_ms ();
+  if (atoi (command + 7) <= 0)
+    snprintf (reply, size, "error: rewind takes minutes\n");
+  else if (oldest == 0)
+    snprintf (reply, size, "error: nothing in the timeshift store\n");
+  else {
+    // before the oldest mark, the replay starts from it
+    ms = (ms > oldest && back < ms - oldest) ? ms - back : oldest;
+    if (timeshift_shift (ms) != 0)
+      snprintf (reply, size, "error: nothing in the timeshift store; playing live\n");
+    else
+      snprintf (reply, size, "ok\n");
+    paused_ms = 0;
+    }
+  }
+else if (strcmp (command, "live") == 0) {
+  timeshift_live ();
+  paused_ms = 0;
+  snprintf (reply, size, "ok\n");
+  }
+else if (strcmp (command, "status") == 0) {
+  int n = 0;
+  if (station)
+    n += snprintf (reply + n, size - n, "playing %s %s\n", station_state_name (station), station->url);
+  else
+    n += snprintf (reply + n, size - n, "stopped\n");
+  if (standby && n < size)
+    n += snprintf (reply + n, size - n, "standby %s %s\n", station_state_name (standby), standby->url);
+  if (n < size)
+    n += snprintf (reply + n, size - n, "volume %d\n", atomic_load (&volume));
+  if (drift && n < size)
+    n += snprintf (reply + n, size - n, "drift %+.1f ppm\n", drift_ppm ());
+  if (station && timeshift_enabled () && n < size) {
+    if (paused_ms)
+      snprintf (reply + n, size - n, "timeshift paused %d s behind\n", (int) ((monotonic_ms () - paused_ms) / 1000));
+    else if (timeshift_replaying ())
+      snprintf (reply + n, size - n, "timeshift %d s behind\n", (int) ((monotonic_ms () - timeshift_position ()) / 1000));
+    else
+      snprintf (reply + n, size - n, "timeshift live\n");
+    }
+  }
+else if (strcmp (command, "quit") == 0) {
+  quit_requested = 1;
+  snprintf (reply, size, "ok\n");
+  }
+else
+  snprintf (reply, size, "error: unknown command\n");
+// control_notify() may have interrupted the ring for nothing
+pcm_ring_interrupt (&pcm_ring, 0);
+} // control_command()
 
-  } while (still_running);
-
-curl_multi_remove_handle(multi_handle, http_handle);
-
-if (curl_output_fp != NULL)
-  fclose (curl_output_fp);
-
-pi_radio_log ("end of start_curl()\n");
+// ==============================================================
 
-} // start_curl()
+int record_main (char **urls, int count)
+/* -R: record count stations at once; the main thread does the downloads
+and the workers of record.c the rest. Return when every station has ended */
+{
+struct station **stations = calloc (count, sizeof (*stations));
+int i, live, failures = 0;
+if (stations == NULL || fetch_init () != 0) {
+  pi_radio_log ("ERROR: fetch_init() fails\n");
+  return 1;
+  }
+if (record_init (record_spec, (int) sysconf (_SC_NPROCESSORS_ONLN)) != 0)
+  return 1;
+for (i = 0; i < count; i++) {
+  if ((stations[i] = station_new (urls[i])) == NULL)
+    pi_radio_log ("ERROR: cannot load \"%s\"\n", urls[i]);
+  else if (record_station (stations[i], i) != 0)
+    return 1;
+  }
+do {
+  live = 0;
+  for (i = 0; i < count; i++) {
+    if (stations[i] == NULL || stations[i]->state == STATION_ENDED)
+      continue;
+    station_poll (stations[i]);
+    live++;
+    }
+  if (fetch_perform (1000) >= 0)
+    failures = 0;
+  else if (++failures == MAX_FETCH_FAILURES) {
+    pi_radio_log ("ERROR: fetch_perform() fails %d times in a row\n", failures);
+    return 1;
+    }
+  else
+    usleep (100000); // the transfers make progress again on the next call
+  } while (live > 0);
+record_finish ();
+pi_radio_log ("Program exits\n");
+return 0;
+} // record_main()
 
 /*********************************/
 int main(int argc, char **argv)
 {
-if (argc != 2) {
-  fprintf (stderr, "Usage: %s radio_url\n", basename(argv[0]));
+int opt;
+int run_seconds = 0;
+int fetch_failures = 0;
+start_ms = monotonic_ms ();
+while ((opt = getopt (argc, argv, "b:C:Dd:L:mM:N:R:S:t:T:vV:")) != -1) {
+  switch (opt) {
+    case 'b':
+      buffer_ms = atoi (optarg);
+      break;
+    case 'C':
+      control_path = optarg;
+      break;
+    case 'D':
+      drift = 1;
+      break;
+    case 'd':
+      sink_spec = optarg;
+      break;
+    case 'L':
+      sink_profile = optarg;
+      break;
+    case 'm':
+      mono = 1;
+      break;
+    case 'M':
+      metrics_port = atoi (optarg);
+      break;
+    case 'N':
+      normalize = 1;
+      normalize_lufs = atof (optarg);
+      break;
+    case 'R':
+      record_spec = optarg;
+      break;
+    case 'S':
+      stats_filename = optarg;
+      break;
+    case 't':
+      run_seconds = atoi (optarg);
+      break;
+    case 'T':
+      timeshift_mb = atoi (optarg);
+      break;
+    case 'v':
+      atomic_store (&log_level, LOG_LEVEL_DEBUG);
+      break;
+    case 'V':
+      atomic_store (&volume, atoi (optarg));
+      break;
+    default:
+      argc = 0; // show the usage
+      break;
+    }
+  }
+
+// the URL is optional in daemon mode, where the control socket says what to play; -R takes several
+if (argc == 0 || (optind < argc - 1 && record_spec == NULL) || (optind == argc && control_path == NULL) || buffer_ms <= 0 || timeshift_mb < 0 || metrics_port < 0 || metrics_port > 65535 ||
+    atomic_load (&volume) < 0 || atomic_load (&volume) > MAX_VOLUME) {
+  fprintf (stderr, "Usage: %s [-b buffer_ms] [-C socket] [-D] [-d sink] [-L profile] [-m] [-M port] [-N lufs] [-V volume] [-T MB] [-t seconds] [-S stats_file] [-v] radio_url\n", basename(argv[0]));
+  fprintf (stderr, "       %s -R [wav:]dir [-t seconds] [-v] radio_url...\n", basename(argv[0]));
+  fprintf (stderr, "  -b buffer_ms : audio buffered before playback starts (default %d)\n", DEFAULT_BUFFER_MS);
+  fprintf (stderr, "  -C socket    : run as a daemon taking commands on this UNIX socket, one per connection:\n");
+  fprintf (stderr, "                 play URL, preload URL, stop, volume N, pause, resume, rewind N, live, status, quit;\n");
+  fprintf (stderr, "                 radio_url is then optional\n");
+  fprintf (stderr, "  -D           : compensate the drift between the clock of the station and that of\n");
+  fprintf (stderr, "                 the audio device, keeping the latency constant over days\n");
+  fprintf (stderr, "  -d sink      : ALSA device (default \"default\"), \"null\" to discard the audio in real time\n");
+  fprintf (stderr, "                 or \"wav:FILE\" to write a WAV file\n");
+  fprintf (stderr, "  -L profile   : buffer of the sink, low-latency, default or resilient\n");
+  fprintf (stderr, "  -m           : mono, both channels play their average\n");
+  fprintf (stderr, "  -M port      : serve latency histograms and counters on http://127.0.0.1:port/metrics\n");
+  fprintf (stderr, "                 in the Prometheus text format\n");
+  fprintf (stderr, "  -N lufs      : bring every station to this loudness, e.g. -18 (EBU R128 measure)\n");
+  fprintf (stderr, "  -R dir       : record every radio_url into dir instead of playing, remuxed as\n");
+  fprintf (stderr, "                 stationNN.mp3/.aac, or decoded to stationNN.wav with wav:dir\n");
+  fprintf (stderr, "  -t seconds   : exit after this many seconds\n");
+  fprintf (stderr, "  -T MB        : keep the last MB of the stream in " TIMESHIFT_FILENAME "\n");
+  fprintf (stderr, "                 for the pause, resume, rewind and live commands of -C\n");
+  fprintf (stderr, "  -S file      : write playback statistics to file at exit\n");
+  fprintf (stderr, "  -v           : also log the per-frame debug lines\n");
+  fprintf (stderr, "  -V volume    : percent of the decoded level, 0 to %d (default 100)\n", MAX_VOLUME);
   fprintf (stderr, "\nThe following URL's have been tested okay\n");
   fprintf (stderr, "\nMETRO 104\n");
   fprintf (stderr, "https://metroradio-lh.akamaihd.net/i/104_h@349798/master.m3u8\n");
@@ -377,8 +957,7 @@ if (argc != 2) {
   return 1;
   }
 
-log_fp = fopen (LOG_FILENAME, "w");
-if (log_fp == NULL) {
+if (log_open (LOG_FILENAME) != 0) {
   fprintf (stderr, "ERROR: Cannot open \"" LOG_FILENAME "\". Program exits\n");
   exit (1);
   }
@@ -390,15 +969,14 @@ atexit(pi_radio_atexit); // for abnormal exit
 pi_radio_log ("Calling signal() to set signal handler\n");
 signal(SIGINT, default_signal_handler); // for Ctrl-C
 signal(SIGSTOP, default_signal_handler); // for Ctrl-C
+signal(SIGTERM, default_signal_handler);
+if (run_seconds > 0) {
+  signal(SIGALRM, default_signal_handler);
+  alarm (run_seconds);
+  }
 
 int err;
 
-pi_radio_log ("Calling snd_pcm_open()\n");
-if ((err = snd_pcm_open (&playback_handle, "default", SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
-  pi_radio_log ("ERROR: snd_pcm_open() fails (%s)\n", snd_strerror (err));
-  return 1;
-  }
-
 curl_version_info_data *d = curl_version_info (CURLVERSION_NOW);
 pi_radio_log ("curl version %s\n", d->version);
 
@@ -416,6 +994,23 @@ if (err != MPG123_OK) {
   }
 #endif
 
+dsp_init (NULL);
+pi_radio_log ("PCM processing with the %s kernels\n", dsp_name ());
+if (normalize)
+  loudness_init (normalize_lufs);
+
+if (record_spec)
+  return record_main (argv + optind, argc - optind);
+
+if ((sink = audio_sink_open (sink_spec)) == NULL) {
+  pi_radio_log ("ERROR: cannot open the audio sink \"%s\"\n", sink_spec);
+  return 1;
+  }
+if (audio_sink_set_profile (sink, sink_profile) != 0) {
+  pi_radio_log ("ERROR: unknown sink profile \"%s\"\n", sink_profile);
+  return 1;
+  }
+
 pi_radio_log ("Calling mpg123_new()\n");
 mh = mpg123_new(NULL, &err);
 if (mh  == NULL) {
@@ -423,6 +1018,14 @@ if (mh  == NULL) {
   return 0;
   }
 
+// always decode to stereo S16 so that the frames fit pcm_ring; the rate follows the stream
+pi_radio_log ("Calling mpg123_format_none() and mpg123_format()\n");
+mpg123_format_none (mh);
+static const long mpg123_rates[] = { 8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000 };
+int r;
+for (r = 0; r < sizeof (mpg123_rates) / sizeof (mpg123_rates[0]); r++)
+  mpg123_format (mh, mpg123_rates[r], MPG123_STEREO, MPG123_ENC_SIGNED_16);
+
 pi_radio_log ("Calling mpg123_open_feed()\n");
 err = mpg123_open_feed (mh);
 if (err != MPG123_OK) {
@@ -430,126 +1033,85 @@ if (err != MPG123_OK) {
   return 0;
   }
 
-pi_radio_log ("Calling curl_global_init()\n");
-curl_global_init(CURL_GLOBAL_DEFAULT);
-
-http_handle = curl_easy_init();
-
-curl_easy_setopt (http_handle, CURLOPT_HEADERFUNCTION, curl_header_callback);
-
-// curl_easy_setopt(http_handle, CURLOPT_VERBOSE, 1L);
-
-// RTHK does not like a null user-agent in libcurl
-curl_easy_setopt(http_handle, CURLOPT_USERAGENT, "curl/7.64.0");
- 
-multi_handle = curl_multi_init();
-
-// if the Content-Type is audio/mpeg, the following function will not return
-int curl_rtn = start_curl (argv[1]);
-
-if (strcmp (content_type, "AUDIO/X-MPEGURL") == 0) {
-  pi_radio_log ("got an m3u file and therefore need to parse the data\n");
-  if (parse_m3u8_file("tmp.m3u") == 1) {
-    pi_radio_log ("only one URL is returned and assume it is a MP3 (for the RTHK case)\n");
-    start_curl (playlist_url[0]); // will not return if the Content-Type is audio/mpeg
-    }
-  else {
-    pi_radio_log ("ERROR: expect only one URL\n");
-    exit (1);
-    }
-  } // content_type == "AUDIO/X-MPEGURL"
+mp3_outblock = mpg123_outblock (mh);
+if ((mp3_bounce = malloc (mp3_outblock)) == NULL) {
+  pi_radio_log ("ERROR: malloc() of %zu bytes fails\n", mp3_outblock);
+  return 1;
+  }
 
+pi_radio_log ("Calling pcm_ring_init() for %d ms\n", buffer_ms);
+// room for twice the target depth so that the decoders can run ahead, and for an MP3 frame
+size_t ring_frames = (size_t) PCM_RING_MAX_RATE * buffer_ms * 2 / 1000;
+if (ring_frames < 2 * mp3_outblock / PCM_FRAME_BYTES)
+  ring_frames = 2 * mp3_outblock / PCM_FRAME_BYTES;
+if (pcm_ring_init (&pcm_ring, ring_frames) != 0) {
+  pi_radio_log ("ERROR: pcm_ring_init() fails\n");
+  return 1;
+  }
+// before the threads start, so that they time their stages
+if (metrics_port > 0 && metrics_open (metrics_port, write_metrics) != 0)
+  return 1;
+if (aac_decoder_reset () != 0)
+  return 1;
+if ((fade = malloc ((size_t) PCM_RING_MAX_RATE * CROSSFADE_MS / 1000 * PCM_FRAME_BYTES)) == NULL) {
+  pi_radio_log ("ERROR: malloc() of the crossfade buffer fails\n");
+  return 1;
+  }
+pi_radio_log ("Calling pthread_create() for the playback thread\n");
+if ((err = pthread_create (&playback_thread, NULL, playback_thread_main, NULL)) != 0) {
+  pi_radio_log ("ERROR: pthread_create() fails (%s)\n", strerror (err));
+  return 1;
+  }
+playback_started = 1;
 
-if (strcmp (content_type, "APPLICATION/VND.APPLE.MPEGURL") != 0) {
-  pi_radio_log ("ERROR: content_type (%s) is not \"APPLICATION/VND.APPLE.MPEGURL\"\n", content_type);
-  exit (1);
+if (fetch_init () != 0) {
+  pi_radio_log ("ERROR: fetch_init() fails\n");
+  return 1;
   }
+// the cores left to the main, player and playback threads decode the segments of a catch-up
+if (decode_pool_start ((int) sysconf (_SC_NPROCESSORS_ONLN) - 1) != 0)
+  return 1;
+if (timeshift_mb > 0 && timeshift_open (TIMESHIFT_FILENAME, (size_t) timeshift_mb << 20) != 0)
+  return 1;
 
-  pi_radio_log ("going to call snd_pcm_set_params()\n");
-  if ((err = snd_pcm_set_params(playback_handle,
-         SND_PCM_FORMAT_S16_LE,
-         SND_PCM_ACCESS_RW_INTERLEAVED,
-         2,
-         VOX_SAMPLING_RATE,
-         0, /* disallow resampling */
-         100000000)) < 0) {   // 10 sec
-    pi_radio_log("ERROR: snd_pcm_set_params() fails: %s\n", snd_strerror(err));
+if (optind < argc) {
+  if (normalize)
+    loudness_set_station (argv[optind]);
+  if ((station = station_new (argv[optind])) == NULL)
     exit (1);
-    }
+  station_play (station);
+  }
+if (control_path && control_open (control_path, control_command, control_notify) != 0)
+  exit (1);
 
-  snd_pcm_sw_params_t *sw_params;
-  snd_pcm_sw_params_malloc (&sw_params);
-  snd_pcm_sw_params_current (playback_handle, sw_params);
-  snd_pcm_sw_params_set_start_threshold(playback_handle, sw_params, 0);
-
-  pi_radio_log ("got a m3u8 file and therefore need to parse the data\n");
-  int num_url = parse_m3u8_file(M3U8_FILENAME);
-  if (num_url == 1) {
-    pi_radio_log ("num_url == 1 and need to collect the next playlist\n");
-    start_curl (playlist_url[0]); 
-    if (strcmp (content_type, "APPLICATION/VND.APPLE.MPEGURL") != 0) {
-      pi_radio_log ("ERROR: the next playlist is not an m3u8 file\n");
+// the event loop: downloads, playlist reloads, the commands of the control socket
+while (!quit_requested) {
+  if (station)
+    station_poll (station);
+  // what the timeshift replays is not downloading
+  atomic_store (&upstream_ms, (station && !timeshift_replaying () && paused_ms == 0) ? station_queued_ms (station) : 0);
+  if (standby)
+    station_poll (standby);
+  if (control_path == NULL && station->state == STATION_ENDED) {
+    if (station->failed)
       exit (1);
-      }
-    num_url = parse_m3u8_file(M3U8_FILENAME);
-    }
-  if (num_url <=1 ) {
-    pi_radio_log ("ERROR: num_url (%d) is not greater than 1\n");
-    exit (1);
-    }
-  pi_radio_log ("parse_m3u8_file returns %d URL with media sequence = %d\n", num_url, media_sequence_fetched);
-  strcpy (refresh_url, last_url);
-  pi_radio_log ("set refresh_url to \"%s\"\n", refresh_url);
-
-  int i;
-  for (i=0; i<num_url; i++) {
-    pi_radio_log ("handing url[%d] \"%s\"\n", i, playlist_url[i]);
-    start_curl (playlist_url[i]); 
-    pi_radio_log ("calling ffmpeg_decode()\n");
-    ffmpeg_decode (TS_FILENAME, VOX_FILENAME);
-    pi_radio_log ("calling pi_aplay()\n");
-    pi_aplay (VOX_FILENAME, VOX_SAMPLING_RATE);
-    media_sequence_played = media_sequence_fetched + i;
-    pi_radio_log ("updating media_sequence_played to %d\n", media_sequence_played);
-    }
-
-  while (1) {
-  start_curl (refresh_url);
-  if (strcmp (content_type, "APPLICATION/VND.APPLE.MPEGURL") != 0) {
-    pi_radio_log ("ERROR: the next playlist is not an m3u8 file\n");
-    exit (1);
+    pi_radio_log ("end of the stream; playing what is left in the buffer\n");
+    break;
     }
-  num_url = parse_m3u8_file(M3U8_FILENAME);
-  if (num_url <=1) {
-    pi_radio_log ("ERROR: num_url (%d) is not greater than 1\n");
+  control_poll ();
+  if (fetch_perform (1000) >= 0)
+    fetch_failures = 0;
+  else if (++fetch_failures == MAX_FETCH_FAILURES) {
+    pi_radio_log ("ERROR: fetch_perform() fails %d times in a row\n", fetch_failures);
     exit (1);
     }
-  pi_radio_log ("parse_m3u8_file returns %d URL with media sequence = %d\n", num_url, media_sequence_fetched);
-  if ((media_sequence_fetched + num_url - 1) > media_sequence_played) {
-    pi_radio_log ("new media sequence received\n");
-  for (i=0; i<num_url; i++) {
-    if ((media_sequence_fetched + i) > media_sequence_played) {
-      pi_radio_log ("handing url[%d] \"%s\"\n", i, playlist_url[i]);
-      start_curl (playlist_url[i]); 
-      pi_radio_log ("calling ffmpeg_decode()\n");
-      ffmpeg_decode (TS_FILENAME, VOX_FILENAME);
-      pi_radio_log ("calling pi_aplay()\n");
-      pi_aplay (VOX_FILENAME, VOX_SAMPLING_RATE);
-      media_sequence_played = media_sequence_fetched + i;
-      pi_radio_log ("updating media_sequence_played to %d\n", media_sequence_played);
-      }
-    } // for
-    }
-  else {
-    pi_radio_log ("sleep 4 seconds\n");
-    sleep (4);
-    }
-  } // while (1)
+  else
+    usleep (100000); // the transfers make progress again on the next call
+  } // while (!quit_requested)
 
-pi_radio_log ("going to call snd_pcm_drain()\n");
-snd_pcm_drain(playback_handle);
+if (quit_requested)
+  atomic_store (&playback_abort, 1);
+playback_finish ();
 pi_radio_log ("Program exits\n");
 return 0;
 } // main
-
-
@@ -0,0 +1,467 @@
+/*
+File: pi_radio.h
+Description: declarations shared by the pi_radio source files
+*/
+
+#ifndef PI_RADIO_H
+#define PI_RADIO_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+
+// growable memory buffer which receives an HTTP body (e.g. a TS segment)
+// the storage is kept and reused when size is reset to 0
+struct mem_buffer {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+};
+
+// one-shot timer of the event loop, see fetch.c
+typedef void (*fetch_timer_fn)(void *userdata);
+
+struct fetch_timer {
+  uint64_t due_ms;            // monotonic_ms() at which it fires
+  fetch_timer_fn fn;
+  void *userdata;
+  int armed;
+  struct fetch_timer *next;
+};
+
+// number of downloaded segments which may wait for the player; the player and
+// the decode workers of a Pi 4 can then work on four at a time when catching up
+#define SEGMENT_QUEUE_SIZE 4
+
+struct segment {
+  int media_sequence;
+  int discontinuity;  // #EXT-X-DISCONTINUITY before this segment
+  double duration;    // #EXTINF in seconds
+  struct mem_buffer data;
+  int complete;   // the download is over
+  int failed;     // the download is over but unusable
+  struct fetch *fetch;       // the download in flight, NULL once over (main thread only)
+  struct station *station;   // the station which queued it
+  // to resume a broken download (main thread only)
+  char uri[2000];
+  int64_t byterange_offset;  // 0 for the whole resource
+  int64_t byterange_length;  // -1 for the whole resource
+  int retries;
+  size_t skip;               // sent again by a server which ignores the range
+  uint64_t dropped_ms;       // monotonic_ms() of the first break
+  struct fetch_timer retry_timer;
+};
+
+struct segment_queue {
+  struct segment slots[SEGMENT_QUEUE_SIZE];
+  int head;   // index of the oldest segment
+  int count;  // number of segments pushed but not yet popped
+  int closed;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+};
+
+// the K-weighting filter of ITU-R BS.1770 (loudness.c, dsp.c): two biquads
+// run over both channels of the frames at once
+struct dsp_biquad {
+  float b0, b1, b2, a1, a2;
+};
+
+struct dsp_kweight {
+  struct dsp_biquad stage[2];
+  float z[2][2][2];   // [stage][z1, z2][left, right]
+};
+
+// the PCM ring holds interleaved S16 stereo frames
+#define PCM_FRAME_BYTES 4
+
+struct pcm_ring {
+  uint8_t *data;
+  size_t capacity;             // in frames, a power of 2
+  atomic_size_t write_pos;     // frames written so far (producer)
+  atomic_size_t read_pos;      // frames read so far (consumer)
+  atomic_int closed;
+  atomic_int interrupted;      // producers give up until it is cleared (a station switch)
+  atomic_int discard;          // the consumer is to skip to discard_pos
+  atomic_size_t discard_pos;
+  // fill-level counters
+  atomic_uint underruns;       // times the consumer found the ring empty while playing
+  atomic_size_t max_fill;      // highest fill level seen, in frames
+};
+
+#define TS_PACKET_SIZE 188
+#define TS_NO_PTS (-1)
+
+// called with one complete ADTS frame and its 90 kHz PTS (or TS_NO_PTS); return 0 on success
+typedef int (*ts_frame_callback_t)(const uint8_t *frame, size_t size, int64_t pts, void *userdata);
+
+struct ts_demux {
+  uint8_t packet[TS_PACKET_SIZE];  // a TS packet split between two feeds
+  size_t packet_len;
+  int pmt_pid;
+  int audio_pid;
+  int unsupported;                 // the audio is not ADTS AAC
+  int in_pes;
+  int64_t pts;
+  uint8_t adts[8192];              // PES payload not yet cut into ADTS frames
+  size_t adts_len;
+  ts_frame_callback_t callback;
+  void *userdata;
+  uint64_t callback_us;            // metrics_now_us() spent in the callback during a feed
+};
+
+// ADTS frames of the previous segment decoded first, and thrown away, by a decode worker
+// so that its decoder starts the segment in the state a sequential decode would have
+#define DECODE_PRIME_FRAMES 2
+#define ADTS_FRAME_MAX 8192
+
+// the last ADTS frames of a segment
+struct adts_tail {
+  uint8_t frames[DECODE_PRIME_FRAMES][ADTS_FRAME_MAX];
+  size_t size[DECODE_PRIME_FRAMES];
+  int count;
+};
+
+// one segment for decode_pool.c
+struct decode_job {
+  struct segment *seg;        // complete; not popped before the job is done
+  struct segment *prev;       // the segment before, to prime the decoder, or NULL
+  int rate;                   // output rate, that of the PCM ring
+  struct mem_buffer pcm;      // output: S16 stereo at rate
+  struct adts_tail tail;      // output: to prime the decoder of the next segment
+  int result;                 // 0, or a negative AVERROR code
+  int done;                   // guarded by the lock of the pool
+  struct decode_job *next;
+};
+
+struct fetch;
+// receives the body of a transfer; return size, or 0 to abort the transfer
+typedef size_t (*fetch_write_fn)(struct fetch *f, const uint8_t *data, size_t size);
+// called when a transfer is over; result is a CURLcode (0 == CURLE_OK)
+typedef void (*fetch_done_fn)(struct fetch *f, int result);
+
+// one media segment of an HLS media playlist
+struct m3u8_segment {
+  int media_sequence;
+  double duration;            // #EXTINF in seconds
+  const char *uri;            // absolute URL, in the arena of the playlist
+  int discontinuity;          // preceded by #EXT-X-DISCONTINUITY
+  int64_t byterange_length;   // #EXT-X-BYTERANGE, or -1 for the whole resource
+  int64_t byterange_offset;
+};
+
+// one #EXT-X-STREAM-INF entry of an HLS master playlist
+struct m3u8_variant {
+  long bandwidth;             // bits per second
+  const char *codecs;         // e.g. "mp4a.40.2", or "" if not given
+  const char *uri;
+};
+
+struct m3u8_arena_block;
+
+// a parsed playlist; the arrays and the arena are kept and reused by the next parse
+struct m3u8_playlist {
+  int target_duration;        // #EXT-X-TARGETDURATION in seconds, 0 if not given
+  int media_sequence;         // #EXT-X-MEDIA-SEQUENCE of the first segment
+  int endlist;                // #EXT-X-ENDLIST: no more segments will be added
+  struct m3u8_segment *segments;
+  int segment_count;
+  int segment_capacity;
+  struct m3u8_variant *variants;
+  int variant_count;
+  int variant_capacity;
+  struct m3u8_arena_block *arena;  // strings of the playlist
+};
+
+// adaptive bitrate state of abr.c
+struct abr {
+  int variant_count;
+  int current;                // index of the variant being played
+  double fast, fast_weight;   // throughput averages in bits per second
+  double slow, slow_weight;
+  int samples;
+  int segments_since_switch;
+};
+
+enum station_state {
+  STATION_LOADING,    // following the playlists to the stream
+  STATION_STREAMING,  // segments (or the MP3 stream) are coming
+  STATION_ENDED       // the stream is over, or it failed
+};
+
+// one radio station, see station.c
+struct station {
+  char url[2000];             // as given by the user
+  enum station_state state;
+  int failed;                 // ended without playing
+  int playing;                // feeds the PCM ring; otherwise a standby which only prefetches
+  atomic_int stop;            // the player thread is to give up
+  atomic_int player_done;     // the player thread played the last segment
+  // the playlist (or MP3 stream) being loaded
+  struct fetch *fetch;
+  char load_url[2000];
+  char content_type[200];
+  struct mem_buffer body;
+  size_t body_fed;            // a stream: the part of body decoded since station_play()
+  struct fetch_timer feed_timer;
+  int redirects;              // m3u files and master playlists followed
+  struct fetch_timer reconnect_timer;
+  int reconnects;             // attempts since the stream (or playlist) dropped
+  uint64_t dropped_ms;        // monotonic_ms() of the drop
+  // HLS
+  struct m3u8_playlist playlist;  // the last media playlist parsed
+  struct m3u8_playlist master;    // the master playlist, if the stream has variants
+  struct abr abr;                 // used when master has more than one variant
+  int playlist_variant;           // variant of the media playlist in playlist
+  int variant_codecs_changed;     // the next segment comes from a variant with other codecs
+  int target_duration;            // #EXT-X-TARGETDURATION in seconds
+  int media_sequence_queued;      // the last segment handed to the player thread
+  char refresh_url[2000];
+  struct segment_queue queue;
+  pthread_t player_thread;
+  int player_started;
+  struct fetch_timer reload_timer;
+  int reload_variant;             // variant of the reload in flight
+  uint64_t reload_started_ms;     // when the last load of the playlist began
+  int reload_unchanged;           // consecutive reloads without a new segment
+  struct recorder *recorder;      // -R: what the station receives goes there, not to the PCM ring
+  // -T: while shifted the station only feeds the timeshift store; timeshift.c plays from it
+  atomic_int shifted;
+  atomic_int decoding;            // the player thread may write to the PCM ring
+  atomic_int playing_sequence;    // the segment the player thread is on
+};
+
+// levels of log.c; a line is kept if its level is not above log_level
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+// pi_radio_debug() compiles to nothing below this level (e.g. -DLOG_COMPILE_LEVEL=2)
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+extern atomic_int log_level;
+
+// per-frame tracing: a relaxed load and a branch when debug is off
+#define pi_radio_debug(...) do { \
+  if (LOG_COMPILE_LEVEL >= LOG_LEVEL_DEBUG && \
+      atomic_load_explicit (&log_level, memory_order_relaxed) >= LOG_LEVEL_DEBUG) \
+    pi_radio_log_level (LOG_LEVEL_DEBUG, __VA_ARGS__); \
+  } while (0)
+
+// called with interleaved S16 stereo samples; return 0 on success
+typedef int (*pcm_callback_t)(const uint8_t *pcm, int frames, void *userdata);
+
+// log.c
+int log_open (const char *filename);
+void log_close (void);
+void pi_radio_log (char * format, ... );
+void pi_radio_log_level (int level, const char *format, ... );
+void pi_radio_vlog (int level, const char *format, va_list args);
+
+// pi_radio.c
+int mem_buffer_append (struct mem_buffer *buf, const uint8_t *data, size_t size);
+void str_trim (char *s);
+void str_toupper (char *s);
+size_t curl_write_callback_handler (char *ptr, size_t size, size_t nmemb, void *userdata);
+size_t aac_write_handler (const uint8_t *data, size_t size);
+// the audio output, shared by the stations
+extern struct pcm_ring pcm_ring;
+extern atomic_uint pcm_rate;  // rate of the frames in pcm_ring; 0 until the decoder knows it
+
+// station.c
+struct station *station_new (const char *url);
+void station_play (struct station *st);
+void station_poll (struct station *st);
+void station_free (struct station *st);
+const char *station_state_name (struct station *st);
+void station_write_stats (FILE *fp);
+void station_shift (struct station *st, int on);
+int station_queued_ms (struct station *st);
+
+// timeshift.c
+// what a record of the store holds
+#define TIMESHIFT_TS 1    // a whole TS segment
+#define TIMESHIFT_MP3 2   // bytes of an MP3 stream
+#define TIMESHIFT_AAC 3   // bytes of an ADTS AAC stream
+int timeshift_open (const char *path, size_t size);
+int timeshift_enabled (void);
+void timeshift_new_epoch (void);
+void timeshift_append (int kind, int media_sequence, const uint8_t *data, size_t size);
+uint64_t timeshift_sequence_ms (int media_sequence);
+uint64_t timeshift_oldest_ms (void);
+int timeshift_replay (uint64_t ms);
+int timeshift_replaying (void);
+uint64_t timeshift_replay_ms (void);
+void timeshift_stop_replay (void);
+void timeshift_close (void);
+
+// drift.c
+int drift_reset (unsigned int rate);
+void drift_update (double latency_ms, size_t frames);
+size_t drift_convert (const uint8_t *pcm, size_t frames, const uint8_t **converted);
+double drift_ppm (void);
+
+// record.c
+struct recorder;
+int record_init (const char *spec, int count);
+int record_station (struct station *st, int index);
+size_t record_mp3 (struct recorder *rec, const uint8_t *data, size_t size);
+void record_notify (struct recorder *rec);
+void record_finish (void);
+
+// control.c
+// runs a command of the control socket in the main thread; the reply goes to reply
+typedef void (*control_fn)(const char *command, char *reply, size_t size);
+// called in the control thread when a command comes, before the main thread runs it
+typedef void (*control_notify_fn)(const char *command);
+int control_open (const char *path, control_fn handler, control_notify_fn notify);
+void control_poll (void);
+void control_close (void);
+
+// metrics.c
+// the histograms, METRICS_FETCH to METRICS_SINK_WRITE being the stages of the pipeline
+#define METRICS_FETCH 0
+#define METRICS_DEMUX 1
+#define METRICS_DECODE 2
+#define METRICS_RESAMPLE 3
+#define METRICS_SINK_WRITE 4
+#define METRICS_SWITCH 5
+#define METRICS_RECONNECT 6
+#define METRICS_OUTAGE 7
+#define METRICS_HISTOGRAMS 8
+// writes more metrics in the Prometheus text format, from the thread of the endpoint
+typedef void (*metrics_fn)(FILE *fp);
+uint64_t metrics_now_us (void);
+void metrics_observe (int histogram, uint64_t us);
+int metrics_open (int port, metrics_fn fn);
+void metrics_close (void);
+
+// fetch.c
+int fetch_init (void);
+void fetch_cleanup (void);
+struct fetch *fetch_start (const char *url, fetch_write_fn write, fetch_done_fn done, void *userdata);
+struct fetch *fetch_start_range (const char *url, int64_t offset, int64_t length, fetch_write_fn write, fetch_done_fn done, void *userdata);
+int fetch_perform (int timeout_ms);
+int fetch_wait (struct fetch *f);
+void fetch_cancel (struct fetch *f);
+void fetch_wakeup (void);
+uint64_t monotonic_ms (void);
+void fetch_timer_start (struct fetch_timer *t, int delay_ms, fetch_timer_fn fn, void *userdata);
+void fetch_timer_stop (struct fetch_timer *t);
+const char *fetch_content_type (struct fetch *f);
+int fetch_transfer_stats (struct fetch *f, int64_t *bytes, int64_t *us);
+int fetch_status (struct fetch *f);
+int64_t fetch_content_length (struct fetch *f);
+void *fetch_userdata (struct fetch *f);
+
+// m3u8.c
+void m3u8_init (struct m3u8_playlist *pl);
+int m3u8_parse (struct m3u8_playlist *pl, const uint8_t *data, size_t size, const char *base_url);
+void m3u8_free (struct m3u8_playlist *pl);
+
+// abr.c
+void abr_init (struct abr *abr, int variant_count, int current);
+void abr_add_sample (struct abr *abr, int64_t bytes, int64_t us, double duration);
+long abr_estimate (struct abr *abr);
+int abr_select (struct abr *abr, const struct m3u8_variant *variants, int buffered_ms, int segment_ms);
+void abr_switched (struct abr *abr, int variant);
+
+// ffmpeg_decode.c
+struct ffmpeg_decoder;
+int ffmpeg_decode (char *infile, char *outfile);
+struct ffmpeg_decoder *ffmpeg_decoder_new (void);
+void ffmpeg_decoder_free (struct ffmpeg_decoder *dec);
+void ffmpeg_decoder_reset (struct ffmpeg_decoder *dec);
+int ffmpeg_decoder_drain (struct ffmpeg_decoder *dec, pcm_callback_t pcm_callback, void *userdata);
+void ffmpeg_decoder_set_ring (struct ffmpeg_decoder *dec, struct pcm_ring *ring);
+void ffmpeg_decoder_set_output_rate (struct ffmpeg_decoder *dec, int rate);
+int ffmpeg_decoder_output_rate (struct ffmpeg_decoder *dec);
+int ffmpeg_decoder_decode_adts (struct ffmpeg_decoder *dec, const uint8_t *frame, size_t size, pcm_callback_t pcm_callback, void *userdata);
+int ffmpeg_decoder_feed_adts (struct ffmpeg_decoder *dec, const uint8_t *data, size_t size);
+int ffmpeg_decoder_decode_buffer (struct ffmpeg_decoder *dec, const uint8_t *data, size_t size, pcm_callback_t pcm_callback, void *userdata);
+
+// decode_pool.c
+int decode_pool_start (int workers);
+int decode_pool_workers (void);
+void decode_pool_submit (struct decode_job *job);
+void decode_pool_wait (struct decode_job *job);
+void decode_pool_prime (struct ffmpeg_decoder *dec, struct adts_tail *tail, struct pcm_ring *ring);
+void decode_pool_stop (void);
+
+// dsp.c
+int dsp_init (const char *name);
+const char *dsp_name (void);
+void dsp_s16_to_float (const int16_t *in, float *out, size_t n);
+void dsp_float_to_s16 (const float *in, int16_t *out, size_t n);
+void dsp_interleave (const float *left, const float *right, int16_t *out, size_t frames);
+void dsp_gain (int16_t *pcm, size_t frames, float gain);
+void dsp_downmix_mono (int16_t *pcm, size_t frames);
+void dsp_crossfade (int16_t *pcm, const int16_t *from, size_t frames, size_t pos, size_t len);
+float dsp_kweight (struct dsp_kweight *k, const int16_t *pcm, size_t frames);
+
+// loudness.c
+void loudness_init (double target);
+void loudness_set_station (const char *url);
+void loudness_switch (void);
+float loudness_process (const int16_t *pcm, size_t frames, unsigned int rate);
+void loudness_save (void);
+
+// pcm_ring.c
+int pcm_ring_init (struct pcm_ring *ring, size_t min_frames);
+size_t pcm_ring_fill (struct pcm_ring *ring);
+size_t pcm_ring_write (struct pcm_ring *ring, const uint8_t *pcm, size_t frames);
+int pcm_ring_write_all (struct pcm_ring *ring, const uint8_t *pcm, size_t frames);
+int pcm_ring_wait_space (struct pcm_ring *ring, size_t frames);
+size_t pcm_ring_write_begin (struct pcm_ring *ring, uint8_t **pcm);
+void pcm_ring_write_commit (struct pcm_ring *ring, size_t frames);
+size_t pcm_ring_read (struct pcm_ring *ring, uint8_t *pcm, size_t frames);
+size_t pcm_ring_read_begin (struct pcm_ring *ring, const uint8_t **pcm);
+void pcm_ring_read_commit (struct pcm_ring *ring, size_t frames);
+void pcm_ring_close (struct pcm_ring *ring);
+void pcm_ring_interrupt (struct pcm_ring *ring, int on);
+void pcm_ring_discard (struct pcm_ring *ring);
+int pcm_ring_take_discard (struct pcm_ring *ring);
+size_t pcm_ring_read_discarded (struct pcm_ring *ring, uint8_t *pcm, size_t frames);
+
+// sink.c
+struct audio_sink;
+struct audio_sink *audio_sink_open (const char *spec);
+int audio_sink_set_profile (struct audio_sink *s, const char *name);
+int audio_sink_configure (struct audio_sink *s, unsigned int rate);
+long audio_sink_write (struct audio_sink *s, const uint8_t *pcm, size_t frames);
+int audio_sink_wait (struct audio_sink *s, int timeout_ms);
+int audio_sink_write_all (struct audio_sink *s, const uint8_t *pcm, size_t frames);
+void audio_sink_drain (struct audio_sink *s);
+void audio_sink_flush (struct audio_sink *s);
+void audio_sink_close (struct audio_sink *s);
+unsigned int audio_sink_underruns (struct audio_sink *s);
+unsigned int audio_sink_recoveries (struct audio_sink *s);
+int audio_sink_delay_ms (struct audio_sink *s);
+const char *audio_sink_name (struct audio_sink *s);
+
+// ts_demux.c
+void ts_demux_init (struct ts_demux *d, ts_frame_callback_t callback, void *userdata);
+void ts_demux_reset (struct ts_demux *d);
+int ts_demux_feed (struct ts_demux *d, const uint8_t *data, size_t size);
+
+// segment_queue.c
+void segment_queue_init (struct segment_queue *q);
+struct segment *segment_queue_reserve (struct segment_queue *q);
+void segment_queue_push (struct segment_queue *q);
+int segment_queue_append (struct segment_queue *q, struct segment *seg, const uint8_t *data, size_t size);
+void segment_queue_finish (struct segment_queue *q, struct segment *seg, int failed);
+ssize_t segment_queue_read (struct segment_queue *q, struct segment *seg, size_t offset, uint8_t *buf, size_t size);
+struct segment *segment_queue_front (struct segment_queue *q);
+struct segment *segment_queue_peek (struct segment_queue *q, int index);
+void segment_queue_pop (struct segment_queue *q);
+int segment_queue_count (struct segment_queue *q);
+void segment_queue_close (struct segment_queue *q);
+void segment_queue_free (struct segment_queue *q);
+
+#endif
@@ -0,0 +1,377 @@
+/*
+File: record.c
+Description: record mode (-R): any number of stations captured to files
+
+Every station is a struct station driven by the event loop of the main
+thread, which does all the downloads through the shared curl multi handle.
+What a station receives is processed by a pool of worker threads, about
+one per core: a station with work is put on a run queue and taken by one
+worker at a time, so its file is written in order while the stations
+spread over the cores.
+
+  -R DIR      remux: the MP3 stream as it comes into DIR/stationNN.mp3,
+              the ADTS frames of the TS segments into DIR/stationNN.aac
+  -R wav:DIR  decode to S16 stereo into DIR/stationNN.wav (the WAV sink of sink.c)
+
+A worker takes only the segments whose download is over, so it never
+waits on the network and the pool stays busy with the stations which
+have something to do.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <mpg123.h>
+
+#include "pi_radio.h"
+
+#define RECORD_MAX_WORKERS 64
+
+struct recorder {
+  struct station *st;
+  int index;
+  // the output, opened by the first run
+  FILE *fp;                   // remux
+  struct audio_sink *sink;    // wav
+  int rate;                   // wav: that of the first decoded frame, 0 before
+  int failed;                 // the output cannot be written; the input is dropped
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  // MP3 stream: record_mp3() appends to input, the worker swaps it with work
+  pthread_mutex_t lock;
+  int mp3;
+  struct mem_buffer input;
+  struct mem_buffer work;
+  mpg123_handle *mh;          // wav
+  // HLS
+  struct ts_demux demux;
+  struct ffmpeg_decoder *dec; // wav
+  // run queue, guarded by pool_lock
+  int scheduled;              // on the run queue or being run
+  int again;                  // more work came while it was being run
+  struct recorder *next_run;
+  struct recorder *next;      // all the recorders
+};
+
+static char record_dir[1024];
+static int record_wav;
+static struct recorder *recorders;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static struct recorder *run_head, *run_tail;
+static int pool_closing;
+static pthread_t workers[RECORD_MAX_WORKERS];
+static int worker_count;
+
+// ==============================================================
+
+static int recorder_open (struct recorder *rec)
+// the file is named after the index of the station; its type is known once data came
+{
+char path[1100];
+const char *ext = record_wav ? "wav" : (rec->mp3 ? "mp3" : "aac");
+snprintf (path, sizeof (path), "%s/station%02d.%s", record_dir, rec->index, ext);
+pi_radio_log ("recording \"%s\" into \"%s\"\n", rec->st->url, path);
+if (!record_wav) {
+  if ((rec->fp = fopen (path, "wb")) == NULL) {
+    pi_radio_log ("ERROR: cannot open \"%s\" (%s)\n", path, strerror (errno));
+    return -1;
+    }
+  return 0;
+  }
+char spec[1110];
+snprintf (spec, sizeof (spec), "wav:%s", path);
+if ((rec->sink = audio_sink_open (spec)) == NULL)
+  return -1;
+if (rec->mp3) {
+  // stereo S16 whatever the stream, as in main(); the WAV header takes the rate of the first frame
+  static const long rates[] = { 8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000 };
+  int err, r;
+  if ((rec->mh = mpg123_new (NULL, &err)) == NULL) {
+    pi_radio_log ("ERROR: mpg123_new() fails... %s\n", mpg123_plain_strerror (err));
+    return -1;
+    }
+  mpg123_format_none (rec->mh);
+  for (r = 0; r < sizeof (rates) / sizeof (rates[0]); r++)
+    mpg123_format (rec->mh, rates[r], MPG123_STEREO, MPG123_ENC_SIGNED_16);
+  if (mpg123_open_feed (rec->mh) != MPG123_OK)
+    return -1;
+  }
+return 0;
+} // recorder_open()
+
+static int record_write (struct recorder *rec, const uint8_t *data, size_t size)
+// remux output
+{
+if (fwrite (data, 1, size, rec->fp) != size) {
+  pi_radio_log ("ERROR: cannot write the recording of \"%s\" (%s)\n", rec->st->url, strerror (errno));
+  rec->failed = 1;
+  return -1;
+  }
+rec->bytes_out += size;
+return 0;
+} // record_write()
+
+static int record_pcm (const uint8_t *pcm, int frames, void *userdata)
+// pcm_callback_t of the wav output
+{
+struct recorder *rec = userdata;
+if (rec->rate == 0 && rec->dec) {
+  // HLS: the stream's rate, to which the decoders after a discontinuity resample
+  rec->rate = ffmpeg_decoder_output_rate (rec->dec);
+  if (audio_sink_configure (rec->sink, rec->rate) != 0) {
+    rec->failed = 1;
+    return -1;
+    }
+  }
+if (audio_sink_write_all (rec->sink, pcm, frames) != 0) {
+  rec->failed = 1;
+  return -1;
+  }
+rec->bytes_out += (uint64_t) frames * PCM_FRAME_BYTES;
+return 0;
+} // record_pcm()
+
+static int record_adts (const uint8_t *frame, size_t size, int64_t pts, void *userdata)
+// ts_frame_callback_t: the frame is written as is, or decoded
+{
+struct recorder *rec = userdata;
+if (!record_wav)
+  return record_write (rec, frame, size);
+return (ffmpeg_decoder_decode_adts (rec->dec, frame, size, record_pcm, rec) < 0) ? -1 : 0;
+} // record_adts()
+
+static void record_decoder_new (struct recorder *rec)
+{
+if (rec->dec)
+  ffmpeg_decoder_free (rec->dec);
+rec->dec = record_wav ? ffmpeg_decoder_new () : NULL;
+if (record_wav && rec->dec == NULL)
+  rec->failed = 1;
+if (rec->dec)
+  ffmpeg_decoder_set_output_rate (rec->dec, rec->rate);
+ts_demux_init (&rec->demux, record_adts, rec);
+} // record_decoder_new()
+
+// ==============================================================
+
+static void record_mp3_run (struct recorder *rec)
+// the MP3 bytes received since the last run
+{
+pthread_mutex_lock (&rec->lock);
+struct mem_buffer in = rec->input;
+rec->input = rec->work;
+rec->input.size = 0;
+pthread_mutex_unlock (&rec->lock);
+rec->work = in;
+if (rec->failed || in.size == 0)
+  return;
+if (!record_wav) {
+  record_write (rec, in.data, in.size);
+  return;
+  }
+if (mpg123_feed (rec->mh, in.data, in.size) != MPG123_OK)
+  return;
+unsigned char *audio;
+size_t decoded_bytes;
+off_t frame_offset;
+int err;
+while ((err = mpg123_decode_frame (rec->mh, &frame_offset, &audio, &decoded_bytes)) != MPG123_NEED_MORE) {
+  if (err == MPG123_NEW_FORMAT) {
+    long rate;
+    int channels, encoding;
+    mpg123_getformat (rec->mh, &rate, &channels, &encoding);
+    rec->rate = rate;
+    audio_sink_configure (rec->sink, rate);
+    }
+  else if (err != MPG123_OK) {
+    pi_radio_log ("ERROR: mpg123_decode_frame() fails for \"%s\"... %s\n", rec->st->url, mpg123_plain_strerror (err));
+    break;
+    }
+  else if (decoded_bytes > 0 && record_pcm (audio, decoded_bytes / PCM_FRAME_BYTES, rec) != 0)
+    break;
+  }
+} // record_mp3_run()
+
+static void record_segments_run (struct recorder *rec)
+// the segments at the head of the queue whose download is over
+{
+struct segment_queue *q = &rec->st->queue;
+struct segment *seg;
+while ((seg = segment_queue_peek (q, 0)) != NULL) {
+  if (seg->discontinuity || (record_wav && rec->dec == NULL))
+    record_decoder_new (rec);
+  if (seg->failed)
+    pi_radio_log ("ERROR: download of media sequence %d of \"%s\" failed; skipping it\n", seg->media_sequence, rec->st->url);
+  else if (!rec->failed) {
+    rec->bytes_in += seg->data.size;
+    ts_demux_reset (&rec->demux);
+    int err = ts_demux_feed (&rec->demux, seg->data.data, seg->data.size);
+    if (rec->demux.unsupported || rec->demux.audio_pid < 0) {
+      if (record_wav)
+        err = ffmpeg_decoder_decode_buffer (rec->dec, seg->data.data, seg->data.size, record_pcm, rec);
+      else
+        pi_radio_log ("ERROR: media sequence %d of \"%s\" is not ADTS AAC; it cannot be remuxed\n", seg->media_sequence, rec->st->url);
+      }
+    if (err < 0)
+      pi_radio_log ("ERROR: media sequence %d of \"%s\" is not recorded whole\n", seg->media_sequence, rec->st->url);
+    }
+  segment_queue_pop (q);
+  fetch_wakeup (); // a slot is free for the next download
+  }
+} // record_segments_run()
+
+static void recorder_run (struct recorder *rec)
+{
+// rec->mp3 was set before record_notify(), which the worker took rec from
+if (rec->fp == NULL && rec->sink == NULL && !rec->failed && recorder_open (rec) != 0)
+  rec->failed = 1;
+if (rec->mp3)
+  record_mp3_run (rec);
+else
+  record_segments_run (rec);
+} // recorder_run()
+
+static void *record_worker_main (void *arg)
+{
+while (1) {
+  pthread_mutex_lock (&pool_lock);
+  while (run_head == NULL && !pool_closing)
+    pthread_cond_wait (&pool_work, &pool_lock);
+  struct recorder *rec = run_head;
+  if (rec == NULL) {
+    pthread_mutex_unlock (&pool_lock);
+    break; // closing and drained
+    }
+  if ((run_head = rec->next_run) == NULL)
+    run_tail = NULL;
+  pthread_mutex_unlock (&pool_lock);
+
+  recorder_run (rec);
+
+  pthread_mutex_lock (&pool_lock);
+  if (rec->again) {
+    // more came while it ran: behind the other stations
+    rec->again = 0;
+    rec->next_run = NULL;
+    if (run_tail)
+      run_tail->next_run = rec;
+    else
+      run_head = rec;
+    run_tail = rec;
+    }
+  else
+    rec->scheduled = 0;
+  pthread_mutex_unlock (&pool_lock);
+  }
+return NULL;
+} // record_worker_main()
+
+// ==============================================================
+
+int record_init (const char *spec, int count)
+// spec as given to -R; start count worker threads
+{
+int err;
+if (strncmp (spec, "wav:", 4) == 0) {
+  record_wav = 1;
+  spec += 4;
+  }
+snprintf (record_dir, sizeof (record_dir), "%s", spec);
+if (count < 1)
+  count = 1;
+if (count > RECORD_MAX_WORKERS)
+  count = RECORD_MAX_WORKERS;
+for (worker_count = 0; worker_count < count; worker_count++)
+  if ((err = pthread_create (&workers[worker_count], NULL, record_worker_main, NULL)) != 0) {
+    pi_radio_log ("ERROR: pthread_create() fails (%s)\n", strerror (err));
+    return -1;
+    }
+pi_radio_log ("recording into \"%s\" (%s) with %d worker threads\n", record_dir, record_wav ? "wav" : "remux", worker_count);
+return 0;
+} // record_init()
+
+int record_station (struct station *st, int index)
+// attach a recorder to st before its first data comes
+{
+struct recorder *rec = calloc (1, sizeof (*rec));
+if (rec == NULL)
+  return -1;
+rec->st = st;
+rec->index = index;
+pthread_mutex_init (&rec->lock, NULL);
+ts_demux_init (&rec->demux, record_adts, rec);
+st->recorder = rec;
+rec->next = recorders;
+recorders = rec;
+return 0;
+} // record_station()
+
+size_t record_mp3 (struct recorder *rec, const uint8_t *data, size_t size)
+// main thread: the MP3 stream of the station; return size, or 0 if out of memory
+{
+pthread_mutex_lock (&rec->lock);
+rec->mp3 = 1;
+rec->bytes_in += size;
+int err = mem_buffer_append (&rec->input, data, size);
+pthread_mutex_unlock (&rec->lock);
+if (err != 0)
+  return 0;
+record_notify (rec);
+return size;
+} // record_mp3()
+
+void record_notify (struct recorder *rec)
+// main thread: rec has new work; put it on the run queue unless it is there already
+{
+pthread_mutex_lock (&pool_lock);
+if (rec->scheduled)
+  rec->again = 1;
+else {
+  rec->scheduled = 1;
+  rec->next_run = NULL;
+  if (run_tail)
+    run_tail->next_run = rec;
+  else
+    run_head = rec;
+  run_tail = rec;
+  pthread_cond_signal (&pool_work);
+  }
+pthread_mutex_unlock (&pool_lock);
+} // record_notify()
+
+void record_finish (void)
+// let the workers write what is queued, then close the files
+{
+struct recorder *rec;
+int i;
+if (worker_count == 0)
+  return;
+pthread_mutex_lock (&pool_lock);
+pool_closing = 1;
+pthread_cond_broadcast (&pool_work);
+pthread_mutex_unlock (&pool_lock);
+for (i = 0; i < worker_count; i++)
+  pthread_join (workers[i], NULL);
+worker_count = 0;
+for (rec = recorders; rec; rec = rec->next) {
+  pi_radio_log ("\"%s\": %llu bytes received, %llu bytes recorded%s\n", rec->st->url,
+    (unsigned long long) rec->bytes_in, (unsigned long long) rec->bytes_out, rec->failed ? " (failed)" : "");
+  if (rec->fp)
+    fclose (rec->fp);
+  if (rec->sink)
+    audio_sink_close (rec->sink);  // fills in the sizes of the WAV header
+  if (rec->mh)
+    mpg123_delete (rec->mh);
+  if (rec->dec)
+    ffmpeg_decoder_free (rec->dec);
+  rec->fp = NULL;
+  rec->sink = NULL;
+  rec->mh = NULL;
+  rec->dec = NULL;
+  }
+} // record_finish()
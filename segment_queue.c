@@ -0,0 +1,162 @@
+/*
+File: segment_queue.c
+Description: bounded queue of downloaded HLS segments between the fetching
+(main) thread and the player thread
+
+The queue owns a fixed number of slots. Each slot keeps its mem_buffer across
+segments so that no memory is allocated in the steady state.
+The producer reserves the slot at the tail, pushes it as soon as the download
+starts, appends the data as it arrives and finally marks it complete; the
+consumer takes the slot at the head, reads it while it is still growing,
+and pops it once played.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pi_radio.h"
+
+// ==============================================================
+
+void segment_queue_init (struct segment_queue *q)
+{
+memset (q, 0, sizeof (*q));
+pthread_mutex_init (&q->lock, NULL);
+pthread_cond_init (&q->not_empty, NULL);
+} // segment_queue_init()
+
+// ==============================================================
+
+struct segment *segment_queue_reserve (struct segment_queue *q)
+/* return the free slot at the tail (without making it visible to the consumer)
+or NULL if the queue is full. It does not wait, as the producer has to keep
+the downloads of the queued segments going in the meantime */
+{
+struct segment *seg = NULL;
+pthread_mutex_lock (&q->lock);
+if (q->count < SEGMENT_QUEUE_SIZE && !q->closed) {
+  seg = &q->slots[(q->head + q->count) % SEGMENT_QUEUE_SIZE];
+  seg->data.size = 0;
+  seg->complete = 0;
+  seg->failed = 0;
+  }
+pthread_mutex_unlock (&q->lock);
+return seg;
+} // segment_queue_reserve()
+
+void segment_queue_push (struct segment_queue *q)
+// hand the slot returned by segment_queue_reserve() to the consumer
+{
+pthread_mutex_lock (&q->lock);
+q->count++;
+pthread_cond_broadcast (&q->not_empty);
+pthread_mutex_unlock (&q->lock);
+} // segment_queue_push()
+
+int segment_queue_append (struct segment_queue *q, struct segment *seg, const uint8_t *data, size_t size)
+// add downloaded bytes to a pushed segment; return -1 if out of memory
+{
+pthread_mutex_lock (&q->lock);
+int err = mem_buffer_append (&seg->data, data, size);
+pthread_cond_broadcast (&q->not_empty);
+pthread_mutex_unlock (&q->lock);
+return err;
+} // segment_queue_append()
+
+void segment_queue_finish (struct segment_queue *q, struct segment *seg, int failed)
+// the download of the segment is over; the consumer may now use seg->data directly
+{
+pthread_mutex_lock (&q->lock);
+seg->failed = failed;
+seg->complete = 1;
+pthread_cond_broadcast (&q->not_empty);
+pthread_mutex_unlock (&q->lock);
+} // segment_queue_finish()
+
+// ==============================================================
+
+struct segment *segment_queue_front (struct segment_queue *q)
+// wait for a segment; return NULL when the queue is closed and drained
+{
+struct segment *seg = NULL;
+pthread_mutex_lock (&q->lock);
+while (q->count == 0 && !q->closed)
+  pthread_cond_wait (&q->not_empty, &q->lock);
+if (q->count > 0)
+  seg = &q->slots[q->head];
+pthread_mutex_unlock (&q->lock);
+return seg;
+} // segment_queue_front()
+
+struct segment *segment_queue_peek (struct segment_queue *q, int index)
+/* the segment index places behind the head if its download is over, without
+waiting; NULL otherwise. It stays valid until the consumer pops it */
+{
+struct segment *seg = NULL;
+pthread_mutex_lock (&q->lock);
+if (index < q->count && q->slots[(q->head + index) % SEGMENT_QUEUE_SIZE].complete)
+  seg = &q->slots[(q->head + index) % SEGMENT_QUEUE_SIZE];
+pthread_mutex_unlock (&q->lock);
+return seg;
+} // segment_queue_peek()
+
+ssize_t segment_queue_read (struct segment_queue *q, struct segment *seg, size_t offset, uint8_t *buf, size_t size)
+/* copy up to size bytes of the segment starting at offset, waiting for the
+download if needed. Return the number of bytes copied, 0 at the end of a
+complete segment, or -1 if its download failed */
+{
+ssize_t n;
+pthread_mutex_lock (&q->lock);
+while (seg->data.size <= offset && !seg->complete && !q->closed)
+  pthread_cond_wait (&q->not_empty, &q->lock);
+if (seg->failed)
+  n = -1;
+else {
+  n = (seg->data.size > offset) ? seg->data.size - offset : 0;
+  if ((size_t) n > size)
+    n = size;
+  // copied under the lock as the producer may realloc() the buffer
+  memcpy (buf, seg->data.data + offset, n);
+  }
+pthread_mutex_unlock (&q->lock);
+return n;
+} // segment_queue_read()
+
+void segment_queue_pop (struct segment_queue *q)
+// release the slot returned by segment_queue_front()
+{
+pthread_mutex_lock (&q->lock);
+q->head = (q->head + 1) % SEGMENT_QUEUE_SIZE;
+q->count--;
+pthread_mutex_unlock (&q->lock);
+} // segment_queue_pop()
+
+// ==============================================================
+
+int segment_queue_count (struct segment_queue *q)
+{
+pthread_mutex_lock (&q->lock);
+int count = q->count;
+pthread_mutex_unlock (&q->lock);
+return count;
+} // segment_queue_count()
+
+void segment_queue_close (struct segment_queue *q)
+// wake up the consumer, which still drains what is queued
+{
+pthread_mutex_lock (&q->lock);
+q->closed = 1;
+pthread_cond_broadcast (&q->not_empty);
+pthread_mutex_unlock (&q->lock);
+} // segment_queue_close()
+
+void segment_queue_free (struct segment_queue *q)
+// the consumer is gone; release the buffers of the slots
+{
+int i;
+for (i = 0; i < SEGMENT_QUEUE_SIZE; i++)
+  free (q->slots[i].data.data);
+pthread_mutex_destroy (&q->lock);
+pthread_cond_destroy (&q->not_empty);
+} // segment_queue_free()
@@ -0,0 +1,566 @@
+/*
+File: sink.c
+Description: audio sinks fed by the playback thread
+
+A sink is chosen by name with -d:
+  null        discards the audio at the pace of a sound card
+  wav:FILE    writes a WAV file as fast as the audio comes
+  alsa:DEVICE or any other name: the ALSA device, e.g. default or hw:0
+
+Every sink takes interleaved S16 stereo frames. The rate is negotiated
+with audio_sink_configure(), again only if a new station has another rate,
+and audio_sink_flush() drops what the sink holds when the station changes.
+audio_sink_write() never blocks: it takes what fits and returns 0 if
+nothing does, and audio_sink_wait() polls until there is room again.
+The ALSA sink writes through mmap access
+(snd_pcm_mmap_begin/commit) when the device allows it, which saves the copy
+into the ALSA buffer that snd_pcm_writei() makes.
+
+The size of the sink's buffer follows a profile chosen with -L:
+  low-latency  a short buffer for quick station switches; needs a steady CPU
+  default      half a second
+  resilient    a long buffer which rides out CPU spikes of a second or more
+The ALSA sink sets its hardware and software parameters explicitly from
+the profile: buffer and period time, a start threshold so that a stream
+(re)starts only with a few periods queued, and avail_min of one period.
+An underrun or a suspend is recovered with snd_pcm_recover() and the
+stream carries on; underruns, recoveries and the delay are counted.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <alsa/asoundlib.h>
+
+#include "pi_radio.h"
+
+struct sink_profile {
+  const char *name;
+  unsigned int buffer_us;      // the sink's own buffer; jitter is absorbed by the PCM ring
+  unsigned int period_us;      // how often the device wakes the writer up
+  unsigned int start_periods;  // queued before the stream starts
+};
+
+static const struct sink_profile sink_profiles[] = {
+  { "low-latency", 80000, 20000, 2 },
+  { "default", 500000, 100000, 3 },
+  { "resilient", 2000000, 250000, 6 },
+};
+
+struct audio_sink;
+
+struct audio_sink_ops {
+  const char *name;
+  int (*configure) (struct audio_sink *sink);
+  long (*write) (struct audio_sink *sink, const uint8_t *pcm, size_t frames);
+  int (*wait) (struct audio_sink *sink, int timeout_ms);
+  void (*drain) (struct audio_sink *sink);
+  void (*flush) (struct audio_sink *sink);
+  void (*close) (struct audio_sink *sink);
+};
+
+struct audio_sink {
+  const struct audio_sink_ops *ops;
+  const struct sink_profile *profile;
+  unsigned int rate;
+  atomic_uint underruns;
+  atomic_uint recoveries;      // errors the stream was recovered from, underruns included
+  atomic_long delay;           // frames queued in the sink after the last write
+  // alsa
+  snd_pcm_t *pcm;
+  int mmap;
+  struct pollfd *pfds;
+  int nfds;
+  snd_pcm_uframes_t buffer_frames;
+  snd_pcm_uframes_t period_frames;
+  snd_pcm_uframes_t start_frames;  // start threshold
+  // wav
+  FILE *fp;
+  uint32_t data_bytes;
+  int header_written;
+  // null
+  uint64_t clock_start_us;    // when the virtual buffer started playing
+  uint64_t frames_written;    // since clock_start_us
+};
+
+// ==============================================================
+// ALSA
+
+static int alsa_set_hw_params (struct audio_sink *s, snd_pcm_access_t access)
+// S16 stereo at s->rate with the buffer and period time of the profile; return 0 or an ALSA error
+{
+snd_pcm_hw_params_t *hw;
+unsigned int buffer_us = s->profile->buffer_us;
+unsigned int period_us = s->profile->period_us;
+int err;
+if ((err = snd_pcm_hw_params_malloc (&hw)) < 0)
+  return err;
+if ((err = snd_pcm_hw_params_any (s->pcm, hw)) < 0 ||
+    (err = snd_pcm_hw_params_set_rate_resample (s->pcm, hw, 0)) < 0 || // the decoders resample
+    (err = snd_pcm_hw_params_set_access (s->pcm, hw, access)) < 0 ||
+    (err = snd_pcm_hw_params_set_format (s->pcm, hw, SND_PCM_FORMAT_S16_LE)) < 0 ||
+    (err = snd_pcm_hw_params_set_channels (s->pcm, hw, 2)) < 0 ||
+    (err = snd_pcm_hw_params_set_rate (s->pcm, hw, s->rate, 0)) < 0 ||
+    (err = snd_pcm_hw_params_set_buffer_time_near (s->pcm, hw, &buffer_us, NULL)) < 0 ||
+    (err = snd_pcm_hw_params_set_period_time_near (s->pcm, hw, &period_us, NULL)) < 0 ||
+    (err = snd_pcm_hw_params (s->pcm, hw)) < 0) {
+  snd_pcm_hw_params_free (hw);
+  return err;
+  }
+snd_pcm_hw_params_get_buffer_size (hw, &s->buffer_frames);
+snd_pcm_hw_params_get_period_size (hw, &s->period_frames, NULL);
+snd_pcm_hw_params_free (hw);
+return 0;
+} // alsa_set_hw_params()
+
+static int alsa_set_sw_params (struct audio_sink *s)
+{
+snd_pcm_sw_params_t *sw;
+int err;
+s->start_frames = s->period_frames * s->profile->start_periods;
+if (s->start_frames > s->buffer_frames)
+  s->start_frames = s->buffer_frames;
+if ((err = snd_pcm_sw_params_malloc (&sw)) < 0)
+  return err;
+if ((err = snd_pcm_sw_params_current (s->pcm, sw)) < 0 ||
+    (err = snd_pcm_sw_params_set_start_threshold (s->pcm, sw, s->start_frames)) < 0 ||
+    (err = snd_pcm_sw_params_set_avail_min (s->pcm, sw, s->period_frames)) < 0 ||
+    (err = snd_pcm_sw_params (s->pcm, sw)) < 0) {
+  snd_pcm_sw_params_free (sw);
+  return err;
+  }
+snd_pcm_sw_params_free (sw);
+return 0;
+} // alsa_set_sw_params()
+
+static int alsa_configure (struct audio_sink *s)
+{
+int err;
+if (s->pfds) {
+  // again for another rate: back to the SETUP state
+  snd_pcm_drop (s->pcm);
+  free (s->pfds);
+  s->pfds = NULL;
+  }
+s->mmap = 1;
+err = alsa_set_hw_params (s, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+if (err < 0) {
+  pi_radio_log ("mmap access is not available (%s); using snd_pcm_writei()\n", snd_strerror (err));
+  s->mmap = 0;
+  err = alsa_set_hw_params (s, SND_PCM_ACCESS_RW_INTERLEAVED);
+  }
+if (err < 0) {
+  pi_radio_log ("ERROR: cannot set the ALSA hardware parameters: %s\n", snd_strerror (err));
+  return -1;
+  }
+if ((err = alsa_set_sw_params (s)) < 0) {
+  pi_radio_log ("ERROR: cannot set the ALSA software parameters: %s\n", snd_strerror (err));
+  return -1;
+  }
+pi_radio_log ("ALSA buffer of %lu frames (%lu ms), period of %lu frames, start at %lu frames\n",
+  s->buffer_frames, s->buffer_frames * 1000 / s->rate, s->period_frames, s->start_frames);
+s->nfds = snd_pcm_poll_descriptors_count (s->pcm);
+if (s->nfds <= 0 || (s->pfds = calloc (s->nfds, sizeof (*s->pfds))) == NULL)
+  return -1;
+snd_pcm_poll_descriptors (s->pcm, s->pfds, s->nfds);
+return 0;
+} // alsa_configure()
+
+static int alsa_recover (struct audio_sink *s, int err)
+/* bring the stream back to PREPARED after an underrun, a suspend or another error
+it restarts by itself once start_frames are queued again; return 0 or -1 */
+{
+if (err == -EPIPE)
+  atomic_fetch_add (&s->underruns, 1);
+atomic_fetch_add (&s->recoveries, 1);
+pi_radio_log ("ALSA %s; calling snd_pcm_recover()\n", (err == -EPIPE) ? "underrun" : snd_strerror (err));
+if (snd_pcm_recover (s->pcm, err, 1) == 0)
+  return 0;
+// not one of the errors snd_pcm_recover() knows: start over
+pi_radio_log ("WARNING: snd_pcm_recover() fails (%s); calling snd_pcm_prepare()\n", snd_strerror (err));
+snd_pcm_drop (s->pcm);
+if ((err = snd_pcm_prepare (s->pcm)) < 0) {
+  pi_radio_log ("ERROR: snd_pcm_prepare() fails (%s)\n", snd_strerror (err));
+  return -1;
+  }
+return 0;
+} // alsa_recover()
+
+static void alsa_start (struct audio_sink *s, int force)
+/* an mmap stream is not started by the start threshold, as the writes do not
+go through the driver: start it once start_frames are queued, or now if force */
+{
+if (snd_pcm_state (s->pcm) != SND_PCM_STATE_PREPARED)
+  return;
+snd_pcm_sframes_t avail = snd_pcm_avail_update (s->pcm);
+if (force || (avail >= 0 && s->buffer_frames - avail >= s->start_frames))
+  snd_pcm_start (s->pcm);
+} // alsa_start()
+
+static long alsa_write_mmap (struct audio_sink *s, const uint8_t *pcm, size_t frames)
+{
+snd_pcm_sframes_t avail = snd_pcm_avail_update (s->pcm);
+if (avail < 0)
+  return (alsa_recover (s, avail) < 0) ? -1 : 0;
+if ((size_t) avail < frames)
+  frames = avail;
+size_t done = 0;
+while (done < frames) {
+  const snd_pcm_channel_area_t *areas;
+  snd_pcm_uframes_t offset;
+  snd_pcm_uframes_t n = frames - done;
+  int err = snd_pcm_mmap_begin (s->pcm, &areas, &offset, &n);
+  if (err < 0)
+    return (alsa_recover (s, err) < 0) ? -1 : (long) done;
+  // interleaved: the area of the first channel addresses whole frames
+  uint8_t *dst = (uint8_t *) areas[0].addr + areas[0].first / 8 + offset * (areas[0].step / 8);
+  memcpy (dst, pcm + done * PCM_FRAME_BYTES, n * PCM_FRAME_BYTES);
+  snd_pcm_sframes_t committed = snd_pcm_mmap_commit (s->pcm, offset, n);
+  if (committed < 0 || (snd_pcm_uframes_t) committed != n)
+    return (alsa_recover (s, committed < 0 ? committed : -EPIPE) < 0) ? -1 : (long) done;
+  done += n;
+  }
+atomic_store (&s->delay, (long) (s->buffer_frames - (avail - done)));
+alsa_start (s, 0);
+return done;
+} // alsa_write_mmap()
+
+static long alsa_write (struct audio_sink *s, const uint8_t *pcm, size_t frames)
+{
+if (s->mmap)
+  return alsa_write_mmap (s, pcm, frames);
+snd_pcm_sframes_t n = snd_pcm_writei (s->pcm, pcm, frames);
+if (n == -EAGAIN)
+  return 0;
+if (n < 0)
+  return (alsa_recover (s, n) < 0) ? -1 : 0;
+snd_pcm_sframes_t avail = snd_pcm_avail_update (s->pcm);
+if (avail >= 0)
+  atomic_store (&s->delay, (long) (s->buffer_frames - avail));
+return n;
+} // alsa_write()
+
+static int alsa_wait (struct audio_sink *s, int timeout_ms)
+// return 1 when a write may go through, 0 on timeout, -1 on error
+{
+unsigned short revents;
+// a prepared but not started stream with a full buffer would never become writable
+if (snd_pcm_avail_update (s->pcm) == 0)
+  alsa_start (s, 1);
+int n = poll (s->pfds, s->nfds, timeout_ms);
+if (n < 0)
+  return (errno == EINTR) ? 0 : -1;
+if (n == 0)
+  return 0;
+snd_pcm_poll_descriptors_revents (s->pcm, s->pfds, s->nfds, &revents);
+if (revents & POLLERR) {
+  // an underrun: the next write recovers
+  return 1;
+  }
+return (revents & POLLOUT) ? 1 : 0;
+} // alsa_wait()
+
+static void alsa_drain (struct audio_sink *s)
+{
+alsa_start (s, 1); // less than start_frames may have been written
+snd_pcm_nonblock (s->pcm, 0);
+snd_pcm_drain (s->pcm);
+} // alsa_drain()
+
+static void alsa_flush (struct audio_sink *s)
+{
+snd_pcm_drop (s->pcm);
+snd_pcm_prepare (s->pcm);
+} // alsa_flush()
+
+static void alsa_close (struct audio_sink *s)
+{
+snd_pcm_drop (s->pcm);
+snd_pcm_close (s->pcm);
+free (s->pfds);
+} // alsa_close()
+
+static const struct audio_sink_ops alsa_ops = {
+  "alsa", alsa_configure, alsa_write, alsa_wait, alsa_drain, alsa_flush, alsa_close
+};
+
+// ==============================================================
+// WAV file
+
+static void wav_header (struct audio_sink *s)
+{
+uint8_t h[44];
+uint32_t byte_rate = s->rate * PCM_FRAME_BYTES;
+#define PUT32(p, v) ((p)[0] = (v), (p)[1] = (v) >> 8, (p)[2] = (v) >> 16, (p)[3] = (v) >> 24)
+#define PUT16(p, v) ((p)[0] = (v), (p)[1] = (v) >> 8)
+memcpy (h, "RIFF", 4);
+PUT32 (h + 4, 36 + s->data_bytes);
+memcpy (h + 8, "WAVEfmt ", 8);
+PUT32 (h + 16, 16);
+PUT16 (h + 20, 1);              // PCM
+PUT16 (h + 22, 2);              // channels
+PUT32 (h + 24, s->rate);
+PUT32 (h + 28, byte_rate);
+PUT16 (h + 32, PCM_FRAME_BYTES);
+PUT16 (h + 34, 16);             // bits per sample
+memcpy (h + 36, "data", 4);
+PUT32 (h + 40, s->data_bytes);
+#undef PUT32
+#undef PUT16
+fwrite (h, 1, sizeof (h), s->fp);
+} // wav_header()
+
+static int wav_configure (struct audio_sink *s)
+{
+if (s->header_written) {
+  pi_radio_log ("WARNING: the rate changes to %u Hz in the middle of the WAV file\n", s->rate);
+  return 0;
+  }
+wav_header (s); // the sizes are filled in by wav_close()
+s->header_written = 1;
+return ferror (s->fp) ? -1 : 0;
+} // wav_configure()
+
+static long wav_write (struct audio_sink *s, const uint8_t *pcm, size_t frames)
+{
+if (fwrite (pcm, PCM_FRAME_BYTES, frames, s->fp) != frames) {
+  pi_radio_log ("ERROR: cannot write the WAV file (%s)\n", strerror (errno));
+  return -1;
+  }
+s->data_bytes += frames * PCM_FRAME_BYTES;
+return frames;
+} // wav_write()
+
+static int wav_wait (struct audio_sink *s, int timeout_ms)
+{
+return 1;
+} // wav_wait()
+
+static void wav_drain (struct audio_sink *s)
+{
+fflush (s->fp);
+} // wav_drain()
+
+static void wav_flush (struct audio_sink *s)
+{
+} // wav_flush()
+
+static void wav_close (struct audio_sink *s)
+{
+// a pipe cannot seek; the header then keeps its zero sizes
+if (s->header_written && fseek (s->fp, 0, SEEK_SET) == 0)
+  wav_header (s);
+fclose (s->fp);
+} // wav_close()
+
+static const struct audio_sink_ops wav_ops = {
+  "wav", wav_configure, wav_write, wav_wait, wav_drain, wav_flush, wav_close
+};
+
+// ==============================================================
+// null: plays nothing, in real time
+
+static uint64_t now_us (void)
+{
+struct timespec ts;
+clock_gettime (CLOCK_MONOTONIC, &ts);
+return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+} // now_us()
+
+static size_t null_fill (struct audio_sink *s)
+// frames still "in the sound card"; an empty buffer restarts the clock
+{
+uint64_t played = (now_us () - s->clock_start_us) * s->rate / 1000000;
+if (played >= s->frames_written) {
+  if (s->frames_written > 0)
+    atomic_fetch_add (&s->underruns, 1);
+  s->clock_start_us = now_us ();
+  s->frames_written = 0;
+  return 0;
+  }
+return s->frames_written - played;
+} // null_fill()
+
+static int null_configure (struct audio_sink *s)
+{
+s->buffer_frames = (uint64_t) s->rate * s->profile->buffer_us / 1000000;
+s->clock_start_us = now_us ();
+s->frames_written = 0;
+return 0;
+} // null_configure()
+
+static long null_write (struct audio_sink *s, const uint8_t *pcm, size_t frames)
+{
+size_t space = s->buffer_frames - null_fill (s);
+if (frames > space)
+  frames = space;
+s->frames_written += frames;
+atomic_store (&s->delay, (long) (s->buffer_frames - space + frames));
+return frames;
+} // null_write()
+
+static int null_wait (struct audio_sink *s, int timeout_ms)
+{
+size_t space = s->buffer_frames - null_fill (s);
+if (space > 0)
+  return 1;
+// room for another period of PLAYBACK_PERIOD_FRAMES is made in about 20 ms
+usleep ((timeout_ms < 20 ? timeout_ms : 20) * 1000);
+return (s->buffer_frames - null_fill (s)) > 0;
+} // null_wait()
+
+static void null_drain (struct audio_sink *s)
+{
+if (s->rate == 0)
+  return; // never configured
+size_t fill = null_fill (s);
+usleep ((uint64_t) fill * 1000000 / s->rate);
+} // null_drain()
+
+static void null_flush (struct audio_sink *s)
+{
+s->clock_start_us = now_us ();
+s->frames_written = 0;
+} // null_flush()
+
+static void null_close (struct audio_sink *s)
+{
+} // null_close()
+
+static const struct audio_sink_ops null_ops = {
+  "null", null_configure, null_write, null_wait, null_drain, null_flush, null_close
+};
+
+// ==============================================================
+
+struct audio_sink *audio_sink_open (const char *spec)
+// spec as given to -d; return NULL if the sink cannot be opened
+{
+struct audio_sink *s = calloc (1, sizeof (*s));
+if (s == NULL)
+  return NULL;
+atomic_init (&s->underruns, 0);
+atomic_init (&s->recoveries, 0);
+atomic_init (&s->delay, 0);
+s->profile = &sink_profiles[1];
+if (strcmp (spec, "null") == 0)
+  s->ops = &null_ops;
+else if (strncmp (spec, "wav:", 4) == 0) {
+  s->ops = &wav_ops;
+  s->fp = (strcmp (spec + 4, "-") == 0) ? stdout : fopen (spec + 4, "wb");
+  if (s->fp == NULL) {
+    pi_radio_log ("ERROR: cannot open \"%s\" (%s)\n", spec + 4, strerror (errno));
+    free (s);
+    return NULL;
+    }
+  }
+else {
+  const char *device = (strncmp (spec, "alsa:", 5) == 0) ? spec + 5 : spec;
+  int err;
+  s->ops = &alsa_ops;
+  pi_radio_log ("Calling snd_pcm_open() for device \"%s\"\n", device);
+  if ((err = snd_pcm_open (&s->pcm, device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK)) < 0) {
+    pi_radio_log ("ERROR: snd_pcm_open() fails (%s)\n", snd_strerror (err));
+    free (s);
+    return NULL;
+    }
+  }
+return s;
+} // audio_sink_open()
+
+int audio_sink_set_profile (struct audio_sink *s, const char *name)
+// one of the profiles at the top of this file, before audio_sink_configure(); -1 if unknown
+{
+size_t i;
+for (i = 0; i < sizeof (sink_profiles) / sizeof (sink_profiles[0]); i++)
+  if (strcmp (name, sink_profiles[i].name) == 0) {
+    s->profile = &sink_profiles[i];
+    return 0;
+    }
+return -1;
+} // audio_sink_set_profile()
+
+int audio_sink_configure (struct audio_sink *s, unsigned int rate)
+// S16 stereo at rate; called before the first write, and again when a new station has another rate
+{
+if (rate == s->rate)
+  return 0;
+s->rate = rate;
+pi_radio_log ("configuring the %s sink for %u Hz with the %s profile\n", s->ops->name, rate, s->profile->name);
+return s->ops->configure (s);
+} // audio_sink_configure()
+
+long audio_sink_write (struct audio_sink *s, const uint8_t *pcm, size_t frames)
+// take as many frames as fit without blocking; return that number or -1 on error
+{
+return s->ops->write (s, pcm, frames);
+} // audio_sink_write()
+
+int audio_sink_wait (struct audio_sink *s, int timeout_ms)
+// wait until audio_sink_write() can take frames; return 1 then, 0 on timeout, -1 on error
+{
+return s->ops->wait (s, timeout_ms);
+} // audio_sink_wait()
+
+int audio_sink_write_all (struct audio_sink *s, const uint8_t *pcm, size_t frames)
+{
+while (frames > 0) {
+  long n = audio_sink_write (s, pcm, frames);
+  if (n < 0)
+    return -1;
+  if (n == 0) {
+    if (audio_sink_wait (s, 1000) < 0)
+      return -1;
+    continue;
+    }
+  pcm += n * PCM_FRAME_BYTES;
+  frames -= n;
+  }
+return 0;
+} // audio_sink_write_all()
+
+void audio_sink_drain (struct audio_sink *s)
+// play what the sink holds and wait for it
+{
+s->ops->drain (s);
+} // audio_sink_drain()
+
+void audio_sink_flush (struct audio_sink *s)
+// drop what the sink holds, at once (a station switch)
+{
+if (s->rate == 0)
+  return; // never configured
+s->ops->flush (s);
+atomic_store (&s->delay, 0);
+} // audio_sink_flush()
+
+void audio_sink_close (struct audio_sink *s)
+{
+s->ops->close (s);
+free (s);
+} // audio_sink_close()
+
+unsigned int audio_sink_underruns (struct audio_sink *s)
+{
+return atomic_load (&s->underruns);
+}
+
+unsigned int audio_sink_recoveries (struct audio_sink *s)
+{
+return atomic_load (&s->recoveries);
+}
+
+int audio_sink_delay_ms (struct audio_sink *s)
+// audio queued in the sink after the last write
+{
+return s->rate ? (int) (atomic_load (&s->delay) * 1000 / s->rate) : 0;
+}
+
+const char *audio_sink_name (struct audio_sink *s)
+{
+return s->ops->name;
+}
@@ -0,0 +1,897 @@
+/*
+File: station.c
+Description: one radio station: following its playlists to the stream,
+downloading the stream and, for HLS, the player thread which decodes the
+segments into the PCM ring
+
+A station is driven by the event loop of the main thread and never blocks
+it: the playlists are loaded with fetch_start() and followed from their
+completion callbacks (an m3u file to its first URL, a master playlist to
+its first variant); then the segments are queued and the playlist reloaded
+on a timer, or the MP3 or AAC stream is decoded as it comes. In record mode
+(record.c) the station hands what it receives to its recorder instead.
+
+A station is created as a standby which only prefetches: an HLS station
+keeps the latest SEGMENT_QUEUE_SIZE segments and an MP3 or AAC station the
+last STANDBY_STREAM_BYTES of its stream, so that station_play() finds the audio
+already downloaded. Only the playing station writes to the PCM ring.
+
+A stream which drops, or a playlist which cannot be loaded on the way to
+it, is loaded again after a delay which doubles from RECONNECT_MIN_MS; the
+decoder of a stream is kept, and finds the next frame in what the new
+connection sends. A segment whose download breaks is resumed with a range
+from where it broke. The live playlist goes on being reloaded meanwhile,
+and the segments are queued from the first one not played yet.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pi_radio.h"
+
+#define DEFAULT_TARGET_DURATION 4
+// a live stream is joined this many segments before its end
+#define LIVE_EDGE_SEGMENTS 3
+// what a standby MP3 or AAC station keeps of its stream (4 s at 128 kbit/s)
+#define STANDBY_STREAM_BYTES 65536
+// what station_play() decodes of it per pass of the event loop, about what curl hands at a time
+#define STREAM_FEED_BYTES 4096
+// m3u files and master playlists followed before the stream
+#define STATION_MAX_REDIRECTS 4
+// backoff of the reconnects, and the attempts in a row before the station fails
+#define RECONNECT_MIN_MS 250
+#define RECONNECT_MAX_MS 30000
+#define STATION_MAX_RECONNECTS 12
+// attempts to resume the download of a segment before it is skipped
+#define SEGMENT_MAX_RETRIES 3
+
+// waits of the player thread for the first bytes of a segment
+static int segment_gap_count;
+static uint64_t segment_gap_total_ms;
+static int segment_gap_max_ms;
+// streams, playlists and segment downloads which came back after a drop
+static int recovery_count;
+static uint64_t recovery_total_ms;
+static int recovery_max_ms;
+
+static void reload_playlist (void *userdata);
+static void station_reconnect (void *userdata);
+static void abr_update (struct station *st, struct fetch *f, struct segment *seg);
+
+// ==============================================================
+
+static int is_stream (const char *type)
+// the Content-Type of a stream decoded as it comes (Icecast, Shoutcast)
+{
+return strcmp (type, "AUDIO/MPEG") == 0 || strcmp (type, "AUDIO/AAC") == 0 || strcmp (type, "AUDIO/AACP") == 0;
+} // is_stream()
+
+static int stream_kind (const char *type)
+// TIMESHIFT_MP3 or TIMESHIFT_AAC
+{
+return (strcmp (type, "AUDIO/MPEG") == 0) ? TIMESHIFT_MP3 : TIMESHIFT_AAC;
+} // stream_kind()
+
+static size_t stream_decode (const char *type, const uint8_t *data, size_t size)
+// main thread: the next bytes of the playing stream, into the PCM ring
+{
+if (stream_kind (type) == TIMESHIFT_MP3)
+  return curl_write_callback_handler ((char *) data, 1, size, NULL);
+return aac_write_handler (data, size);
+} // stream_decode()
+
+static void stream_feed (void *userdata)
+/* fetch_timer_fn of feed_timer: decode the stream prefetched in standby a
+chunk per pass of the event loop, as if it came from the network, so that
+the other transfers and the control socket are not held up by the switch;
+what arrives meanwhile waits behind it in st->body */
+{
+struct station *st = userdata;
+size_t n = st->body.size - st->body_fed;
+if (n > STREAM_FEED_BYTES)
+  n = STREAM_FEED_BYTES;
+if (atomic_load (&st->shifted))
+  n = st->body.size - st->body_fed; // timeshift.c plays from the store
+else
+  stream_decode (st->content_type, st->body.data + st->body_fed, n);
+st->body_fed += n;
+if (st->body_fed < st->body.size) {
+  fetch_timer_start (&st->feed_timer, 0, stream_feed, st);
+  return;
+  }
+st->body.size = 0;
+st->body_fed = 0;
+} // stream_feed()
+
+static int station_parse (struct station *st, struct mem_buffer *body, const char *url)
+/* parse an m3u or m3u8 body fetched from url into st->playlist
+return the number of segments (or of variants of a master playlist), 0 on failure */
+{
+if (m3u8_parse (&st->playlist, body->data, body->size, url) != 0) {
+  pi_radio_log ("ERROR: m3u8_parse() is out of memory\n");
+  return 0;
+  }
+if (st->playlist.target_duration > 0)
+  st->target_duration = st->playlist.target_duration;
+return st->playlist.variant_count ? st->playlist.variant_count : st->playlist.segment_count;
+} // station_parse()
+
+static void station_end (struct station *st, int failed)
+{
+if (failed)
+  pi_radio_log ("ERROR: station \"%s\" fails\n", st->url);
+else
+  pi_radio_log ("station \"%s\" ends\n", st->url);
+st->state = STATION_ENDED;
+st->failed = failed;
+} // station_end()
+
+static int backoff_ms (int attempt)
+// the delay before the attempt-th reconnect (from 0)
+{
+int delay = RECONNECT_MIN_MS;
+while (attempt-- > 0 && delay < RECONNECT_MAX_MS)
+  delay *= 2;
+return (delay < RECONNECT_MAX_MS) ? delay : RECONNECT_MAX_MS;
+} // backoff_ms()
+
+static void recovered (const char *what, uint64_t dropped_ms, int attempts)
+// the data of what comes again since dropped_ms
+{
+int ms = (int) (monotonic_ms () - dropped_ms);
+pi_radio_log ("%s is back after %d ms and %d attempts\n", what, ms, attempts);
+recovery_count++;
+recovery_total_ms += ms;
+if (ms > recovery_max_ms)
+  recovery_max_ms = ms;
+metrics_observe (METRICS_RECONNECT, (uint64_t) ms * 1000);
+} // recovered()
+
+static void station_retry (struct station *st)
+/* the stream, or a playlist on the way to it, dropped or could not be
+loaded: load st->load_url again after the backoff; the station fails after
+STATION_MAX_RECONNECTS attempts in a row */
+{
+if (st->reconnects == STATION_MAX_RECONNECTS) {
+  pi_radio_log ("ERROR: giving up on \"%s\" after %d attempts\n", st->load_url, st->reconnects);
+  station_end (st, 1);
+  return;
+  }
+if (st->reconnects == 0)
+  st->dropped_ms = monotonic_ms ();
+int delay = backoff_ms (st->reconnects++);
+pi_radio_log ("WARNING: loading \"%s\" again in %d ms (attempt %d)\n", st->load_url, delay, st->reconnects);
+fetch_timer_start (&st->reconnect_timer, delay, station_reconnect, st);
+} // station_retry()
+
+// ==============================================================
+
+static int segment_ms (struct station *st)
+// duration of the segments of the stream
+{
+struct m3u8_playlist *pl = &st->playlist;
+if (pl->segment_count > 0 && pl->segments[pl->segment_count - 1].duration > 0)
+  return (int) (pl->segments[pl->segment_count - 1].duration * 1000);
+return st->target_duration * 1000;
+} // segment_ms()
+
+static int buffered_ms (struct station *st)
+// audio waiting to be played: the queued segments, plus what is in the PCM ring if st plays
+{
+unsigned int rate = atomic_load (&pcm_rate);
+int ms = (st->playing && rate) ? (int) (pcm_ring_fill (&pcm_ring) * 1000 / rate) : 0;
+return ms + segment_queue_count (&st->queue) * segment_ms (st);
+} // buffered_ms()
+
+// ==============================================================
+
+static void segment_done (struct fetch *f, int result);
+
+static size_t segment_write (struct fetch *f, const uint8_t *data, size_t size)
+// append the received data to the segment; the player thread reads it as it grows
+{
+struct segment *seg = fetch_userdata (f);
+size_t skip = 0;
+if (fetch_status (f) >= 400)
+  return 0; // an error page: segment_done() tells a 4xx from a 5xx
+if (strcmp (fetch_content_type (f), "VIDEO/MP2T") != 0) {
+  pi_radio_log ("ERROR: content_type (%s) of media sequence %d is not \"VIDEO/MP2T\"\n", fetch_content_type (f), seg->media_sequence);
+  return 0; // return 0 means error to curl
+  }
+if (seg->skip > 0) {
+  // a resumed download: the server which ignores the range sends the start again
+  if (fetch_status (f) != 206)
+    skip = (size < seg->skip) ? size : seg->skip;
+  seg->skip = (fetch_status (f) != 206) ? seg->skip - skip : 0;
+  }
+if (segment_queue_append (&seg->station->queue, seg, data + skip, size - skip) != 0)
+  return 0; // return 0 means error to curl
+return size;
+} // segment_write()
+
+static void segment_resume (void *userdata)
+// fetch_timer_fn of a segment's retry_timer: download the rest of it
+{
+struct segment *seg = userdata;
+int64_t length = (seg->byterange_length >= 0) ? seg->byterange_length - (int64_t) seg->data.size : -1;
+seg->skip = seg->byterange_offset + seg->data.size;
+seg->fetch = fetch_start_range (seg->uri, seg->byterange_offset + seg->data.size, length, segment_write, segment_done, seg);
+if (seg->fetch == NULL)
+  fetch_timer_start (&seg->retry_timer, backoff_ms (seg->retries), segment_resume, seg);
+} // segment_resume()
+
+static void segment_done (struct fetch *f, int result)
+{
+struct segment *seg = fetch_userdata (f);
+struct station *st = seg->station;
+int64_t bytes, us;
+int status = fetch_status (f);
+const char *type = fetch_content_type (f);
+seg->fetch = NULL;
+// an HTTP error, or an empty body, is as unusable as a broken download
+int failed = result != 0 || status >= 400 || seg->data.size == 0;
+/* only a broken connection or a server error is worth another request: a 4xx
+(a segment gone from the live window) or another body would only come again */
+int transient = status >= 500 || (status < 400 && (type[0] == '\0' || strcmp (type, "VIDEO/MP2T") == 0));
+if (failed && transient && !atomic_load (&st->stop) && seg->retries < SEGMENT_MAX_RETRIES &&
+    (seg->byterange_length < 0 || (int64_t) seg->data.size < seg->byterange_length)) {
+  // the player waits for the rest meanwhile, and the PCM ring covers the wait
+  int delay = backoff_ms (seg->retries++);
+  if (seg->retries == 1)
+    seg->dropped_ms = monotonic_ms ();
+  pi_radio_log ("WARNING: download of media sequence %d breaks after %zu bytes; resuming it in %d ms\n", seg->media_sequence, seg->data.size, delay);
+  fetch_timer_start (&seg->retry_timer, delay, segment_resume, seg);
+  return;
+  }
+if (failed && status >= 400)
+  pi_radio_log ("ERROR: media sequence %d answers HTTP %d; skipping it\n", seg->media_sequence, status);
+pi_radio_log ("download of media sequence %d is over (%zu bytes)\n", seg->media_sequence, seg->data.size);
+if (!failed && seg->retries > 0) {
+  char what[64];
+  snprintf (what, sizeof (what), "media sequence %d", seg->media_sequence);
+  recovered (what, seg->dropped_ms, seg->retries);
+  }
+if (!failed && fetch_transfer_stats (f, &bytes, &us) == 0)
+  metrics_observe (METRICS_FETCH, us);
+if (!failed && st->master.variant_count > 1)
+  abr_update (st, f, seg);
+segment_queue_finish (&st->queue, seg, failed);
+if (st->playing && !failed && timeshift_enabled ()) {
+  if (seg->discontinuity)
+    timeshift_new_epoch ();
+  timeshift_append (TIMESHIFT_TS, seg->media_sequence, seg->data.data, seg->data.size);
+  }
+if (st->recorder)
+  record_notify (st->recorder);
+} // segment_done()
+
+static void queue_pending_segments (struct station *st)
+/* producer side of the segment queue: start the downloads of the segments in
+the playlist which are not queued yet, as long as there are free slots.
+It is called from the event loop, so the download of the next segments
+overlaps the playback of the current one, and up to SEGMENT_QUEUE_SIZE
+downloads run at the same time */
+{
+struct m3u8_playlist *pl = &st->playlist;
+if (st->master.variant_count > 1 && st->playlist_variant != st->abr.current)
+  return; // wait for the media playlist of the new variant
+int i = st->media_sequence_queued + 1 - pl->media_sequence;
+if (i < 0) {
+  pi_radio_log ("ERROR: media sequence %d to %d dropped out of the playlist\n", st->media_sequence_queued + 1, pl->media_sequence - 1);
+  i = 0;
+  }
+for (; i < pl->segment_count; i++) {
+  struct m3u8_segment *s = &pl->segments[i];
+  struct segment *seg = segment_queue_reserve (&st->queue);
+  if (seg == NULL && !st->playing && !st->recorder) {
+    // a standby keeps the latest segments: drop the oldest once downloaded
+    struct segment *oldest = segment_queue_front (&st->queue);
+    if (oldest->fetch != NULL || oldest->retry_timer.armed)
+      return;
+    segment_queue_pop (&st->queue);
+    seg = segment_queue_reserve (&st->queue);
+    }
+  if (seg == NULL)
+    return; // called again once the player frees a slot
+  pi_radio_log ("handing url[%d] \"%s\"\n", i, s->uri);
+  seg->media_sequence = s->media_sequence;
+  seg->discontinuity = s->discontinuity || st->variant_codecs_changed;
+  seg->duration = s->duration;
+  seg->station = st;
+  snprintf (seg->uri, sizeof (seg->uri), "%s", s->uri);
+  seg->byterange_offset = s->byterange_offset;
+  seg->byterange_length = s->byterange_length;
+  seg->retries = 0;
+  seg->skip = 0;
+  seg->fetch = fetch_start_range (s->uri, s->byterange_offset, s->byterange_length, segment_write, segment_done, seg);
+  if (seg->fetch == NULL)
+    return; // the segment stays pending for the next station_poll()
+  st->variant_codecs_changed = 0;
+  // pushed before the first bytes arrive (from fetch_perform()) so that the player can start on them
+  segment_queue_push (&st->queue);
+  st->media_sequence_queued = s->media_sequence;
+  pi_radio_log ("queued media sequence %d (%d segments waiting)\n", s->media_sequence, segment_queue_count (&st->queue));
+  }
+} // queue_pending_segments()
+
+// ==============================================================
+
+static void player_take_rate (struct ffmpeg_decoder *dec)
+// the first decoded frame of the station sets the rate of the PCM ring
+{
+if (atomic_load (&pcm_rate) == 0 && ffmpeg_decoder_output_rate (dec) != 0) {
+  pi_radio_log ("the station plays at %d Hz\n", ffmpeg_decoder_output_rate (dec));
+  atomic_store (&pcm_rate, ffmpeg_decoder_output_rate (dec));
+  }
+} // player_take_rate()
+
+static int ts_frame_to_decoder (const uint8_t *frame, size_t size, int64_t pts, void *userdata)
+// ts_frame_callback_t of the player thread's ts_demux
+{
+struct ffmpeg_decoder *dec = userdata;
+int err = ffmpeg_decoder_decode_adts (dec, frame, size, NULL, NULL);
+if (err < 0)
+  pi_radio_log ("ERROR: ffmpeg_decoder_decode_adts() returns %d\n", err);
+player_take_rate (dec);
+return err;
+} // ts_frame_to_decoder()
+
+static struct ffmpeg_decoder *player_decoder_new (void)
+{
+struct ffmpeg_decoder *dec = ffmpeg_decoder_new ();
+if (dec == NULL) {
+  pi_radio_log ("ERROR: ffmpeg_decoder_new() fails\n");
+  exit (1);
+  }
+ffmpeg_decoder_set_ring (dec, &pcm_ring); // resample straight into the ring
+// the rate of the stream, unless an earlier decoder of the station set it
+ffmpeg_decoder_set_output_rate (dec, atomic_load (&pcm_rate));
+return dec;
+} // player_decoder_new()
+
+static int submit_decode_jobs (struct station *st, struct decode_job *jobs)
+/* hand the complete segments waiting behind the head to the decode workers, up
+to the first one after a discontinuity; return how many. Only when the head is
+complete too, as the workers prime their decoders from the segment before */
+{
+int n;
+// the workers resample to the rate of the ring, which the first frame sets
+if (segment_queue_peek (&st->queue, 0) == NULL || atomic_load (&pcm_rate) == 0)
+  return 0;
+for (n = 0; n < decode_pool_workers () && n + 1 < SEGMENT_QUEUE_SIZE; n++) {
+  struct segment *seg = segment_queue_peek (&st->queue, n + 1);
+  if (seg == NULL || seg->discontinuity || seg->failed)
+    break;
+  jobs[n].seg = seg;
+  jobs[n].prev = segment_queue_peek (&st->queue, n);
+  jobs[n].rate = atomic_load (&pcm_rate);
+  decode_pool_submit (&jobs[n]);
+  }
+if (n > 0)
+  pi_radio_log ("catching up: media sequence %d to %d go to the decode workers\n", jobs[0].seg->media_sequence, jobs[n - 1].seg->media_sequence);
+return n;
+} // submit_decode_jobs()
+
+static void *player_thread_main (void *arg)
+/* consumer side of the segment queue: decode and play the segments in order
+a segment is demuxed while it is still downloading; only if it holds
+something else than ADTS AAC is it decoded by libavformat once complete.
+The complete segments behind it are decoded meanwhile by decode_pool.c and
+written to the PCM ring after it, in order. While the station is shifted
+the segments are only read through, for the downloads to go on */
+{
+struct station *st = arg;
+uint8_t chunk[16384];
+struct segment *seg;
+struct ts_demux demux;
+struct decode_job jobs[SEGMENT_QUEUE_SIZE - 1];
+int job_count, j;
+ssize_t n;
+int err;
+int skip, skipped = 0;        // the segment (the previous one) is not decoded
+uint64_t segment_end_ms = 0;  // when the player was done with the previous segment
+// the codec context and the resampler are kept from one segment to the next
+struct ffmpeg_decoder *dec = player_decoder_new ();
+ts_demux_init (&demux, ts_frame_to_decoder, dec);
+memset (jobs, 0, sizeof (jobs));
+
+while (!atomic_load (&st->stop) && (seg = segment_queue_front (&st->queue)) != NULL) {
+  pi_radio_log ("demuxing media sequence %d\n", seg->media_sequence);
+  atomic_store (&st->playing_sequence, seg->media_sequence);
+  skip = atomic_load (&st->shifted);
+  if (seg->discontinuity || (skipped && !skip)) {
+    // the encoding may change at an #EXT-X-DISCONTINUITY: start with a fresh decoder
+    pi_radio_log ("%s before media sequence %d\n", seg->discontinuity ? "discontinuity" : "back from the timeshift", seg->media_sequence);
+    ffmpeg_decoder_free (dec);
+    dec = player_decoder_new ();
+    ts_demux_init (&demux, ts_frame_to_decoder, dec);
+    }
+  job_count = skip ? 0 : submit_decode_jobs (st, jobs);
+  ts_demux_reset (&demux);
+  size_t offset = 0;
+  err = 0;
+  while (!atomic_load (&st->stop) && (n = segment_queue_read (&st->queue, seg, offset, chunk, sizeof (chunk))) > 0) {
+    if (offset == 0 && segment_end_ms != 0) {
+      int gap = (int) (monotonic_ms () - segment_end_ms);
+      segment_gap_count++;
+      segment_gap_total_ms += gap;
+      if (gap > segment_gap_max_ms)
+        segment_gap_max_ms = gap;
+      }
+    offset += n;
+    // station_shift() waits while decoding is set; once shifted, the rest of the segment is skipped
+    atomic_store (&st->decoding, 1);
+    if (atomic_load (&st->shifted))
+      skip = 1;
+    if (!skip && err == 0 && !demux.unsupported)
+      err = ts_demux_feed (&demux, chunk, n);
+    atomic_store (&st->decoding, 0);
+    }
+  if (atomic_load (&st->stop)) {
+    // the jobs read the queue, which is freed once this thread is gone
+    for (j = 0; j < job_count; j++)
+      decode_pool_wait (&jobs[j]);
+    break;
+    }
+  atomic_store (&st->decoding, 1);
+  if (atomic_load (&st->shifted))
+    skip = 1;
+  if (skip)
+    pi_radio_log ("media sequence %d is only kept in the timeshift\n", seg->media_sequence);
+  else if (n < 0)
+    pi_radio_log ("ERROR: download of media sequence %d failed; skipping it\n", seg->media_sequence);
+  else if (demux.unsupported || demux.audio_pid < 0) {
+    pi_radio_log ("calling ffmpeg_decoder_decode_buffer() for media sequence %d with %zu bytes\n", seg->media_sequence, seg->data.size);
+    err = ffmpeg_decoder_decode_buffer (dec, seg->data.data, seg->data.size, NULL, NULL);
+    player_take_rate (dec);
+    if (err < 0)
+      pi_radio_log ("ERROR: ffmpeg_decoder_decode_buffer() returns %d; skipping media sequence %d\n", err, seg->media_sequence);
+    }
+  else if (err != 0)
+    pi_radio_log ("ERROR: decoding stops at byte %zu of media sequence %d\n", offset, seg->media_sequence);
+  else
+    pi_radio_log ("media sequence %d played\n", seg->media_sequence);
+
+  // a slot is popped only once the job which primes from it is done
+  for (j = 0; j < job_count; j++) {
+    decode_pool_wait (&jobs[j]);
+    segment_queue_pop (&st->queue);
+    fetch_wakeup (); // a slot is free for the next download
+    if (jobs[j].result < 0)
+      pi_radio_log ("ERROR: decoding of media sequence %d fails (%d)\n", jobs[j].seg->media_sequence, jobs[j].result);
+    if (atomic_load (&st->stop) || skip || pcm_ring_write_all (&pcm_ring, jobs[j].pcm.data, jobs[j].pcm.size / PCM_FRAME_BYTES) != 0)
+      pi_radio_log ("ERROR: media sequence %d decoded by a worker is not played\n", jobs[j].seg->media_sequence);
+    else
+      pi_radio_log ("media sequence %d played from a decode worker\n", jobs[j].seg->media_sequence);
+    }
+  if (!skip && job_count > 0 && jobs[job_count - 1].tail.count > 0)
+    decode_pool_prime (dec, &jobs[job_count - 1].tail, &pcm_ring);
+  atomic_store (&st->decoding, 0);
+  skipped = skip;
+  segment_queue_pop (&st->queue);
+  fetch_wakeup (); // a slot is free for the next download
+  segment_end_ms = monotonic_ms ();
+  }
+for (j = 0; j < SEGMENT_QUEUE_SIZE - 1; j++)
+  free (jobs[j].pcm.data);
+ffmpeg_decoder_free (dec);
+atomic_store (&st->player_done, 1);
+fetch_wakeup ();
+pi_radio_log ("player thread exits\n");
+return NULL;
+} // player_thread_main()
+
+static void start_player (struct station *st)
+{
+int err;
+pi_radio_log ("Calling pthread_create() for the player thread\n");
+if ((err = pthread_create (&st->player_thread, NULL, player_thread_main, st)) != 0) {
+  pi_radio_log ("ERROR: pthread_create() fails (%s)\n", strerror (err));
+  station_end (st, 1);
+  return;
+  }
+st->player_started = 1;
+} // start_player()
+
+// ==============================================================
+
+static int reload_delay_ms (struct station *st, int changed)
+/* when to reload the live playlist (RFC 8216 section 6.3.4): the target
+duration after a load which brought a new segment, half of it after an
+unchanged one, backing off by another half target duration for each further
+unchanged reload (up to twice the target duration) unless the buffer runs low.
+With a deep buffer the reload is put off as long as 2 target durations of
+audio remain. The delay counts from when the last load began */
+{
+int td = st->target_duration * 1000;
+int buffered = buffered_ms (st);
+int delay;
+if (changed) {
+  st->reload_unchanged = 0;
+  delay = td;
+  }
+else {
+  st->reload_unchanged++;
+  delay = (buffered < td) ? td / 2 : td / 2 * st->reload_unchanged;
+  if (delay > 2 * td)
+    delay = 2 * td;
+  }
+if (buffered - 2 * td > delay)
+  delay = (buffered - 2 * td < 3 * td) ? buffered - 2 * td : 3 * td;
+delay -= (int) (monotonic_ms () - st->reload_started_ms);
+return (delay > 0) ? delay : 0;
+} // reload_delay_ms()
+
+static size_t reload_write (struct fetch *f, const uint8_t *data, size_t size)
+{
+struct station *st = fetch_userdata (f);
+return (mem_buffer_append (&st->body, data, size) == 0) ? size : 0;
+} // reload_write()
+
+static void reload_done (struct fetch *f, int result)
+{
+struct station *st = fetch_userdata (f);
+struct m3u8_playlist *pl = &st->playlist;
+int changed = 0;
+st->fetch = NULL;
+if (result != 0 || strcmp (fetch_content_type (f), "APPLICATION/VND.APPLE.MPEGURL") != 0)
+  pi_radio_log ("ERROR: the reloaded playlist is not an m3u8 file (%s)\n", fetch_content_type (f));
+else {
+  int last_media_sequence = pl->media_sequence + pl->segment_count - 1;
+  station_parse (st, &st->body, st->refresh_url);
+  changed = (pl->media_sequence + pl->segment_count - 1) > last_media_sequence;
+  if (changed)
+    pi_radio_log ("new media sequence received\n");
+  if (st->reload_variant != st->playlist_variant)
+    pi_radio_log ("ABR: media playlist of variant %d loaded; continuing after media sequence %d\n", st->reload_variant, st->media_sequence_queued);
+  st->playlist_variant = st->reload_variant;
+  }
+int delay = reload_delay_ms (st, changed);
+if (st->master.variant_count > 1 && st->playlist_variant != st->abr.current)
+  delay = 0; // the variant changed while this reload was in flight
+pi_radio_log ("next reload of the playlist in %d ms (%d ms of audio buffered)\n", delay, buffered_ms (st));
+fetch_timer_start (&st->reload_timer, delay, reload_playlist, st);
+} // reload_done()
+
+static void reload_playlist (void *userdata)
+// fetch_timer_fn of reload_timer
+{
+struct station *st = userdata;
+st->body.size = 0;
+st->reload_started_ms = monotonic_ms ();
+// the variant is kept as refresh_url may change before the playlist arrives
+st->reload_variant = st->abr.current;
+pi_radio_log ("reloading the playlist \"%s\"\n", st->refresh_url);
+if ((st->fetch = fetch_start (st->refresh_url, reload_write, reload_done, st)) == NULL)
+  fetch_timer_start (&st->reload_timer, st->target_duration * 500, reload_playlist, st);
+} // reload_playlist()
+
+// ==============================================================
+
+static void abr_update (struct station *st, struct fetch *f, struct segment *seg)
+/* feed the download of a segment to the ABR controller and switch variant if it says so
+the switch takes effect at a segment boundary: the segments already queued are
+played, and the next ones come from the media playlist of the new variant with
+the following media sequence numbers */
+{
+struct abr *abr = &st->abr;
+struct m3u8_variant *variants = st->master.variants;
+int64_t bytes, us;
+if (fetch_transfer_stats (f, &bytes, &us) != 0)
+  return;
+abr_add_sample (abr, bytes, us, seg->duration);
+int variant = abr_select (abr, variants, buffered_ms (st), segment_ms (st));
+if (variant == abr->current)
+  return;
+pi_radio_log ("ABR: switching from variant %d (%ld bit/s) to variant %d (%ld bit/s); estimate %ld bit/s, %d ms buffered\n",
+  abr->current, variants[abr->current].bandwidth, variant, variants[variant].bandwidth,
+  abr_estimate (abr), buffered_ms (st));
+if (strcmp (variants[variant].codecs, variants[abr->current].codecs) != 0)
+  st->variant_codecs_changed = 1;
+abr_switched (abr, variant);
+snprintf (st->refresh_url, sizeof (st->refresh_url), "%s", variants[variant].uri);
+// load the new media playlist now unless a reload is in flight (reload_done() then reloads at once)
+if (st->reload_timer.armed)
+  fetch_timer_start (&st->reload_timer, 0, reload_playlist, st);
+} // abr_update()
+
+// ==============================================================
+
+static size_t station_body_write (struct fetch *f, const uint8_t *data, size_t size)
+// fetch_write_fn of station_load(): what to do with the body depends on its Content-Type
+{
+struct station *st = fetch_userdata (f);
+const char *type = fetch_content_type (f);
+if (is_stream (st->content_type) && (strcmp (type, st->content_type) != 0 || fetch_status (f) >= 400)) {
+  // a reconnect which brings something else, e.g. an error page
+  pi_radio_log ("ERROR: \"%s\" answers %d (%s) instead of the stream\n", st->load_url, fetch_status (f), type);
+  return 0; // return 0 means error to curl
+  }
+if (st->reconnects > 0) {
+  recovered (st->load_url, st->dropped_ms, st->reconnects);
+  st->reconnects = 0;
+  }
+if (st->content_type[0] == '\0') {
+  // first data of this response
+  snprintf (st->content_type, sizeof (st->content_type), "%s", type);
+  if (strcmp (type, "APPLICATION/VND.APPLE.MPEGURL") == 0)
+    pi_radio_log ("Content-Type (%s) is m3u8\n", type);
+  else if (strcmp (type, "AUDIO/X-MPEGURL") == 0)
+    pi_radio_log ("Content-Type (%s) is m3u\n", type);
+  else if (is_stream (type)) {
+    pi_radio_log ("Content-Type (%s) is %s\n", type, stream_kind (type) == TIMESHIFT_MP3 ? "MP3" : "AAC");
+    st->state = STATION_STREAMING;
+    }
+  }
+if (is_stream (type)) {
+  if (st->recorder && stream_kind (type) == TIMESHIFT_AAC) {
+    pi_radio_log ("ERROR: the AAC stream of \"%s\" cannot be recorded\n", st->url);
+    station_end (st, 1); // not to be reconnected
+    return 0; // error exit
+    }
+  if (st->recorder)
+    return record_mp3 (st->recorder, data, size);
+  if (st->playing && timeshift_enabled ())
+    timeshift_append (stream_kind (type), -1, data, size);
+  if (st->playing && atomic_load (&st->shifted))
+    return size; // timeshift.c plays from the store
+  if (st->playing && st->body.size == 0)
+    return stream_decode (type, data, size);
+  // playing: behind what stream_feed() still has to decode of the prefetch
+  // standby: keep the end of the stream for station_play(); mpg123 and the AAC parser find the next frame header
+  if (!st->playing && st->body.size + size > STANDBY_STREAM_BYTES) {
+    size_t drop = st->body.size + size - STANDBY_STREAM_BYTES;
+    if (drop > st->body.size)
+      drop = st->body.size;
+    memmove (st->body.data, st->body.data + drop, st->body.size - drop);
+    st->body.size -= drop;
+    }
+  return (mem_buffer_append (&st->body, data, size) == 0) ? size : 0;
+  }
+// playlists are kept in memory for station_parse()
+if (mem_buffer_append (&st->body, data, size) != 0)
+  return 0;
+return size;
+} // station_body_write()
+
+static void station_body_done (struct fetch *f, int result);
+
+static int station_load (struct station *st, const char *url)
+// fetch a playlist or the stream itself; what follows is up to station_body_done()
+{
+if (++st->redirects > STATION_MAX_REDIRECTS) {
+  pi_radio_log ("ERROR: too many playlists before the stream of \"%s\"\n", st->url);
+  return -1;
+  }
+snprintf (st->load_url, sizeof (st->load_url), "%s", url);
+pi_radio_log ("loading \"%s\"\n", st->load_url);
+st->content_type[0] = '\0';
+st->body.size = 0;
+st->reload_started_ms = monotonic_ms ();
+st->fetch = fetch_start (st->load_url, station_body_write, station_body_done, st);
+return (st->fetch != NULL) ? 0 : -1;
+} // station_load()
+
+static void station_reconnect (void *userdata)
+/* fetch_timer_fn of reconnect_timer: load st->load_url again
+a stream keeps its Content-Type, and with it its decoder and what a standby prefetched */
+{
+struct station *st = userdata;
+if (!is_stream (st->content_type)) {
+  st->content_type[0] = '\0';
+  st->body.size = 0;
+  }
+st->reload_started_ms = monotonic_ms ();
+pi_radio_log ("loading \"%s\" again\n", st->load_url);
+if ((st->fetch = fetch_start (st->load_url, station_body_write, station_body_done, st)) == NULL)
+  station_retry (st);
+} // station_reconnect()
+
+static void station_body_done (struct fetch *f, int result)
+{
+struct station *st = fetch_userdata (f);
+st->fetch = NULL;
+if (st->state == STATION_ENDED)
+  return;
+if (st->content_type[0] == '\0')
+  snprintf (st->content_type, sizeof (st->content_type), "%s", fetch_content_type (f));
+if (is_stream (st->content_type)) {
+  // only a file ends; a live stream has no length, and its end is a drop
+  if (result == 0 && fetch_content_length (f) >= 0 && fetch_status (f) < 400) {
+    pi_radio_log ("end of the %s stream\n", stream_kind (st->content_type) == TIMESHIFT_MP3 ? "MP3" : "AAC");
+    station_end (st, 0);
+    }
+  else {
+    pi_radio_log ("WARNING: the %s stream of \"%s\" drops\n", stream_kind (st->content_type) == TIMESHIFT_MP3 ? "MP3" : "AAC", st->load_url);
+    station_retry (st);
+    }
+  return;
+  }
+if (result != 0 || fetch_status (f) >= 500) {
+  pi_radio_log ("ERROR: cannot load \"%s\"\n", st->load_url);
+  station_retry (st);
+  return;
+  }
+
+if (strcmp (st->content_type, "AUDIO/X-MPEGURL") == 0) {
+  pi_radio_log ("got an m3u file and therefore need to parse the data\n");
+  if (station_parse (st, &st->body, st->load_url) < 1) {
+    pi_radio_log ("ERROR: no URL in the m3u file\n");
+    station_end (st, 1);
+    }
+  else {
+    pi_radio_log ("playing the first URL and assume it is a MP3 (for the RTHK case)\n");
+    if (station_load (st, st->playlist.segments[0].uri) != 0)
+      station_end (st, 1);
+    }
+  return;
+  }
+
+if (strcmp (st->content_type, "APPLICATION/VND.APPLE.MPEGURL") != 0) {
+  pi_radio_log ("ERROR: content_type (%s) is not \"APPLICATION/VND.APPLE.MPEGURL\"\n", st->content_type);
+  station_end (st, 1);
+  return;
+  }
+
+pi_radio_log ("got a m3u8 file and therefore need to parse the data\n");
+station_parse (st, &st->body, st->load_url);
+if (st->playlist.variant_count > 0) {
+  // kept for ABR; the first variant listed is the one to start with
+  m3u8_parse (&st->master, st->body.data, st->body.size, st->load_url);
+  abr_init (&st->abr, st->master.variant_count, 0);
+  int i;
+  for (i = 0; i < st->master.variant_count; i++)
+    pi_radio_log ("variant %d: %ld bit/s, codecs \"%s\", %s\n", i, st->master.variants[i].bandwidth, st->master.variants[i].codecs, st->master.variants[i].uri);
+  pi_radio_log ("master playlist: collecting the media playlist of variant 0\n");
+  if (station_load (st, st->master.variants[0].uri) != 0)
+    station_end (st, 1);
+  return;
+  }
+if (st->playlist.segment_count < 1) {
+  pi_radio_log ("ERROR: no segment in the media playlist\n");
+  station_end (st, 1);
+  return;
+  }
+// join a live stream near its end rather than at the start of its window
+if (!st->playlist.endlist && st->playlist.segment_count > LIVE_EDGE_SEGMENTS)
+  st->media_sequence_queued = st->playlist.media_sequence + st->playlist.segment_count - LIVE_EDGE_SEGMENTS - 1;
+snprintf (st->refresh_url, sizeof (st->refresh_url), "%s", st->load_url);
+pi_radio_log ("set refresh_url to \"%s\" (target duration %d s)\n", st->refresh_url, st->target_duration);
+st->state = STATION_STREAMING;
+fetch_timer_start (&st->reload_timer, reload_delay_ms (st, 1), reload_playlist, st);
+if (st->playing)
+  start_player (st);
+} // station_body_done()
+
+// ==============================================================
+
+struct station *station_new (const char *url)
+// start loading url as a standby station; NULL if it cannot even start
+{
+struct station *st = calloc (1, sizeof (*st));
+if (st == NULL)
+  return NULL;
+snprintf (st->url, sizeof (st->url), "%s", url);
+st->state = STATION_LOADING;
+st->target_duration = DEFAULT_TARGET_DURATION;
+st->media_sequence_queued = -1;
+atomic_init (&st->stop, 0);
+atomic_init (&st->player_done, 0);
+atomic_init (&st->shifted, 0);
+atomic_init (&st->decoding, 0);
+atomic_init (&st->playing_sequence, -1);
+m3u8_init (&st->playlist);
+m3u8_init (&st->master);
+segment_queue_init (&st->queue);
+if (station_load (st, url) != 0) {
+  station_free (st);
+  return NULL;
+  }
+return st;
+} // station_new()
+
+void station_play (struct station *st)
+/* let st feed the PCM ring, with what it has prefetched first
+the caller has stopped the station which played before */
+{
+st->playing = 1;
+if (st->state != STATION_STREAMING)
+  return; // the player starts once the stream is found
+if (is_stream (st->content_type)) {
+  pi_radio_log ("decoding the %zu bytes of the stream prefetched in standby\n", st->body.size);
+  if (timeshift_enabled ())
+    timeshift_append (stream_kind (st->content_type), -1, st->body.data, st->body.size);
+  st->body_fed = 0;
+  if (st->body.size > 0)
+    stream_feed (st);
+  }
+else
+  start_player (st);
+} // station_play()
+
+void station_poll (struct station *st)
+// called from the event loop: queue the next downloads and notice the end of an HLS stream
+{
+if (st->state != STATION_STREAMING || is_stream (st->content_type))
+  return;
+queue_pending_segments (st);
+if (st->playing && st->playlist.endlist &&
+    st->media_sequence_queued >= st->playlist.media_sequence + st->playlist.segment_count - 1)
+  segment_queue_close (&st->queue); // the player thread exits once it has played the rest
+if (atomic_load (&st->player_done))
+  station_end (st, 0);
+// a recorder pops the segments itself
+if (st->recorder && st->playlist.endlist && segment_queue_count (&st->queue) == 0 &&
+    st->media_sequence_queued >= st->playlist.media_sequence + st->playlist.segment_count - 1)
+  station_end (st, 0);
+} // station_poll()
+
+void station_free (struct station *st)
+/* stop the downloads and the player thread, and free st
+if st plays, the PCM ring must be interrupted first as the player may wait for room in it */
+{
+int i;
+atomic_store (&st->stop, 1);
+segment_queue_close (&st->queue);
+if (st->player_started)
+  pthread_join (st->player_thread, NULL);
+fetch_timer_stop (&st->reload_timer);
+fetch_timer_stop (&st->reconnect_timer);
+fetch_timer_stop (&st->feed_timer);
+if (st->fetch)
+  fetch_cancel (st->fetch);
+for (i = 0; i < SEGMENT_QUEUE_SIZE; i++) {
+  fetch_timer_stop (&st->queue.slots[i].retry_timer);
+  if (st->queue.slots[i].fetch)
+    fetch_cancel (st->queue.slots[i].fetch);
+  }
+segment_queue_free (&st->queue);
+m3u8_free (&st->playlist);
+m3u8_free (&st->master);
+free (st->body.data);
+free (st);
+} // station_free()
+
+const char *station_state_name (struct station *st)
+{
+switch (st->state) {
+  case STATION_LOADING:
+    return "loading";
+  case STATION_STREAMING:
+    return st->playing ? "playing" : (st->recorder ? "recording" : "prefetched");
+  default:
+    return st->failed ? "failed" : "ended";
+  }
+} // station_state_name()
+
+void station_write_stats (FILE *fp)
+// the -S lines about the segments and the recoveries
+{
+fprintf (fp, "segments=%d\n", segment_gap_count);
+fprintf (fp, "segment_gap_mean_ms=%d\n", segment_gap_count ? (int) (segment_gap_total_ms / segment_gap_count) : 0);
+fprintf (fp, "segment_gap_max_ms=%d\n", segment_gap_max_ms);
+fprintf (fp, "recoveries=%d\n", recovery_count);
+fprintf (fp, "recovery_mean_ms=%d\n", recovery_count ? (int) (recovery_total_ms / recovery_count) : 0);
+fprintf (fp, "recovery_max_ms=%d\n", recovery_max_ms);
+} // station_write_stats()
+
+void station_shift (struct station *st, int on)
+/* main thread: while on, st only downloads into the timeshift store
+when turning it on, the caller interrupts the PCM ring first; the player
+thread is then out of its decoder, and stays out, once this returns */
+{
+atomic_store (&st->shifted, on);
+while (on && atomic_load (&st->decoding))
+  usleep (1000);
+} // station_shift()
+
+int station_queued_ms (struct station *st)
+// the HLS segments downloaded (or downloading) and not played yet; 0 for a stream decoded as it comes
+{
+if (st->state != STATION_STREAMING || is_stream (st->content_type))
+  return 0;
+return segment_queue_count (&st->queue) * segment_ms (st);
+} // station_queued_ms()
@@ -0,0 +1,444 @@
+/*
+File: timeshift.c
+Description: the timeshift store (-T): pause, rewind and catch up with a
+live station without downloading it again
+
+What the playing station downloads is appended to a ring file of a fixed
+size, mapped in memory: the TS segments of an HLS stream whole, the bytes
+of an MP3 or AAC stream as they come. The oldest bytes are overwritten once the
+file is full. Only a small index is kept in RAM: one mark per segment, or
+per second of stream, with its position in the file, its media sequence and
+when it arrived (24 bytes), and one epoch per station or discontinuity,
+from which the decoders start afresh.
+
+While the station is shifted (station_shift()) it keeps downloading into
+the store but does not decode; the replay thread of this file decodes the
+store from a mark into the PCM ring instead, and follows the new marks
+once it reaches the last one.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <mpg123.h>
+
+#include "pi_radio.h"
+
+// an MP3 or AAC stream gets a mark at most this often
+#define TIMESHIFT_MARK_MS 1000
+// the bytes per mark a store is sized for: 1 s of 64 kbit/s MP3
+#define TIMESHIFT_BYTES_PER_MARK 8000
+#define TIMESHIFT_MAX_EPOCHS 256
+#define TIMESHIFT_CHUNK 16384
+
+struct timeshift_mark {
+  uint64_t pos;               // of the first byte, counted from the first byte ever stored
+  uint64_t ms;                // monotonic_ms() of its arrival, less base_ms; 32 bits would wrap after 49 days
+  int32_t media_sequence;     // -1 for MP3 and AAC
+};
+
+struct timeshift_epoch {
+  uint64_t pos;
+  int kind;
+};
+
+static int fd = -1;
+static uint8_t *map;
+static size_t map_size;
+static uint64_t base_ms;
+
+// guarded by lock: the main thread appends, the replay thread reads
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t appended = PTHREAD_COND_INITIALIZER;
+static uint64_t head;           // bytes stored so far
+static struct timeshift_mark *marks;
+static size_t mark_capacity, mark_first, mark_count;
+static struct timeshift_epoch epochs[TIMESHIFT_MAX_EPOCHS];
+static int epoch_first, epoch_count;
+static int epoch_pending = 1;   // the next record starts an epoch
+
+static pthread_t replay_thread;
+static int replay_started;
+static atomic_int replay_stop;
+static uint64_t replay_pos;     // where the replay thread starts
+static atomic_ullong replay_ms; // the arrival of the mark being replayed, as monotonic_ms()
+
+// ==============================================================
+
+static struct timeshift_mark *mark_at (size_t i)
+// the i-th mark from the oldest
+{
+return &marks[(mark_first + i) % mark_capacity];
+} // mark_at()
+
+static struct timeshift_epoch *epoch_at (int i)
+{
+return &epochs[(epoch_first + i) % TIMESHIFT_MAX_EPOCHS];
+} // epoch_at()
+
+static void evict (uint64_t limit)
+// forget the marks and epochs of the bytes before limit, about to be overwritten
+{
+while (mark_count > 0 && mark_at (0)->pos < limit) {
+  mark_first = (mark_first + 1) % mark_capacity;
+  mark_count--;
+  }
+// an epoch stays as long as a mark after its start does
+while (epoch_count > 1 && (mark_count == 0 || epoch_at (1)->pos <= mark_at (0)->pos)) {
+  epoch_first = (epoch_first + 1) % TIMESHIFT_MAX_EPOCHS;
+  epoch_count--;
+  }
+} // evict()
+
+static size_t mark_find (uint64_t pos)
+// index of the last mark at or before pos; the caller checks that there is a mark
+{
+size_t lo = 0, hi = mark_count;
+while (hi - lo > 1) {
+  size_t mid = (lo + hi) / 2;
+  if (mark_at (mid)->pos <= pos)
+    lo = mid;
+  else
+    hi = mid;
+  }
+return lo;
+} // mark_find()
+
+static int epoch_kind (uint64_t pos, uint64_t *start)
+// the kind of the epoch pos is in, and where the epoch starts
+{
+int i = epoch_count - 1;
+while (i > 0 && epoch_at (i)->pos > pos)
+  i--;
+*start = epoch_at (i)->pos;
+return epoch_at (i)->kind;
+} // epoch_kind()
+
+static void store_copy (uint64_t pos, uint8_t *out, size_t size)
+// the stored bytes from pos, across the end of the file
+{
+size_t index = pos % map_size;
+size_t first = (size < map_size - index) ? size : map_size - index;
+memcpy (out, map + index, first);
+memcpy (out + first, map, size - first);
+} // store_copy()
+
+// ==============================================================
+
+int timeshift_open (const char *path, size_t size)
+// map a store of size bytes at path, created or truncated
+{
+if ((fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+  pi_radio_log ("ERROR: cannot open \"%s\" (%s)\n", path, strerror (errno));
+  return -1;
+  }
+if (ftruncate (fd, size) != 0 ||
+    (map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+  pi_radio_log ("ERROR: cannot map %zu bytes of \"%s\" (%s)\n", size, path, strerror (errno));
+  map = NULL;
+  close (fd);
+  fd = -1;
+  return -1;
+  }
+map_size = size;
+mark_capacity = size / TIMESHIFT_BYTES_PER_MARK + 16;
+if ((marks = calloc (mark_capacity, sizeof (*marks))) == NULL) {
+  pi_radio_log ("ERROR: calloc() of %zu timeshift marks fails\n", mark_capacity);
+  return -1;
+  }
+base_ms = monotonic_ms ();
+atomic_init (&replay_stop, 0);
+atomic_init (&replay_ms, 0);
+pi_radio_log ("timeshift store \"%s\": %zu MB, index of %zu marks (%zu KB)\n", path, size >> 20,
+  mark_capacity, mark_capacity * sizeof (*marks) >> 10);
+return 0;
+} // timeshift_open()
+
+int timeshift_enabled (void)
+{
+return map != NULL;
+} // timeshift_enabled()
+
+void timeshift_new_epoch (void)
+// main thread: what is appended next does not follow what was (another station, a discontinuity)
+{
+pthread_mutex_lock (&lock);
+epoch_pending = 1;
+pthread_mutex_unlock (&lock);
+} // timeshift_new_epoch()
+
+void timeshift_append (int kind, int media_sequence, const uint8_t *data, size_t size)
+/* main thread: store a whole segment (TIMESHIFT_TS) or the next bytes of an MP3
+or AAC stream (TIMESHIFT_MP3, TIMESHIFT_AAC); the writes only ever go forward in the file */
+{
+if (map == NULL || size == 0 || size > map_size / 2)
+  return;
+uint64_t now = monotonic_ms () - base_ms;
+pthread_mutex_lock (&lock);
+evict (head + size > map_size ? head + size - map_size : 0);
+if (epoch_pending || epoch_at (epoch_count - 1)->kind != kind) {
+  if (epoch_count == TIMESHIFT_MAX_EPOCHS) {
+    epoch_first = (epoch_first + 1) % TIMESHIFT_MAX_EPOCHS;
+    epoch_count--;
+    }
+  epochs[(epoch_first + epoch_count++) % TIMESHIFT_MAX_EPOCHS] = (struct timeshift_epoch) { head, kind };
+  epoch_pending = 0;
+  }
+// a stream mark every TIMESHIFT_MARK_MS; the bytes in between extend the last record
+if (kind == TIMESHIFT_TS || mark_count == 0 || mark_at (mark_count - 1)->pos < epoch_at (epoch_count - 1)->pos ||
+    now - mark_at (mark_count - 1)->ms >= TIMESHIFT_MARK_MS) {
+  if (mark_count == mark_capacity) {
+    mark_first = (mark_first + 1) % mark_capacity;
+    mark_count--;
+    }
+  *mark_at (mark_count++) = (struct timeshift_mark) { head, now, media_sequence };
+  }
+size_t index = head % map_size;
+size_t first = (size < map_size - index) ? size : map_size - index;
+memcpy (map + index, data, first);
+memcpy (map, data + first, size - first);
+head += size;
+pthread_cond_broadcast (&appended);
+pthread_mutex_unlock (&lock);
+} // timeshift_append()
+
+uint64_t timeshift_sequence_ms (int media_sequence)
+// when the segment of the latest epoch with media_sequence arrived, as monotonic_ms(); 0 if not stored
+{
+uint64_t ms = 0;
+size_t i;
+pthread_mutex_lock (&lock);
+for (i = mark_count; i > 0 && ms == 0; i--)
+  if (mark_at (i - 1)->media_sequence == media_sequence)
+    ms = base_ms + mark_at (i - 1)->ms;
+pthread_mutex_unlock (&lock);
+return ms;
+} // timeshift_sequence_ms()
+
+uint64_t timeshift_oldest_ms (void)
+// the oldest mark, as monotonic_ms(); 0 if the store is empty
+{
+pthread_mutex_lock (&lock);
+uint64_t ms = mark_count ? base_ms + mark_at (0)->ms : 0;
+pthread_mutex_unlock (&lock);
+return ms;
+} // timeshift_oldest_ms()
+
+// ==============================================================
+
+static int replay_ts (struct ffmpeg_decoder *dec, struct ts_demux *demux, const struct mem_buffer *seg)
+// a whole segment, demuxed and decoded as by the player thread of station.c
+{
+ts_demux_reset (demux);
+int err = ts_demux_feed (demux, seg->data, seg->size);
+if (demux->unsupported || demux->audio_pid < 0)
+  err = ffmpeg_decoder_decode_buffer (dec, seg->data, seg->size, NULL, NULL);
+if (atomic_load (&pcm_rate) == 0 && ffmpeg_decoder_output_rate (dec) != 0)
+  atomic_store (&pcm_rate, ffmpeg_decoder_output_rate (dec));
+return err;
+} // replay_ts()
+
+static int replay_adts (const uint8_t *frame, size_t size, int64_t pts, void *userdata)
+// ts_frame_callback_t of the replay
+{
+int err = ffmpeg_decoder_decode_adts (userdata, frame, size, NULL, NULL);
+if (atomic_load (&pcm_rate) == 0 && ffmpeg_decoder_output_rate (userdata) != 0)
+  atomic_store (&pcm_rate, ffmpeg_decoder_output_rate (userdata));
+return err;
+} // replay_adts()
+
+static int replay_aac (struct ffmpeg_decoder *dec, const uint8_t *data, size_t size)
+{
+int err = ffmpeg_decoder_feed_adts (dec, data, size);
+if (atomic_load (&pcm_rate) == 0 && ffmpeg_decoder_output_rate (dec) != 0)
+  atomic_store (&pcm_rate, ffmpeg_decoder_output_rate (dec));
+return err;
+} // replay_aac()
+
+static int replay_mp3 (mpg123_handle *h, const uint8_t *data, size_t size)
+{
+unsigned char *audio;
+size_t decoded_bytes;
+off_t frame_offset;
+int err;
+if (mpg123_feed (h, data, size) != MPG123_OK)
+  return -1;
+while ((err = mpg123_decode_frame (h, &frame_offset, &audio, &decoded_bytes)) != MPG123_NEED_MORE) {
+  if (err == MPG123_NEW_FORMAT) {
+    long rate;
+    int channels, encoding;
+    mpg123_getformat (h, &rate, &channels, &encoding);
+    if (atomic_load (&pcm_rate) == 0)
+      atomic_store (&pcm_rate, rate);
+    }
+  else if (err != MPG123_OK) {
+    // a corrupt chunk: what is left of it is dropped and the next one is fed to the decoder afresh
+    pi_radio_log ("ERROR: mpg123_decode_frame() fails in the timeshift... %s\n", mpg123_plain_strerror (err));
+    mpg123_open_feed (h);
+    break;
+    }
+  else if (decoded_bytes > 0 && pcm_ring_write_all (&pcm_ring, audio, decoded_bytes / PCM_FRAME_BYTES) != 0)
+    return -1;
+  }
+return 0;
+} // replay_mp3()
+
+static void *replay_thread_main (void *arg)
+/* producer of the PCM ring while the station is shifted: decode the store
+from replay_pos, a record at a time, then wait for the next ones */
+{
+static const long rates[] = { 8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000 };
+struct mem_buffer seg = { NULL, 0, 0 };
+struct ffmpeg_decoder *dec = NULL;
+struct ts_demux demux;
+mpg123_handle *h;
+uint64_t pos = replay_pos, epoch = UINT64_MAX;
+int kind = 0, err, r;
+
+// stereo S16 whatever the stream, as in main()
+if ((h = mpg123_new (NULL, &err)) == NULL) {
+  pi_radio_log ("ERROR: mpg123_new() fails... %s\n", mpg123_plain_strerror (err));
+  return NULL;
+  }
+mpg123_format_none (h);
+for (r = 0; r < sizeof (rates) / sizeof (rates[0]); r++)
+  mpg123_format (h, rates[r], MPG123_STEREO, MPG123_ENC_SIGNED_16);
+
+while (!atomic_load (&replay_stop)) {
+  uint64_t start, end;
+  pthread_mutex_lock (&lock);
+  while (!atomic_load (&replay_stop) && pos >= head)
+    pthread_cond_wait (&appended, &lock);
+  if (atomic_load (&replay_stop) || mark_count == 0) {
+    pthread_mutex_unlock (&lock);
+    break;
+    }
+  if (pos < mark_at (0)->pos) {
+    pi_radio_log ("WARNING: the timeshift overwrote what was to be replayed; skipping %llu bytes\n",
+      (unsigned long long) (mark_at (0)->pos - pos));
+    pos = mark_at (0)->pos;
+    }
+  size_t i = mark_find (pos);
+  atomic_store (&replay_ms, base_ms + mark_at (i)->ms);
+  end = (i + 1 < mark_count) ? mark_at (i + 1)->pos : head;
+  int new_kind = epoch_kind (pos, &start);
+  if (start != epoch) {
+    // another station or a discontinuity: decoders afresh
+    epoch = start;
+    kind = new_kind;
+    mpg123_open_feed (h);
+    if (dec)
+      ffmpeg_decoder_free (dec);
+    if ((dec = ffmpeg_decoder_new ()) == NULL) {
+      pthread_mutex_unlock (&lock);
+      break;
+      }
+    ffmpeg_decoder_set_ring (dec, &pcm_ring);
+    ffmpeg_decoder_set_output_rate (dec, atomic_load (&pcm_rate));
+    ts_demux_init (&demux, replay_adts, dec);
+    }
+  // a segment whole; a stream in chunks, as the last record may still grow
+  size_t size = (size_t) (end - pos);
+  if (kind != TIMESHIFT_TS && size > TIMESHIFT_CHUNK)
+    size = TIMESHIFT_CHUNK;
+  if (seg.capacity < size) {
+    uint8_t *p = realloc (seg.data, size);
+    if (p == NULL) {
+      pthread_mutex_unlock (&lock);
+      break;
+      }
+    seg.data = p;
+    seg.capacity = size;
+    }
+  store_copy (pos, seg.data, size);
+  seg.size = size;
+  pthread_mutex_unlock (&lock);
+
+  pos += size;
+  if (kind == TIMESHIFT_TS)
+    err = replay_ts (dec, &demux, &seg);
+  else if (kind == TIMESHIFT_AAC)
+    err = replay_aac (dec, seg.data, seg.size);
+  else
+    err = replay_mp3 (h, seg.data, seg.size);
+  if (err < 0 && atomic_load (&replay_stop) == 0)
+    pi_radio_log ("ERROR: the timeshift replay cannot decode %zu bytes (%d)\n", size, err);
+  }
+free (seg.data);
+if (dec)
+  ffmpeg_decoder_free (dec);
+mpg123_delete (h);
+pi_radio_log ("timeshift replay thread exits\n");
+return NULL;
+} // replay_thread_main()
+
+int timeshift_replay (uint64_t ms)
+/* start replaying from the mark at ms (as monotonic_ms()), or the nearest
+after it; the caller has stopped every other producer of the PCM ring */
+{
+size_t i;
+timeshift_stop_replay ();
+pthread_mutex_lock (&lock);
+for (i = 0; i < mark_count && base_ms + mark_at (i)->ms < ms; i++)
+  ;
+if (mark_count == 0) {
+  pthread_mutex_unlock (&lock);
+  return -1;
+  }
+if (i == mark_count)
+  i = mark_count - 1; // the latest one
+replay_pos = mark_at (i)->pos;
+atomic_store (&replay_ms, base_ms + mark_at (i)->ms);
+pthread_mutex_unlock (&lock);
+atomic_store (&replay_stop, 0);
+int err = pthread_create (&replay_thread, NULL, replay_thread_main, NULL);
+if (err != 0) {
+  pi_radio_log ("ERROR: pthread_create() fails (%s)\n", strerror (err));
+  return -1;
+  }
+replay_started = 1;
+return 0;
+} // timeshift_replay()
+
+int timeshift_replaying (void)
+{
+return replay_started;
+} // timeshift_replaying()
+
+uint64_t timeshift_replay_ms (void)
+// the arrival of what the replay decodes, as monotonic_ms()
+{
+return atomic_load (&replay_ms);
+} // timeshift_replay_ms()
+
+void timeshift_stop_replay (void)
+// the PCM ring must be interrupted first, as the replay may wait for room in it
+{
+if (!replay_started)
+  return;
+pthread_mutex_lock (&lock);
+atomic_store (&replay_stop, 1);
+pthread_cond_broadcast (&appended);
+pthread_mutex_unlock (&lock);
+pthread_join (replay_thread, NULL);
+replay_started = 0;
+} // timeshift_stop_replay()
+
+void timeshift_close (void)
+{
+timeshift_stop_replay ();
+if (map)
+  munmap (map, map_size);
+if (fd >= 0)
+  close (fd);
+map = NULL;
+fd = -1;
+free (marks);
+marks = NULL;
+} // timeshift_close()
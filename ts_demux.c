@@ -0,0 +1,265 @@
+/*
+File: ts_demux.c
+Description: incremental MPEG-2 transport stream demuxer for HLS audio segments
+
+The bytes are fed as they come from the network. They are cut into 188-byte
+TS packets, the PAT and PMT locate the audio PID, the PES headers give the
+PTS, and the PES payload is cut into ADTS frames which are handed one by one
+to the callback (and then to the AAC decoder). Nothing waits for the end of
+the segment, so the first frame is available after a few TS packets.
+
+Only ADTS AAC (stream_type 0x0F) is handled here; for any other audio
+stream type the demuxer flags the segment as unsupported and the caller
+falls back to libavformat once the segment is complete.
+*/
+
+#include <string.h>
+
+#include "pi_radio.h"
+
+#define TS_SYNC_BYTE 0x47
+#define TS_PID_PAT 0x0000
+#define TS_STREAM_TYPE_ADTS_AAC 0x0F
+#define ADTS_HEADER_SIZE 7
+
+// ==============================================================
+
+void ts_demux_init (struct ts_demux *d, ts_frame_callback_t callback, void *userdata)
+{
+memset (d, 0, sizeof (*d));
+d->callback = callback;
+d->userdata = userdata;
+ts_demux_reset (d);
+} // ts_demux_init()
+
+void ts_demux_reset (struct ts_demux *d)
+// start a new segment; every segment carries its own PAT and PMT
+{
+d->packet_len = 0;
+d->pmt_pid = -1;
+d->audio_pid = -1;
+d->unsupported = 0;
+d->in_pes = 0;
+d->adts_len = 0;
+d->pts = TS_NO_PTS;
+} // ts_demux_reset()
+
+// ==============================================================
+
+static int emit_adts_frames (struct ts_demux *d)
+// hand every complete ADTS frame in adts[] to the callback
+{
+size_t pos = 0;
+int err = 0;
+while (d->adts_len - pos >= ADTS_HEADER_SIZE) {
+  const uint8_t *h = d->adts + pos;
+  // syncword 0xFFF
+  if (h[0] != 0xFF || (h[1] & 0xF0) != 0xF0) {
+    pos++;
+    continue;
+    }
+  size_t frame_length = ((h[3] & 0x03) << 11) | (h[4] << 3) | (h[5] >> 5);
+  if (frame_length < ADTS_HEADER_SIZE) {
+    pos++;
+    continue;
+    }
+  if (d->adts_len - pos < frame_length)
+    break; // wait for the rest of the frame
+  uint64_t start = metrics_now_us ();
+  err = d->callback (h, frame_length, d->pts, d->userdata);
+  d->callback_us += metrics_now_us () - start;
+  // only the first frame of a PES carries its PTS
+  d->pts = TS_NO_PTS;
+  pos += frame_length;
+  if (err != 0)
+    break;
+  }
+d->adts_len -= pos;
+memmove (d->adts, d->adts + pos, d->adts_len);
+return err;
+} // emit_adts_frames()
+
+static int add_pes_payload (struct ts_demux *d, const uint8_t *data, size_t size)
+{
+while (size > 0) {
+  size_t n = sizeof (d->adts) - d->adts_len;
+  if (n > size)
+    n = size;
+  memcpy (d->adts + d->adts_len, data, n);
+  d->adts_len += n;
+  data += n;
+  size -= n;
+  int err = emit_adts_frames (d);
+  if (err != 0)
+    return err;
+  if (d->adts_len == sizeof (d->adts)) {
+    // cannot be a valid ADTS stream as a frame is at most 8191 bytes
+    pi_radio_log ("ts_demux: no ADTS frame in %zu bytes; dropping them\n", d->adts_len);
+    d->adts_len = 0;
+    }
+  }
+return 0;
+} // add_pes_payload()
+
+// ==============================================================
+
+static const uint8_t *section_start (const uint8_t *payload, size_t size, int unit_start, size_t *section_size)
+/* skip the pointer field of a PSI payload and return the section with its length
+PAT and PMT of HLS segments fit in one TS packet, so sections split across packets are not handled */
+{
+if (!unit_start || size < 1 || 1 + (size_t) payload[0] + 3 > size)
+  return NULL;
+const uint8_t *s = payload + 1 + payload[0];
+size -= 1 + payload[0];
+size_t length = 3 + (((s[1] & 0x0F) << 8) | s[2]);
+if (length > size || length < 12)
+  return NULL;
+*section_size = length - 4; // without the CRC
+return s;
+} // section_start()
+
+static void parse_pat (struct ts_demux *d, const uint8_t *payload, size_t size, int unit_start)
+{
+size_t n;
+const uint8_t *s = section_start (payload, size, unit_start, &n);
+if (s == NULL || s[0] != 0x00)
+  return;
+size_t i;
+for (i = 8; i + 4 <= n; i += 4) {
+  int program_number = (s[i] << 8) | s[i+1];
+  if (program_number != 0) { // 0 is the network PID
+    d->pmt_pid = ((s[i+2] & 0x1F) << 8) | s[i+3];
+    return;
+    }
+  }
+} // parse_pat()
+
+static void parse_pmt (struct ts_demux *d, const uint8_t *payload, size_t size, int unit_start)
+{
+size_t n;
+const uint8_t *s = section_start (payload, size, unit_start, &n);
+if (s == NULL || s[0] != 0x02)
+  return;
+size_t i = 12 + (((s[10] & 0x0F) << 8) | s[11]);
+int other_audio = 0;
+for (; i + 5 <= n; i += 5 + (((s[i+3] & 0x0F) << 8) | s[i+4])) {
+  int stream_type = s[i];
+  int pid = ((s[i+1] & 0x1F) << 8) | s[i+2];
+  if (stream_type == TS_STREAM_TYPE_ADTS_AAC) {
+    if (d->audio_pid != pid)
+      pi_radio_log ("ts_demux: ADTS AAC on PID %d\n", pid);
+    d->audio_pid = pid;
+    d->unsupported = 0;
+    return;
+    }
+  // MPEG-1/2 audio, AC-3, E-AC-3, LATM AAC
+  if (stream_type == 0x03 || stream_type == 0x04 || stream_type == 0x81 ||
+      stream_type == 0x87 || stream_type == 0x11)
+    other_audio = stream_type;
+  }
+if (other_audio) {
+  pi_radio_log ("ts_demux: audio stream type 0x%02x is left to libavformat\n", other_audio);
+  d->unsupported = 1;
+  }
+} // parse_pmt()
+
+static int parse_pes (struct ts_demux *d, const uint8_t *payload, size_t size, int unit_start)
+{
+if (unit_start) {
+  // packet_start_code_prefix, stream_id, PES_packet_length, two flag bytes, PES_header_data_length
+  if (size < 9 || payload[0] != 0 || payload[1] != 0 || payload[2] != 1) {
+    d->in_pes = 0;
+    return 0;
+    }
+  size_t header_size = 9 + payload[8];
+  if (header_size > size) {
+    d->in_pes = 0;
+    return 0;
+    }
+  if ((payload[7] & 0x80) && payload[8] >= 5) {
+    const uint8_t *p = payload + 9;
+    d->pts = ((int64_t) (p[0] & 0x0E) << 29) | (p[1] << 22) | ((p[2] & 0xFE) << 14) |
+             (p[3] << 7) | (p[4] >> 1);
+    }
+  d->in_pes = 1;
+  payload += header_size;
+  size -= header_size;
+  }
+if (!d->in_pes)
+  return 0;
+return add_pes_payload (d, payload, size);
+} // parse_pes()
+
+static int parse_packet (struct ts_demux *d, const uint8_t *p)
+{
+int unit_start = p[1] & 0x40;
+int pid = ((p[1] & 0x1F) << 8) | p[2];
+int adaptation = (p[3] >> 4) & 0x03;
+size_t offset = 4;
+
+if (p[1] & 0x80) // transport_error_indicator
+  return 0;
+if (adaptation & 0x02)
+  offset += 1 + p[4];
+if (!(adaptation & 0x01) || offset >= TS_PACKET_SIZE)
+  return 0; // no payload
+
+if (pid == TS_PID_PAT)
+  parse_pat (d, p + offset, TS_PACKET_SIZE - offset, unit_start);
+else if (pid == d->pmt_pid)
+  parse_pmt (d, p + offset, TS_PACKET_SIZE - offset, unit_start);
+else if (pid == d->audio_pid)
+  return parse_pes (d, p + offset, TS_PACKET_SIZE - offset, unit_start);
+return 0;
+} // parse_packet()
+
+// ==============================================================
+
+static int feed (struct ts_demux *d, const uint8_t *data, size_t size)
+{
+int err;
+while (size > 0) {
+  if (d->packet_len == 0) {
+    // look for the sync byte, skipping garbage in between
+    const uint8_t *sync = memchr (data, TS_SYNC_BYTE, size);
+    if (sync == NULL)
+      return 0;
+    size -= sync - data;
+    data = sync;
+    if (size >= TS_PACKET_SIZE) {
+      // the common case: parse the packet in place
+      if ((err = parse_packet (d, data)) != 0)
+        return err;
+      data += TS_PACKET_SIZE;
+      size -= TS_PACKET_SIZE;
+      continue;
+      }
+    }
+  // keep a packet split between two calls
+  size_t n = TS_PACKET_SIZE - d->packet_len;
+  if (n > size)
+    n = size;
+  memcpy (d->packet + d->packet_len, data, n);
+  d->packet_len += n;
+  data += n;
+  size -= n;
+  if (d->packet_len == TS_PACKET_SIZE) {
+    d->packet_len = 0;
+    if ((err = parse_packet (d, d->packet)) != 0)
+      return err;
+    }
+  }
+return 0;
+} // feed()
+
+int ts_demux_feed (struct ts_demux *d, const uint8_t *data, size_t size)
+/* feed any number of bytes of the segment
+return 0, or the non-zero value returned by the callback.
+The time of the demuxing itself goes to the metrics, that of the callback (the decoding) not */
+{
+uint64_t start = metrics_now_us ();
+d->callback_us = 0;
+int err = feed (d, data, size);
+metrics_observe (METRICS_DEMUX, metrics_now_us () - start - d->callback_us);
+return err;
+} // ts_demux_feed()